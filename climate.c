@@ -4,12 +4,111 @@
  * Performs analysis on climate data provided by the
  * National Oceanic and Atmospheric Administration (NOAA).
  *
- * Input:    Tab-delimited file(s) to analyze.
+ * Input:    Tab-delimited file(s) to analyze ("-" for standard input).
  * Output:   Summary information about the data.
  *
- * Compile:  run make
+ * Compile:  run make (link with -lm -pthread)
  *
  * Example Run:      ./climate data_tn.tdv data_wa.tdv
+ *                   zcat data.tdv.gz | ./climate -
+ *
+ * Options (given before the files):
+ *      --histograms            print per-state histograms after each summary
+ *      --histograms=FILE       export per-state histograms as CSV
+ *      --correlate=METRIC      print the cross-state correlation matrix of
+ *                              hourly METRIC anomalies (temperature, humidity,
+ *                              cloudcover, pressure, snow, lightning)
+ *      --climatology-save=FILE save the (state, day-of-year, hour) normals
+ *                              of the input files to FILE
+ *      --climatology=FILE      report daily departures from the normals in
+ *                              FILE for the input records in --period
+ *      --period=FROM:TO        target dates, e.g. 2015-02-01:2015-02-28
+ *      --rolling               print rolling 24h lightning / 7d temperature
+ *                              peaks per state
+ *      --rolling=FILE          export the hourly rolling values as CSV
+ *      --storm-cells           cluster lightning strikes into storm cells
+ *      --storm-precision=N     geohash length of the storm-cell grid (1-8,
+ *                              default 4, about 39 x 20 km)
+ *      --snow-extent           print daily snow-cover extent (distinct
+ *                              locations) per state, limited to --period
+ *      --snow-extent=FILE      also export the daily extents as CSV
+ *      --where=COND[,COND]     only use records matching every COND, where
+ *                              COND is snow=0|1 or lightning=0|1
+ *      --cache-write=FILE      write the (selected) records as a binary
+ *                              columnar cache; cache files given as input
+ *                              are recognized and read instead of TDV
+ *      --series-store=FILE     write per-location temperature/pressure
+ *                              series, Gorilla-compressed, to FILE
+ *      --series-read=FILE:GEOHASH
+ *                              print one location's series from FILE (no
+ *                              input files needed)
+ *      --history-store=FILE    write every record grouped by location and
+ *                              sorted by time, behind a geohash directory
+ *      --history=FILE:GEOHASH  print one location's records from a history
+ *                              store (no input files needed)
+ *      --heatmap=METRIC:FILE   rasterize the mean of METRIC per lat/lon
+ *                              cell (e.g. temperature, or lightning/snow
+ *                              for their frequency) to FILE: an 8-bit PGM
+ *                              if FILE ends in .pgm, raw float32 otherwise
+ *      --grid=WxH              heatmap size in cells (default 512x512)
+ *      --bbox=S,W,N,E          heatmap bounds in degrees (default: data)
+ *      --threads=N             worker threads (default: all cores)
+ *      --unordered             merge the summaries of piped input's blocks as
+ *                              they are parsed rather than in input order
+ *      --regions=FILE          summarize records by the polygon regions in
+ *                              FILE, one per line: NAME<tab>WKT, where WKT
+ *                              is a POLYGON or MULTIPOLYGON in lon/lat
+ *      --nearest=LAT,LON[,K]   print the K (default 5) reporting locations
+ *                              nearest to LAT,LON with their aggregates
+ *      --within=S,W,N,E        only use records located inside the box
+ *      --between=FROM:TO       only use records from these (UTC) dates,
+ *                              optionally with hours (YYYY-MM-DDTHH)
+ *      --cache-order=ORDER     sort each state's cached records by location
+ *                              (morton: Z-order of the geohash, then time)
+ *                              or by time before writing the blocks
+ *      --benchmark             compare bounding-box and 7-day queries on
+ *                              Morton- and time-ordered caches of the input
+ *                              and time the geohash decode/encode kernels;
+ *                              also checks that the series codec round-trips
+ *                              its delta-of-delta bucket edges
+ *      --profile-data          only run range and format checks on every
+ *                              column, reporting violations per file (with
+ *                              sample byte offsets) and per state; exits
+ *                              with failure if there are any
+ *      --arrow=FILE            export the parsed columns (state and geohash
+ *                              dictionary-encoded, temperature in F) as an
+ *                              Arrow IPC file, readable as Feather V2
+ *      --parquet=FILE          export the parsed columns as a Parquet file
+ *                              (dictionary-encoded where smaller, with
+ *                              min/max statistics per column chunk)
+ *      --parquet-codec=CODEC   compress the Parquet pages with snappy or
+ *                              none (default)
+ *      --lsm=DIR               also ingest the records into the log-structured
+ *                              store in DIR (write-ahead log, sorted segments,
+ *                              background compaction)
+ *      --retain-raw=DAYS       with --lsm, keep the records of the last DAYS
+ *                              days (before the newest one no later than a
+ *                              day from now) and only hourly and daily
+ *                              rollups of older ones
+ *      --retain-hourly=MONTHS  keep hourly rollups for MONTHS (of 30 days,
+ *                              default 3) before the raw records, and only
+ *                              daily rollups of older ones
+ *      --lsm-query=DIR[:STATE] analyze the records of the store in DIR (of
+ *                              STATE, in --between) instead of input files
+ *      --upsert                treat a record with the timestamp and geohash
+ *                              of an earlier one as its correction, replacing
+ *                              it in the state summaries, hourly series,
+ *                              climatology, regions and --nearest; not with
+ *                              the exports, stores, --heatmap, --snow-extent,
+ *                              --storm-cells, --stream or --queries
+ *      --stream=FILE           bucket the records by event time into hourly
+ *                              windows per state, writing each window as CSV
+ *                              once the watermark passes it
+ *      --lateness=MINUTES      how far behind the newest record the watermark
+ *                              trails (default 60); later records are dropped
+ *      --queries=FILE          also evaluate each line of FILE (--where,
+ *                              --within, --between, --group-by=KEYS and
+ *                              --output=FILE) in the same pass over the input
  *
  *
  * Opening file: data_tn.tdv
@@ -20,9 +119,9 @@
  * Average Humidity: 49.4%
  * Average Temperature: 58.3F
  * Max Temperature: 110.4F 
- * Max Temperatuer on: Mon Aug  3 11:00:00 2015
+ * Max Temperatuer on: Mon Aug  3 13:00:00 2015 CDT
  * Min Temperature: -11.1F
- * Min Temperature on: Fri Feb 20 04:00:00 2015
+ * Min Temperature on: Fri Feb 20 06:00:00 2015 CST
  * Lightning Strikes: 781
  * Records with Snow Cover: 107
  * Average Cloud Cover: 53.0%
@@ -31,9 +130,9 @@
  * Average Humidity: 61.3%
  * Average Temperature: 52.9F
  * Max Temperature: 125.7F
- * Max Temperature on: Sun Jun 28 17:00:00 2015
+ * Max Temperature on: Sun Jun 28 17:00:00 2015 PDT
  * Min Temperature: -18.7F 
- * Min Temperature on: Wed Dec 30 04:00:00 2015
+ * Min Temperature on: Wed Dec 30 04:00:00 2015 PST
  * Lightning Strikes: 1190
  * Records with Snow Cover: 1383
  * Average Cloud Cover: 54.5%
@@ -63,14 +162,322 @@
  *      surface temperature (Kelvin)
  */
 
+/* getline, strnlen, strdup, mkstemp and clock_gettime under -std=c11. */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #define NUM_STATES 50
 
+/* M_PI is not part of C11 or POSIX. */
+#define PI 3.14159265358979323846
+
+/* Fixed-bin histograms: 1F temperature bins, 5% humidity and cloud cover bins.
+ * Values outside the range are clamped into the first/last bin. */
+#define TEMP_HIST_MIN -60.0f
+#define TEMP_HIST_BINS 200
+#define PERCENT_HIST_WIDTH 5.0f
+#define PERCENT_HIST_BINS 20
+
+/* Number of parsed records buffered before binning them as a batch. */
+#define BATCH_SIZE 256
+
+/* Earliest timestamp the time-indexed analyses accept (1900-01-01). */
+#define EARLIEST_TIMESTAMP (-2208988800L)
+
+/* Column block size (in doubles) used by the blocked matrix product. */
+#define GEMM_BLOCK 512
+
+/* Climatology table dimensions: (state slot, day of year, hour of day). */
+#define CLIMATOLOGY_DAYS 366
+#define CLIMATOLOGY_HOURS 24
+#define CLIMATOLOGY_MAGIC "CLIMNORM"
+#define CLIMATOLOGY_VERSION 2
+
+/* Rolling window lengths in hours. */
+#define SHORT_WINDOW_HOURS 24
+#define LONG_WINDOW_HOURS (7 * 24)
+
+/* Geohash length (and its bits, half of them per axis), and default/maximum
+ * length of the storm-cell grid. */
+#define GEOHASH_LENGTH 12
+#define GEOHASH_BITS (5 * GEOHASH_LENGTH)
+#define GEOHASH_AXIS_BITS (GEOHASH_BITS / 2)
+#define STORM_PRECISION 4
+#define MAX_STORM_PRECISION 8
+
+/* Roaring bitmap containers hold 2^16 values; sparse ones are sorted
+ * arrays, dense ones (more than ROARING_ARRAY_MAX values) are bitsets. */
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITSET_WORDS 1024
+
+/* Years covered by the precomputed DST transition tables. */
+#define TZ_FIRST_YEAR 1970
+#define TZ_LAST_YEAR 2037
+#define TZ_YEARS (TZ_LAST_YEAR - TZ_FIRST_YEAR + 1)
+
+/* Binary columnar cache: records per block (a multiple of 64 so the snow
+ * and lightning bitmaps are whole words). */
+#define CACHE_MAGIC "CLIMCACH"
+#define CACHE_VERSION 2
+#define CACHE_BLOCK_RECORDS 4096
+#define CACHE_BLOCK_WORDS (CACHE_BLOCK_RECORDS / 64)
+
+/* Queries per query type of --benchmark, the size of their bounding boxes
+ * as a fraction of the data extent, and the length of their time ranges. */
+#define BENCHMARK_QUERIES 200
+#define BENCHMARK_BOX_FRACTION 0.1
+#define BENCHMARK_RANGE_DAYS 7
+
+/* Per-location series store (Gorilla-compressed). */
+#define SERIES_MAGIC "CLIMGORL"
+#define SERIES_VERSION 1
+
+/* Location history store (series-major layout). */
+#define HISTORY_MAGIC "CLIMHIST"
+#define HISTORY_VERSION 1
+
+/* Default heatmap size in cells. */
+#define HEATMAP_WIDTH 512
+#define HEATMAP_HEIGHT 512
+
+/* Region grid index: cells per side, and maximum region name length. */
+#define REGION_GRID 64
+#define REGION_NAME_LENGTH 64
+
+/* Default number of neighbors for --nearest, and mean earth radius. */
+#define NEAREST_K 5
+#define EARTH_RADIUS_KM 6371.0
+
+/* Data-quality profiler: lines per vectorized batch (one bit each in the
+ * violation masks), sample offsets kept per check, longest line read, and
+ * fields per TDV line. */
+#define PROFILE_BATCH 64
+#define PROFILE_SAMPLES 3
+#define PROFILE_LINE_SIZE 256
+#define PROFILE_FIELDS 9
+
+/* Arrow IPC (Feather V2) export: magic, rows per record batch, alignment
+ * of the body buffers, and the metadata version, message header and type
+ * IDs of the Arrow flatbuffer schema that are used. */
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_BATCH_ROWS 65536
+#define ARROW_ALIGNMENT 64
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_DICTIONARY_BATCH 2
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+#define ARROW_TYPE_TIMESTAMP 10
+
+/* Most fields of a flatbuffer table written here. */
+#define FB_MAX_FIELDS 8
+
+/* Parquet export: magic, rows per row group (each column chunk is one
+ * page), and the parquet.thrift enum values that are used. */
+#define PARQUET_MAGIC "PAR1"
+#define PARQUET_ROW_GROUP_ROWS (1 << 20)
+#define PARQUET_BOOLEAN 0
+#define PARQUET_INT64 2
+#define PARQUET_DOUBLE 5
+#define PARQUET_BYTE_ARRAY 6
+#define PARQUET_REQUIRED 0
+#define PARQUET_CONVERTED_UTF8 0
+#define PARQUET_CONVERTED_TIMESTAMP_MILLIS 9
+#define PARQUET_PLAIN 0
+#define PARQUET_RLE 3
+#define PARQUET_RLE_DICTIONARY 8
+#define PARQUET_DATA_PAGE 0
+#define PARQUET_DICTIONARY_PAGE 2
+#define PARQUET_CODEC_NONE 0
+#define PARQUET_CODEC_SNAPPY 1
+
+/* Log-structured store: segment magic and version, write buffer size (one
+ * level-0 segment), entries read per chunk, records between log syncs,
+ * segments merged per compaction and the deepest level. */
+#define LSM_MAGIC "CLIMLSM1"
+#define LSM_VERSION 2
+#define LSM_BUFFER_ENTRIES 65536
+#define LSM_READ_ENTRIES 1024
+#define LSM_SYNC_ENTRIES 4096
+#define LSM_MERGE_WIDTH 4
+#define LSM_MAX_LEVELS 16
+
+/* Retention tiers of the store: rollup file magic, tier IDs and the
+ * default months of hourly rollups. */
+#define LSM_ROLLUP_MAGIC "CLIMROLL"
+#define LSM_TIER_HOURLY 1
+#define LSM_TIER_DAILY 2
+#define LSM_RETAIN_HOURLY_MONTHS 3
+
+/* Default allowed lateness of --stream, in minutes. */
+#define STREAM_LATENESS_MINUTES 60
+
+/* Piped input is parsed in blocks of PIPE_BLOCK_SIZE bytes, with up to
+ * PIPE_BLOCKS_PER_THREAD blocks per parser thread read ahead. */
+#define PIPE_BLOCK_SIZE (4 << 20)
+#define PIPE_BLOCKS_PER_THREAD 2
+
+/* --queries: longest query line, and the default and largest geohash
+ * prefix length of a group key. */
+#define QUERY_LINE_LENGTH 1024
+#define QUERY_GEOHASH_PRECISION 5
+#define QUERY_MAX_GEOHASH_PRECISION 8
+
+/* Group tables of --queries: most groups kept in an array searched in
+ * order, most kept in one hashed table, and the radix partitions (by the
+ * top bits of the key hash) beyond that. */
+#define GROUP_ARRAY_MAX 16
+#define GROUP_HASH_MAX (1 << 14)
+#define GROUP_PARTITION_BITS 6
+#define GROUP_PARTITIONS (1 << GROUP_PARTITION_BITS)
+
+/* Thrift compact protocol field types, and the deepest struct nesting of
+ * the Parquet metadata. */
+#define THRIFT_TRUE 1
+#define THRIFT_FALSE 2
+#define THRIFT_I32 5
+#define THRIFT_I64 6
+#define THRIFT_BINARY 8
+#define THRIFT_LIST 9
+#define THRIFT_STRUCT 12
+#define THRIFT_MAX_DEPTH 8
+
+/* Snappy compression: input fragment size (so offsets fit in 16 bits) and
+ * hash table size in bits. */
+#define SNAPPY_FRAGMENT 65536
+#define SNAPPY_HASH_BITS 14
+
+/* Per-record metrics that can be tracked as hourly series. */
+enum metric {
+    METRIC_TEMPERATURE,
+    METRIC_HUMIDITY,
+    METRIC_CLOUDCOVER,
+    METRIC_PRESSURE,
+    METRIC_SNOW,
+    METRIC_LIGHTNING,
+    NUM_METRICS
+};
+
+const char *metric_names[NUM_METRICS] = {
+    "temperature", "humidity", "cloudcover", "pressure", "snow", "lightning"
+};
+
+/* Columns of the Arrow and Parquet exports, in schema order. The float64
+ * columns (humidity, cloud cover, pressure and temperature in F) are
+ * buffered together, snow and lightning are booleans. */
+enum column {
+    COLUMN_STATE,
+    COLUMN_TIMESTAMP,
+    COLUMN_GEOHASH,
+    COLUMN_HUMIDITY,
+    COLUMN_SNOW,
+    COLUMN_CLOUDCOVER,
+    COLUMN_LIGHTNING,
+    COLUMN_PRESSURE,
+    COLUMN_TEMPERATURE,
+    NUM_COLUMNS
+};
+
+#define NUM_VALUE_COLUMNS 4
+
+const char *column_names[NUM_COLUMNS] = {
+    "state", "timestamp", "geohash", "humidity", "snow", "cloudcover", "lightning", "pressure", "temperature"
+};
+
+/* Checks of --profile-data. The numeric checks come last, in the order of
+ * their TDV columns. */
+enum quality_check {
+    CHECK_FORMAT,
+    CHECK_STATE,
+    CHECK_GEOHASH,
+    CHECK_TIMESTAMP,
+    CHECK_HUMIDITY,
+    CHECK_SNOW,
+    CHECK_CLOUDCOVER,
+    CHECK_LIGHTNING,
+    CHECK_PRESSURE,
+    CHECK_TEMPERATURE,
+    NUM_CHECKS
+};
+
+const char *check_names[NUM_CHECKS] = {
+    "malformed line", "unknown state", "malformed geohash", "timestamp invalid or out of range",
+    "humidity invalid or out of range", "snow not 0 or 1", "cloud cover invalid or out of range",
+    "lightning not 0 or 1", "pressure invalid or out of range", "temperature invalid or out of range"
+};
+
+/* Valid ranges of the numeric columns: timestamp in seconds (up to a day
+ * after the profiler starts), percentages, pressure in Pa and temperature
+ * in K. Snow and lightning must be 0 or 1. */
+double profile_ranges[NUM_CHECKS - CHECK_TIMESTAMP][2] = {
+    {1, 0}, {0, 100}, {0, 1}, {0, 100}, {0, 1}, {30000, 110000}, {180, 340}
+};
+
+/* One container of a roaring bitmap: the values whose high 16 bits are
+ * `key`, as a sorted array of low bits or as a bitset. */
+struct roaring_container {
+    uint16_t key;
+    int cardinality;
+    int capacity;
+    uint16_t *array;
+    uint64_t *bitset;
+};
+
+/* Compressed bitmap of 32-bit IDs, containers sorted by key. */
+struct roaring {
+    int num_containers;
+    int capacity;
+    struct roaring_container *containers;
+};
+
+/* Per-day bitmaps of the locations with snow cover, for the days
+ * [first_day, first_day + num_days) since 1970. */
+struct snow_days {
+    long first_day;
+    int num_days;
+    int capacity;
+    struct roaring **days;
+};
+
+/* Sum of each metric over the records of one hour, and the hour's
+ * temperature extremes (valid when count > 0). */
+struct hour_bucket {
+    unsigned long count;
+    double sum[NUM_METRICS];
+    double max_temperature;
+    double min_temperature;
+};
+
+/* Hourly buckets covering [first_hour, first_hour + num_hours), where an hour
+ * is a UNIX timestamp / 3600 rounded down. Grows in both directions as records arrive. */
+struct hourly_series {
+    long first_hour;
+    long num_hours;
+    long capacity;
+    struct hour_bucket *buckets;
+};
+
 /* TODO: Add elements to the climate_info struct as necessary. */
 struct climate_info {
     char code[3];
@@ -84,10 +491,1095 @@ struct climate_info {
     unsigned long num_lightning;
     unsigned long num_snowcover;
     long double sum_cloudcover;
+    unsigned long temp_hist[TEMP_HIST_BINS];
+    unsigned long humidity_hist[PERCENT_HIST_BINS];
+    unsigned long cloudcover_hist[PERCENT_HIST_BINS];
+    struct hourly_series *hourly;
+    struct snow_days *snow;
+};
+
+/* One parsed TDV line (timestamp in seconds, temperature in F). */
+struct record {
+    char code[3];
+    long timestamp;
+    char geohash[GEOHASH_LENGTH + 1];
+    double humidity;
+    double snow;
+    double cloudcover;
+    double lightning;
+    double pressure;
+    double temperature;
+};
+
+/* Columns of parsed records waiting to be binned into the histograms, and
+ * the records themselves when --queries fans them out. */
+struct parse_batch {
+    int count;
+    int state_index[BATCH_SIZE];
+    float temperature[BATCH_SIZE];
+    float humidity[BATCH_SIZE];
+    float cloudcover[BATCH_SIZE];
+    struct record records[BATCH_SIZE];
+};
+
+/* Fixed-length window of hourly values kept in a ring buffer, with the sum
+ * of the window updated as values enter and leave. */
+struct ring_window {
+    int size;
+    int pos;
+    double sum;
+    double *values;
+};
+
+/* One element of a max/min queue stack: the value's extremes and the
+ * extremes of everything below it on the stack. */
+struct extreme_entry {
+    double max;
+    double min;
+    double stack_max;
+    double stack_min;
+};
+
+/* FIFO of hourly extremes built from two stacks, giving the max/min of
+ * the whole window in amortized constant time per hour. */
+struct extreme_queue {
+    int capacity;
+    int in_count;
+    int out_count;
+    struct extreme_entry *in;
+    struct extreme_entry *out;
+};
+
+/* A lightning-positive record: its state, hour, position and grid cell. */
+struct strike {
+    int state_index;
+    long timestamp;
+    double latitude;
+    double longitude;
+    uint32_t cell_x;
+    uint32_t cell_y;
+};
+
+/* Open-addressing map from (state, hour, grid cell) to the first strike
+ * seen there. */
+struct cell_map_entry {
+    long hour;
+    int state_index;
+    uint32_t cell_x;
+    uint32_t cell_y;
+    int strike;
+};
+
+struct cell_map {
+    size_t capacity;
+    struct cell_map_entry *entries;
+};
+
+/* Header of a cache block. Every block holds records of one state; the
+ * popcounts of its snow and lightning bitmaps, its time range and its
+ * spatial extent (zone map, rounded outward to float) are precomputed. The
+ * header is followed by the columns: timestamps (int64),
+ * geohashes (12 chars, not terminated), humidity, cloud cover, pressure and
+ * temperature (double, F, as parsed), then the snow and lightning bitmaps (one bit per
+ * record, 64 records per uint64 word). */
+struct cache_block_header {
+    char code[4];
+    uint32_t num_records;
+    uint32_t num_snow;
+    uint32_t num_lightning;
+    int64_t min_timestamp;
+    int64_t max_timestamp;
+    float min_latitude;
+    float max_latitude;
+    float min_longitude;
+    float max_longitude;
+};
+
+/* A cache block in memory, while it is being filled or after reading. */
+struct cache_block {
+    struct cache_block_header header;
+    int64_t timestamp[CACHE_BLOCK_RECORDS];
+    char geohash[CACHE_BLOCK_RECORDS][GEOHASH_LENGTH];
+    double humidity[CACHE_BLOCK_RECORDS];
+    double cloudcover[CACHE_BLOCK_RECORDS];
+    double pressure[CACHE_BLOCK_RECORDS];
+    double temperature[CACHE_BLOCK_RECORDS];
+    uint64_t snow[CACHE_BLOCK_WORDS];
+    uint64_t lightning[CACHE_BLOCK_WORDS];
+};
+
+/* Record order within each state's blocks (--cache-order). */
+enum cache_order {
+    CACHE_ORDER_ARRIVAL,
+    CACHE_ORDER_MORTON,
+    CACHE_ORDER_TIME,
+    NUM_CACHE_ORDERS
+};
+
+/* A record held back by an ordered cache writer, with its sort key. */
+struct cache_row {
+    uint64_t key;
+    struct record rec;
+};
+
+/* Cache file being written, with one partly filled block per state. An
+ * ordered writer holds every state's rows until it is closed. */
+struct cache_writer {
+    FILE *out;
+    int failed;
+    int order;
+    struct cache_block *pending[NUM_STATES];
+    struct cache_row *rows[NUM_STATES];
+    size_t num_rows[NUM_STATES];
+    size_t rows_capacity[NUM_STATES];
+};
+
+/* Record selection of --where, --within and --between. snow and lightning
+ * are -1 when not filtered; within is S,W,N,E in degrees and the time
+ * range is [from, to) in seconds. */
+struct record_filter {
+    int snow;
+    int lightning;
+    int has_within;
+    double within[4];
+    int has_between;
+    long from;
+    long to;
+};
+
+/* Lines and violations of one file or state, with the byte offsets of the
+ * first PROFILE_SAMPLES lines failing each check (kept for files). */
+struct quality_counts {
+    unsigned long lines;
+    unsigned long violations[NUM_CHECKS];
+    long samples[NUM_CHECKS][PROFILE_SAMPLES];
+};
+
+/* Lines being profiled, as columns. Numbers that do not parse are NaN and
+ * fail their range check; violations hold one bit per line and check. */
+struct profile_batch {
+    int count;
+    long offset[PROFILE_BATCH];
+    int slot[PROFILE_BATCH];
+    double values[NUM_CHECKS - CHECK_TIMESTAMP][PROFILE_BATCH];
+    uint64_t violations[NUM_CHECKS];
+};
+
+/* Flatbuffer being built back to front, as the flatbuffers library does:
+ * objects are prepended to the end of data, and positions are counted from
+ * the end, so they stay valid as the buffer grows. Children are prepended
+ * before the tables that refer to them. */
+struct flatbuffer {
+    uint8_t *data;
+    size_t capacity;
+    size_t size;
+    size_t max_align;
+    size_t table_start;
+    size_t fields[FB_MAX_FIELDS];
+    int num_fields;
+};
+
+/* Location of an IPC message in the file (the footer's Block struct). */
+struct arrow_block {
+    int64_t offset;
+    int32_t metadata_length;
+    int32_t padding;
+    int64_t body_length;
+};
+
+/* Arrow IPC file being written, with the columns of the pending batch. */
+struct arrow_writer {
+    FILE *out;
+    int failed;
+    int64_t position;
+    int count;
+    int8_t *state;
+    int64_t *timestamp;
+    int32_t *geohash;
+    double *values;
+    uint8_t snow[ARROW_BATCH_ROWS / 8];
+    uint8_t lightning[ARROW_BATCH_ROWS / 8];
+    struct arrow_block schema_block;
+    struct arrow_block *batches;
+    int num_batches;
+    int batches_capacity;
+};
+
+/* Output of the Thrift compact protocol, with the last field ID written
+ * in each open struct (field IDs are written as deltas). */
+struct thrift_buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int16_t last_id[THRIFT_MAX_DEPTH];
+    int depth;
+};
+
+/* Column chunk of a written row group, as described in the footer. */
+struct parquet_chunk {
+    int64_t num_values;
+    int64_t uncompressed_size;
+    int64_t compressed_size;
+    int64_t data_page_offset;
+    int64_t dictionary_page_offset;
+    int encodings[4];
+    int num_encodings;
+    uint8_t min[GEOHASH_LENGTH + 4];
+    uint8_t max[GEOHASH_LENGTH + 4];
+    int min_length;
+    int max_length;
+};
+
+struct parquet_row_group {
+    int64_t num_rows;
+    int64_t file_offset;
+    struct parquet_chunk chunks[NUM_COLUMNS];
+};
+
+/* Parquet file being written, with the columns of the pending row group. */
+struct parquet_writer {
+    FILE *out;
+    int codec;
+    int failed;
+    int64_t position;
+    int count;
+    int64_t num_rows;
+    uint16_t *state;
+    int64_t *timestamp;
+    uint32_t *geohash;
+    uint8_t *snow;
+    uint8_t *lightning;
+    double *values;
+    struct parquet_row_group *row_groups;
+    int num_row_groups;
+    int row_groups_capacity;
+};
+
+/* Record of the log-structured store, as logged and in segments (64 bytes,
+ * no padding). The sequence number orders records that arrived in the same
+ * second. */
+struct lsm_entry {
+    int64_t timestamp;
+    uint64_t sequence;
+    char code[2];
+    char geohash[GEOHASH_LENGTH];
+    uint8_t snow;
+    uint8_t lightning;
+    double humidity;
+    double cloudcover;
+    double pressure;
+    double temperature;
+};
+
+/* Segment file header, followed by its entries in compare_lsm_entries
+ * order. The time range and state mask let queries skip the segment; the
+ * newest in-range timestamp (of num_in_range entries) sets the retention
+ * cutoff, so a corrupt far-future time can't expire the real records. */
+struct lsm_segment_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t level;
+    uint64_t num_entries;
+    int64_t min_timestamp;
+    int64_t max_timestamp;
+    uint64_t num_in_range;
+    int64_t max_in_range;
+    uint64_t max_sequence;
+    uint64_t states;
+};
+
+struct lsm_segment {
+    uint32_t id;
+    int merging;
+    struct lsm_segment_header header;
+};
+
+/* Summary of a state's records in one hour or day: the metrics of
+ * print_report, histograms included, mergeable with merge_climate_info. */
+struct lsm_rollup {
+    int64_t start;
+    char code[2];
+    uint32_t num_records;
+    uint32_t num_snowcover;
+    uint32_t num_lightning;
+    double sum_temperature;
+    double sum_humidity;
+    double sum_cloudcover;
+    double max_temperature;
+    int64_t max_temp_date;
+    double min_temperature;
+    int64_t min_temp_date;
+    uint32_t temp_hist[TEMP_HIST_BINS];
+    uint32_t humidity_hist[PERCENT_HIST_BINS];
+    uint32_t cloudcover_hist[PERCENT_HIST_BINS];
+};
+
+/* Rollup file header, followed by the rollups sorted by start and state.
+ * Every record before cutoff when the file was written is in the rollups
+ * (later, late records may be raw again until the next expiry); the tier
+ * covers the time from first on. */
+struct lsm_rollup_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t tier;
+    int64_t cutoff;
+    int64_t first;
+    uint64_t count;
+};
+
+/* Rollups of a tier, found by (start, state) through an open-addressing
+ * table of indices. */
+struct rollup_set {
+    struct lsm_rollup *rollups;
+    uint32_t count;
+    uint32_t rollups_capacity;
+    uint32_t *slots;
+    size_t capacity;
+};
+
+/* Log-structured store: the write buffer (also appended to the write-ahead
+ * log) and the live segments, shared with the compaction thread under
+ * lock. Retention (in seconds) is off when retain_raw is 0. */
+struct lsm_store {
+    const char *dir;
+    long retain_raw;
+    long retain_hourly;
+    int expire_due;
+    uint32_t rollups;
+    FILE *wal;
+    struct lsm_entry *buffer;
+    int count;
+    int buffer_capacity;
+    uint64_t next_sequence;
+    int log_failed;
+    struct lsm_segment *segments;
+    int num_segments;
+    int segments_capacity;
+    uint32_t next_id;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t compactor;
+    int stop;
+    int failed;
+};
+
+/* Sorted run being merged: a segment read in chunks, or (with no file) the
+ * sorted write buffer. */
+struct lsm_cursor {
+    FILE *file;
+    struct lsm_entry *entries;
+    int count;
+    int next;
+    uint64_t remaining;
+    int failed;
+};
+
+/* Last value of a (timestamp, geohash) key for --upsert: only what is
+ * retracted from the aggregates when a correction arrives. The state and
+ * snow/lightning flags are kept in a parallel byte array and the pressure,
+ * which only the hourly series sums, in a parallel array when that series
+ * is kept. Entries of the same (state, hour) bucket are linked in arrival
+ * order. */
+struct upsert_entry {
+    int64_t timestamp;
+    uint32_t location;
+    uint32_t next;
+    double humidity;
+    double cloudcover;
+    double temperature;
+};
+
+/* Bits of an entry's flags byte: snow, lightning and the state index. */
+#define UPSERT_SNOW 1
+#define UPSERT_LIGHTNING 2
+#define UPSERT_STATE_SHIFT 2
+
+/* Temperature extremes of a state's hour, recomputed from its entries when
+ * a retracted value was one of them (dirty). */
+struct upsert_bucket {
+    long hour;
+    int state_index;
+    int dirty;
+    uint32_t first;
+    uint32_t last;
+    uint32_t count;
+    double max_temperature;
+    long max_temp_date;
+    double min_temperature;
+    long min_temp_date;
+};
+
+/* Keys and buckets of --upsert, each found through an open-addressing table
+ * of indices. States whose max/min was retracted are marked dirty. */
+struct upsert_table {
+    struct upsert_entry *entries;
+    uint8_t *flags;
+    double *pressures;
+    uint32_t num_entries;
+    uint32_t entries_capacity;
+    uint32_t *slots;
+    size_t capacity;
+    struct upsert_bucket *buckets;
+    uint32_t num_buckets;
+    uint32_t buckets_capacity;
+    uint32_t *bucket_slots;
+    size_t bucket_capacity;
+    unsigned char dirty_states[NUM_STATES];
+    unsigned long num_corrections;
+    unsigned long num_recomputed;
+};
+
+/* Time part of a --queries group key. */
+enum query_time {
+    QUERY_TIME_NONE,
+    QUERY_TIME_HOUR,
+    QUERY_TIME_DAY,
+    QUERY_TIME_MONTH,
+    NUM_QUERY_TIMES
+};
+
+/* Aggregate of one group of a query: the state code and geohash prefix
+ * packed into space, and the start of the hour, day or month. */
+struct group_aggregate {
+    uint64_t space;
+    int64_t time;
+    unsigned long count;
+    double sum_temperature;
+    double max_temperature;
+    double min_temperature;
+    double sum_humidity;
+    double sum_cloudcover;
+    unsigned long num_snowcover;
+    unsigned long num_lightning;
+};
+
+/* How a group table finds its groups, as their number grows. */
+enum group_mode {
+    GROUPS_ARRAY,
+    GROUPS_HASHED,
+    GROUPS_PARTITIONED
+};
+
+/* Groups of a query. Few groups are searched in order in a small array,
+ * like the states array; more are found through an open-addressing table
+ * of indices; past GROUP_HASH_MAX they are split by hash into partitions,
+ * each a hashed table of its own (count is then the total). */
+struct group_table {
+    int mode;
+    struct group_aggregate *groups;
+    uint32_t count;
+    uint32_t groups_capacity;
+    uint32_t *slots;
+    size_t capacity;
+    struct group_table *partitions;
+};
+
+const char *group_modes[] = {"array", "hashed", "partitioned"};
+
+/* One query of --queries: its filter, group key and groups. */
+struct query {
+    char *text;
+    struct record_filter filter;
+    int group_state;
+    int geohash_precision;
+    int time_unit;
+    char *output;
+    unsigned long num_records;
+    struct group_table groups;
+};
+
+/* Newline-aligned block of piped input, with what its parser made of it:
+ * the block's own state summaries, or its selected records. */
+struct parse_block {
+    unsigned long sequence;
+    char *text;
+    size_t length;
+    struct climate_info *states[NUM_STATES];
+    struct record *records;
+    int num_records;
+    struct parse_block *next;
+};
+
+/* Reader thread, parser pool and consumer of analyze_stream, sharing the
+ * queue of blocks to parse and the list of parsed ones. */
+struct parse_pipeline {
+    FILE *file;
+    const char *prefix;
+    size_t prefix_length;
+    int summaries;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct parse_block *pending;
+    struct parse_block *pending_tail;
+    struct parse_block *done;
+    unsigned long num_blocks;
+    int in_flight;
+    int max_in_flight;
+    int reading;
+    int failed;
+};
+
+/* Hourly event-time window of --stream, with a bucket for every state. A
+ * finalized window is free (hour LONG_MIN) for a later hour. */
+struct stream_window {
+    long hour;
+    struct hour_bucket states[NUM_STATES];
+};
+
+/* Event-time bucketing of --stream. The watermark trails the newest
+ * timestamp by the allowed lateness; windows ending at or before it are
+ * finalized. The windows still open span at most lateness + 2 hours, so they
+ * live in a ring indexed by hour. */
+struct event_stream {
+    long lateness;
+    long max_timestamp;
+    long next_hour;
+    struct stream_window *windows;
+    int num_windows;
+    int num_open;
+    int max_open;
+    unsigned long num_emitted;
+    unsigned long num_late;
+    FILE *csv;
+    int failed;
+};
+
+/* Blocks read and skipped (by their zone maps) while scanning a cache. */
+struct cache_stats {
+    unsigned long blocks_read;
+    unsigned long blocks_skipped;
+};
+
+/* One point of a location's series. */
+struct series_point {
+    long timestamp;
+    double temperature;
+    double pressure;
+};
+
+/* Points of one location, buffered until they can be sorted and encoded. */
+struct point_list {
+    uint32_t count;
+    uint32_t capacity;
+    struct series_point *points;
+};
+
+/* MSB-first bit stream used by the Gorilla codec. */
+struct bit_writer {
+    uint8_t *bytes;
+    size_t num_bits;
+    size_t capacity;
+};
+
+struct bit_reader {
+    const uint8_t *bytes;
+    size_t num_bytes;
+    size_t position;
+};
+
+/* Streaming Gorilla encoder for (timestamp, temperature, pressure) points:
+ * timestamps as delta-of-delta in units of time_unit seconds, values as
+ * the XOR with the previous value, reusing the previous window of
+ * meaningful bits when the new XOR fits in it. */
+struct gorilla_encoder {
+    struct bit_writer bits;
+    uint32_t count;
+    uint32_t time_unit;
+    long last_timestamp;
+    long last_delta;
+    uint64_t last_value[2];
+    int leading[2];
+    int trailing[2];
+};
+
+/* A record as stored in the history store, 32 bytes. */
+struct history_record {
+    int64_t timestamp;
+    char code[2];
+    uint8_t snow;
+    uint8_t lightning;
+    float humidity;
+    float cloudcover;
+    float pressure;
+    float temperature;
+    uint32_t reserved;
+};
+
+/* History store directory entry: a location's records are the `count`
+ * records starting at byte `offset` of the file. Entries are sorted by
+ * geohash. */
+struct history_entry {
+    char geohash[GEOHASH_LENGTH];
+    uint32_t count;
+    uint64_t offset;
+};
+
+/* Records of one location, buffered until the store is written. */
+struct history_list {
+    uint32_t count;
+    uint32_t capacity;
+    struct history_record *records;
+};
+
+/* A decoded location and its value for the heatmap. */
+struct raster_point {
+    float latitude;
+    float longitude;
+    float value;
+};
+
+/* One thread's share of the heatmap: the rows [first_row, last_row) and
+ * the points falling in them. Bands are disjoint so threads never write
+ * to the same cell. */
+struct raster_band {
+    int first_row;
+    int last_row;
+    const struct raster_point *points;
+    size_t num_points;
+    double *sum;
+    unsigned int *count;
+};
+
+/* A polygon region (possibly with holes or several parts) and the summary
+ * of the records inside it. All rings are tested together with the
+ * even-odd rule, which handles both holes and multiple parts. */
+struct region {
+    char name[REGION_NAME_LENGTH];
+    int num_rings;
+    int *ring_sizes;
+    double **rings;
+    double bounds[4];
+    unsigned long num_records;
+    double sum_temperature;
+    double sum_humidity;
+    double sum_cloudcover;
+    unsigned long num_lightning;
+    unsigned long num_snowcover;
+};
+
+/* Regions plus a uniform grid over their combined bounds; each grid cell
+ * lists the regions whose bounds overlap it. region_of_location caches the
+ * result per interned geohash ID (-2 = not tested yet, -1 = no region). */
+struct region_index {
+    int num_regions;
+    struct region *regions;
+    double bounds[4];
+    int *cell_counts;
+    int **cell_regions;
+    int *region_of_location;
+    uint32_t locations_capacity;
+    unsigned long num_outside;
+};
+
+/* Aggregates of one reporting location, indexed by geohash ID. */
+struct location_stats {
+    char code[3];
+    unsigned long num_records;
+    double sum_temperature;
+    double sum_humidity;
+    unsigned long num_lightning;
+    unsigned long num_snowcover;
+    long latest_timestamp;
+    double latest_temperature;
+    double latest_humidity;
+};
+
+/* KD-tree node: a location as a point on the unit sphere, so squared
+ * Euclidean (chord) distance orders locations like great-circle distance.
+ * The tree is implicit: the node for a range is at its middle, split on
+ * `axis`, with the halves before and after it as children. */
+struct kd_node {
+    double xyz[3];
+    uint32_t location;
+    int axis;
+};
+
+/* Interned geohash strings: each distinct geohash gets a dense ID. */
+struct geohash_table {
+    size_t capacity;
+    uint32_t count;
+    uint32_t *slots;
+    char (*names)[GEOHASH_LENGTH + 1];
+    uint32_t names_capacity;
+};
+
+/* Two-letter codes of the 50 states; a code's position is its "slot" in
+ * tables that are shared across runs (e.g. saved climatologies). */
+const char *state_codes[NUM_STATES] = {
+    "AK", "AL", "AR", "AZ", "CA", "CO", "CT", "DE", "FL", "GA",
+    "HI", "IA", "ID", "IL", "IN", "KS", "KY", "LA", "MA", "MD",
+    "ME", "MI", "MN", "MO", "MS", "MT", "NC", "ND", "NE", "NH",
+    "NJ", "NM", "NV", "NY", "OH", "OK", "OR", "PA", "RI", "SC",
+    "SD", "TN", "TX", "UT", "VA", "VT", "WA", "WI", "WV", "WY"
+};
+
+/* Slot of every two-letter code, -1 for codes that are not states; built
+ * once (pthread_once, so parser threads may be the first to use it). */
+signed char state_slots[26 * 26];
+pthread_once_t state_slots_once = PTHREAD_ONCE_INIT;
+
+/* US time zones: standard offset from UTC in hours, whether daylight saving
+ * time is observed, and the standard/daylight abbreviations. */
+struct time_zone {
+    int offset_hours;
+    int observes_dst;
+    const char *standard_name;
+    const char *daylight_name;
+};
+
+enum zone {
+    ZONE_EASTERN,
+    ZONE_CENTRAL,
+    ZONE_MOUNTAIN,
+    ZONE_ARIZONA,
+    ZONE_PACIFIC,
+    ZONE_ALASKA,
+    ZONE_HAWAII,
+    NUM_ZONES
+};
+
+const struct time_zone time_zones[NUM_ZONES] = {
+    {-5, 1, "EST", "EDT"},
+    {-6, 1, "CST", "CDT"},
+    {-7, 1, "MST", "MDT"},
+    {-7, 0, "MST", "MST"},
+    {-8, 1, "PST", "PDT"},
+    {-9, 1, "AKST", "AKDT"},
+    {-10, 0, "HST", "HST"},
+};
+
+/* Time zone of each state in state_codes (for states spanning two zones,
+ * the zone most of the state is in). */
+const unsigned char state_zones[NUM_STATES] = {
+    ZONE_ALASKA, ZONE_CENTRAL, ZONE_CENTRAL, ZONE_ARIZONA, ZONE_PACIFIC,         // AK AL AR AZ CA
+    ZONE_MOUNTAIN, ZONE_EASTERN, ZONE_EASTERN, ZONE_EASTERN, ZONE_EASTERN,      // CO CT DE FL GA
+    ZONE_HAWAII, ZONE_CENTRAL, ZONE_MOUNTAIN, ZONE_CENTRAL, ZONE_EASTERN,       // HI IA ID IL IN
+    ZONE_CENTRAL, ZONE_EASTERN, ZONE_CENTRAL, ZONE_EASTERN, ZONE_EASTERN,       // KS KY LA MA MD
+    ZONE_EASTERN, ZONE_EASTERN, ZONE_CENTRAL, ZONE_CENTRAL, ZONE_CENTRAL,       // ME MI MN MO MS
+    ZONE_MOUNTAIN, ZONE_EASTERN, ZONE_CENTRAL, ZONE_CENTRAL, ZONE_EASTERN,      // MT NC ND NE NH
+    ZONE_EASTERN, ZONE_MOUNTAIN, ZONE_PACIFIC, ZONE_EASTERN, ZONE_EASTERN,      // NJ NM NV NY OH
+    ZONE_CENTRAL, ZONE_PACIFIC, ZONE_EASTERN, ZONE_EASTERN, ZONE_EASTERN,       // OK OR PA RI SC
+    ZONE_CENTRAL, ZONE_CENTRAL, ZONE_CENTRAL, ZONE_MOUNTAIN, ZONE_EASTERN,      // SD TN TX UT VA
+    ZONE_EASTERN, ZONE_PACIFIC, ZONE_CENTRAL, ZONE_EASTERN, ZONE_MOUNTAIN,      // VT WA WI WV WY
+};
+
+/* Aggregate of one (state, day of year, hour) cell of a climatology. */
+struct climatology_cell {
+    float sum_temperature;
+    float sum_humidity;
+    uint32_t num_snowcover;
+    uint32_t num_records;
+};
+
+/* Dense climatology table, cell (slot, day, hour) lives at
+ * cells[(slot * num_days + day) * CLIMATOLOGY_HOURS + hour]. For the
+ * normals num_days is CLIMATOLOGY_DAYS and day is the day of a leap year
+ * (see climatology_day), so a date has the same cell in every year;
+ * for the target period day counts from first_day (days since 1970). */
+struct climatology {
+    long first_day;
+    int num_days;
+    struct climatology_cell *cells;
+};
+
+/* Command line options (see usage in main). */
+struct options {
+    int print_histograms;
+    char *histogram_file;
+    int correlate_metric;
+    char *climatology_save_file;
+    char *climatology_file;
+    long period_first_day;
+    long period_last_day;
+    int rolling;
+    char *rolling_file;
+    int storm_cells;
+    int storm_precision;
+    int snow_extent;
+    char *snow_extent_file;
+    struct record_filter filter;
+    char *cache_file;
+    int cache_order;
+    int benchmark;
+    int profile_data;
+    char *arrow_file;
+    char *parquet_file;
+    int parquet_codec;
+    char *lsm_dir;
+    char *lsm_query;
+    long retain_raw_days;
+    long retain_hourly_months;
+    int upsert;
+    char *stream_file;
+    long stream_lateness;
+    char *queries_file;
+    char *series_file;
+    char *series_query;
+    char *history_file;
+    char *history_query;
+    int heatmap_metric;
+    char *heatmap_file;
+    int grid_width;
+    int grid_height;
+    int has_bbox;
+    double bbox[4];
+    int threads;
+    int unordered;
+    char *regions_file;
+    int nearest;
+    double nearest_latitude;
+    double nearest_longitude;
+    int nearest_k;
+};
+
+struct options options = {
+    .correlate_metric = -1,
+    .period_last_day = -1,
+    .storm_precision = STORM_PRECISION,
+    .filter = {.snow = -1, .lightning = -1},
+    .heatmap_metric = -1,
+    .grid_width = HEATMAP_WIDTH,
+    .grid_height = HEATMAP_HEIGHT,
+    .nearest_k = NEAREST_K,
+    .retain_hourly_months = LSM_RETAIN_HOURLY_MONTHS,
+    .stream_lateness = STREAM_LATENESS_MINUTES,
 };
 
+/* Latest timestamp the time-indexed analyses accept, a day after the run
+ * starts; together with EARLIEST_TIMESTAMP it keeps corrupt times from
+ * stretching the dense series. */
+long latest_timestamp = 0;
+
+/* Records left out of the hourly series for their timestamp, and whether
+ * growing a series failed. */
+unsigned long num_series_skipped = 0;
+int series_failed = 0;
+
+/* The same for the per-day snow bitmaps of --snow-extent. */
+unsigned long num_snow_skipped = 0;
+int snow_failed = 0;
+
+/* Per-location points collected for --series-store, indexed by geohash ID. */
+struct point_list *location_points = NULL;
+uint32_t location_points_capacity = 0;
+
+/* Per-location records collected for --history-store, indexed by geohash ID. */
+struct history_list *location_history = NULL;
+uint32_t location_history_capacity = 0;
+
+/* Points collected for --heatmap. */
+struct raster_point *raster_points = NULL;
+size_t num_raster_points = 0;
+size_t raster_points_capacity = 0;
+
+/* Regions loaded by --regions. */
+struct region_index *regions = NULL;
+
+/* Per-location aggregates collected for --nearest, indexed by geohash ID. */
+struct location_stats *location_stats = NULL;
+uint32_t location_stats_capacity = 0;
+
+/* Binary cache being written by --cache-write. */
+struct cache_writer *cache_out = NULL;
+
+/* Arrow IPC file being written by --arrow. */
+struct arrow_writer *arrow_out = NULL;
+
+/* Parquet file being written by --parquet. */
+struct parquet_writer *parquet_out = NULL;
+
+/* Log-structured store being ingested into by --lsm. */
+struct lsm_store *lsm_out = NULL;
+
+/* Last value of every key seen, for --upsert. */
+struct upsert_table upserts = {0};
+
+/* Open event-time windows of --stream. */
+struct event_stream *stream_out = NULL;
+
+/* Queries of --queries, evaluated on every flushed parse batch. */
+struct query *queries = NULL;
+int num_queries = 0;
+int queries_capacity = 0;
+
+/* Temporary caches written in each order for --benchmark. */
+char benchmark_paths[NUM_CACHE_ORDERS][32];
+struct cache_writer *benchmark_caches[NUM_CACHE_ORDERS] = {NULL};
+
+struct geohash_table geohashes = {0, 0, NULL, NULL, 0};
+
+/* Lightning-positive records collected for storm-cell clustering. */
+struct strike *strikes = NULL;
+size_t num_strikes = 0;
+size_t strikes_capacity = 0;
+
+/* Normals being built from the input files, and the target period's
+ * observations to compare with saved normals. */
+struct climatology *normals_build = NULL;
+struct climatology *period_observed = NULL;
+
 void analyze_file(FILE *file, struct climate_info *states[], int num_states);
+int get_state_index(struct climate_info **states, char *state_code);
+void add_record(struct climate_info **states, int state_index, const struct record *rec,
+        struct parse_batch *batch);
 void print_report(struct climate_info *states[], int num_states);
+void compute_bins(const float *values, int count, float min, float width, int num_bins, int *bins);
+void flush_batch(struct parse_batch *batch, struct climate_info *states[]);
+void merge_climate_info(struct climate_info *dst, const struct climate_info *src);
+void print_histograms(struct climate_info *info);
+int export_histograms(const char *path, struct climate_info *states[], int num_states);
+int find_metric(const char *name);
+void add_climatology(const char *code, long timestamp, double temperature, double humidity, int snow,
+        int sign);
+int timestamp_in_range(long timestamp);
+long hour_index(long timestamp);
+long day_index(long timestamp);
+struct hour_bucket *hourly_bucket(struct climate_info *info, long hour);
+void gemm_nt(const double *a, const double *b, double *c, int m, int n, int k);
+void print_correlation(struct climate_info *states[], int num_states, int metric);
+void init_state_slots(void);
+int state_slot(const char *code);
+long days_from_civil(int year, int month, int day);
+void civil_from_days(long days, int *year, int *month, int *day);
+int climatology_day(int month, int day);
+int parse_period(const char *text, long *first_day, long *last_day);
+int weekday_from_days(long days);
+long zone_offset(int zone, long timestamp, int *dst);
+int state_zone(const char *code);
+long local_timestamp(const char *code, long timestamp);
+const char *local_ctime(const char *code, long timestamp);
+struct climatology *new_climatology(long first_day, int num_days);
+struct climatology_cell *climatology_cell(struct climatology *table, int slot, int day, int hour);
+int save_climatology(const char *path, struct climatology *table);
+struct climatology *load_climatology(const char *path);
+void print_departures(struct climatology *normals, struct climatology *observed);
+void ring_window_init(struct ring_window *window, int size);
+void ring_window_push(struct ring_window *window, double value);
+void extreme_queue_init(struct extreme_queue *queue, int capacity);
+void extreme_queue_push(struct extreme_queue *queue, double max, double min);
+void extreme_queue_pop(struct extreme_queue *queue);
+void extreme_queue_extremes(struct extreme_queue *queue, double *max, double *min);
+int print_rolling(struct climate_info *states[], int num_states, const char *csv_path);
+int geohash_decode(const char *hash, int length, double *latitude, double *longitude);
+int geohash_cell(const char *hash, int length, uint32_t *x, uint32_t *y);
+int geohash_decode_batch(const char (*hashes)[GEOHASH_LENGTH], int count, double *latitudes,
+        double *longitudes);
+void geohash_encode_batch(const double *latitudes, const double *longitudes, int count,
+        char (*hashes)[GEOHASH_LENGTH]);
+void add_strike(int state_index, long timestamp, const char *geolocation);
+int *cell_map_find(struct cell_map *map, int state_index, long hour, uint32_t x, uint32_t y);
+int find_root(int *parent, int i);
+void union_sets(int *parent, int *size, int a, int b);
+void print_storm_cells(struct climate_info *states[], int num_states);
+uint32_t intern_geohash(const char *hash);
+struct roaring *roaring_new(void);
+void roaring_free(struct roaring *bitmap);
+void roaring_add(struct roaring *bitmap, uint32_t value);
+unsigned long roaring_cardinality(const struct roaring *bitmap);
+struct roaring *roaring_union(const struct roaring *a, const struct roaring *b);
+struct roaring *roaring_intersection(const struct roaring *a, const struct roaring *b);
+int add_snow(struct climate_info *info, long day, uint32_t location);
+int print_snow_extent(struct climate_info *states[], int num_states, const char *csv_path);
+int parse_where(const char *text, struct record_filter *filter);
+uint64_t geohash_bits(const char *hash);
+int filter_match(const struct record_filter *filter, long timestamp, const char *geohash);
+int filter_block(const struct record_filter *filter, const struct cache_block_header *header);
+uint64_t select_records(const struct record_filter *filter, const struct cache_block *block, uint64_t *masks);
+struct cache_writer *cache_open(const char *path, int order);
+void cache_append(struct cache_writer *writer, int state_index, const struct record *rec);
+int cache_close(struct cache_writer *writer);
+int read_cache_block(FILE *file, struct cache_block *block, const struct record_filter *filter,
+        struct cache_stats *stats);
+void analyze_cache(FILE *file, struct climate_info *states[], int num_states);
+void add_series_point(uint32_t location, const struct record *rec);
+void gorilla_init(struct gorilla_encoder *encoder, uint32_t time_unit);
+void gorilla_append(struct gorilla_encoder *encoder, long timestamp, double temperature, double pressure);
+uint32_t gorilla_decode(const uint8_t *bytes, size_t num_bytes, uint32_t count, uint32_t time_unit,
+        struct series_point *points);
+int write_series_store(const char *path);
+int print_series(const char *path, const char *geohash);
+void add_history_record(uint32_t location, const struct record *rec);
+int write_history_store(const char *path);
+int print_history(const char *path, const char *geohash);
+int num_threads(void);
+void add_raster_point(const struct record *rec);
+void *rasterize_band(void *arg);
+int write_heatmap(const char *path);
+struct region_index *load_regions(const char *path);
+int point_in_region(const struct region *region, double x, double y);
+int find_region(struct region_index *index, uint32_t location);
+void add_region_record(const struct record *rec);
+void print_regions(struct region_index *index);
+void add_location_stats(uint32_t location, const struct record *rec);
+void to_unit_sphere(double latitude, double longitude, double *xyz);
+void kd_build(struct kd_node *nodes, int count);
+void kd_search(const struct kd_node *nodes, int count, const double *target, int k,
+        int *best, double *best_distance, int *num_best);
+void print_nearest(double latitude, double longitude, int k);
+int open_benchmark_caches(void);
+int run_benchmark(void);
+void benchmark_geohash_kernels(const char (*hashes)[GEOHASH_LENGTH], int count);
+void check_gorilla_round_trip(void);
+uint64_t range_violations(const double *values, int count, double min, double max);
+uint64_t flag_violations(const double *values, int count);
+void flush_profile(struct profile_batch *batch, struct quality_counts *file_counts,
+        struct quality_counts *state_counts);
+long profile_file(FILE *file, const char *prefix, size_t prefix_length, struct quality_counts *file_counts,
+        struct quality_counts *state_counts);
+unsigned long profile_files(char *paths[], int num_paths);
+void fb_init(struct flatbuffer *b);
+size_t fb_end_table(struct flatbuffer *b);
+size_t arrow_schema(struct flatbuffer *b);
+struct arrow_writer *arrow_open(const char *path);
+void arrow_append(struct arrow_writer *writer, int state_index, const struct record *rec);
+int arrow_close(struct arrow_writer *writer, struct climate_info *states[]);
+size_t snappy_compress(const uint8_t *in, size_t n, uint8_t *out);
+size_t encode_hybrid(const uint32_t *values, int n, int bit_width, uint8_t *out);
+struct parquet_writer *parquet_open(const char *path, int codec);
+void parquet_append(struct parquet_writer *writer, const struct record *rec);
+int parquet_close(struct parquet_writer *writer);
+int compare_lsm_entries(const void *a, const void *b);
+int compare_lsm_segments(const void *a, const void *b);
+struct lsm_store *lsm_open(const char *dir, long retain_raw, long retain_hourly);
+int lsm_flush(struct lsm_store *store);
+void lsm_append(struct lsm_store *store, const struct record *rec);
+int lsm_close(struct lsm_store *store);
+int analyze_lsm(const char *dir, const char *state, struct climate_info *states[]);
+int read_rollups(const struct lsm_store *store, int tier, struct rollup_set *set,
+        struct lsm_rollup_header *header);
+int lsm_expire(struct lsm_store *store);
+int parse_between(const char *text, long *from, long *to);
+int query_rollups(struct lsm_store *store, const char *state, long from, long to,
+        struct climate_info *states[], unsigned long *num_hourly, unsigned long *num_daily);
+int query_needs_records(void);
+int upsert_record(struct climate_info *states[], int state_index, const struct record *rec);
+void settle_upserts(struct climate_info *states[]);
+struct event_stream *stream_open(const char *path, long lateness);
+void stream_emit(struct event_stream *stream, struct climate_info *states[], struct stream_window *window);
+void stream_advance(struct event_stream *stream, struct climate_info *states[], long watermark);
+void stream_add(struct event_stream *stream, struct climate_info *states[], int state_index,
+        const struct record *rec);
+int stream_close(struct event_stream *stream, struct climate_info *states[]);
+int parse_query(char *line, struct query *query);
+int load_queries(const char *path, int *line_number);
+uint64_t group_hash(uint64_t space, int64_t time);
+size_t group_slot(const struct group_table *table, uint64_t hash, uint64_t space, int64_t time);
+void rehash_groups(struct group_table *table);
+struct group_aggregate *new_group(struct group_table *table, uint64_t space, int64_t time);
+struct group_aggregate *find_group(struct group_table *table, uint64_t space, int64_t time, uint64_t hash);
+void partition_groups(struct group_table *table);
+void add_to_group(struct group_aggregate *group, const struct record *rec);
+void aggregate_groups(struct group_table *table, const struct record *records, const int *selected,
+        const uint64_t *spaces, const int64_t *times, int count);
+void flatten_groups(struct group_table *table);
+void run_queries(const struct record *records, int count);
+int write_query(struct query *query, int index);
+int parse_line(char *line, struct record *rec);
+int record_selected(const struct record_filter *filter, const struct record *rec);
+void *read_blocks(void *arg);
+void parse_block(struct parse_pipeline *pipeline, struct parse_block *block);
+void *parse_blocks(void *arg);
+int analyze_stream(FILE *file, const char *prefix, size_t prefix_length, struct climate_info *states[]);
 
 int findStateIndex(struct climate_info **states, char *stateCode){
     // loop until we hit a NULL spot.
@@ -107,37 +1599,568 @@ int findStateIndex(struct climate_info **states, char *stateCode){
 }
 
 int main(int argc, char *argv[]) {
+    latest_timestamp = (long) time(NULL) + 86400;
 
-    /* TODO: fix this conditional. You should be able to read multiple files. */
-    if (argc < 2) { 
-        printf("Usage: %s tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    /* Let's create an array to store our state data in. As we know, there are
-     * 50 US states. */
-    struct climate_info *states[NUM_STATES] = {NULL};
-
-    int i;
-    for (i = 1; i < argc; ++i) {
-        /* TODO: Open the file for reading */
-        FILE *file = fopen(argv[i], "r");
-
-        /* TODO: If the file doesn't exist, print an error message and move on
-         * to the next file. */
-        if (file == NULL) {
-            printf("Error: File \"%s\" does not exist.\n", argv[i]);
-            continue;
+    // options come first and start with "--", everything after is a file
+    int first_file = 1;
+    while (first_file < argc && strncmp(argv[first_file], "--", 2) == 0) {
+        char *opt = argv[first_file];
+        if (strcmp(opt, "--histograms") == 0) {
+            options.print_histograms = 1;
         }
+        else if (strncmp(opt, "--histograms=", 13) == 0) {
+            options.histogram_file = opt + 13;
+        }
+        else if (strncmp(opt, "--climatology-save=", 19) == 0) {
+            options.climatology_save_file = opt + 19;
+        }
+        else if (strncmp(opt, "--climatology=", 14) == 0) {
+            options.climatology_file = opt + 14;
+        }
+        else if (strncmp(opt, "--period=", 9) == 0) {
+            if (parse_period(opt + 9, &options.period_first_day, &options.period_last_day) != 0) {
+                printf("Error: Invalid period \"%s\", expected YYYY-MM-DD:YYYY-MM-DD.\n", opt + 9);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(opt, "--rolling") == 0) {
+            options.rolling = 1;
+        }
+        else if (strncmp(opt, "--rolling=", 10) == 0) {
+            options.rolling = 1;
+            options.rolling_file = opt + 10;
+        }
+        else if (strcmp(opt, "--snow-extent") == 0) {
+            options.snow_extent = 1;
+        }
+        else if (strncmp(opt, "--snow-extent=", 14) == 0) {
+            options.snow_extent = 1;
+            options.snow_extent_file = opt + 14;
+        }
+        else if (strncmp(opt, "--where=", 8) == 0) {
+            if (parse_where(opt + 8, &options.filter) != 0) {
+                printf("Error: Invalid filter \"%s\", expected e.g. snow=1,lightning=1.\n", opt + 8);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--within=", 9) == 0) {
+            double *box = options.filter.within;
+            if (sscanf(opt + 9, "%lf,%lf,%lf,%lf", &box[0], &box[1], &box[2], &box[3]) != 4
+                    || box[2] < box[0] || box[3] < box[1]) {
+                printf("Error: Expected --within=SOUTH,WEST,NORTH,EAST.\n");
+                return EXIT_FAILURE;
+            }
+            options.filter.has_within = 1;
+        }
+        else if (strncmp(opt, "--between=", 10) == 0) {
+            if (parse_between(opt + 10, &options.filter.from, &options.filter.to) != 0) {
+                printf("Error: Invalid dates \"%s\", expected YYYY-MM-DD[THH]:YYYY-MM-DD[THH].\n", opt + 10);
+                return EXIT_FAILURE;
+            }
+            options.filter.has_between = 1;
+        }
+        else if (strncmp(opt, "--cache-write=", 14) == 0) {
+            options.cache_file = opt + 14;
+        }
+        else if (strncmp(opt, "--cache-order=", 14) == 0) {
+            if (strcmp(opt + 14, "morton") == 0) {
+                options.cache_order = CACHE_ORDER_MORTON;
+            }
+            else if (strcmp(opt + 14, "time") == 0) {
+                options.cache_order = CACHE_ORDER_TIME;
+            }
+            else {
+                printf("Error: Unknown cache order \"%s\", expected morton or time.\n", opt + 14);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(opt, "--benchmark") == 0) {
+            options.benchmark = 1;
+        }
+        else if (strcmp(opt, "--profile-data") == 0) {
+            options.profile_data = 1;
+        }
+        else if (strncmp(opt, "--arrow=", 8) == 0) {
+            options.arrow_file = opt + 8;
+        }
+        else if (strcmp(opt, "--upsert") == 0) {
+            options.upsert = 1;
+        }
+        else if (strncmp(opt, "--stream=", 9) == 0) {
+            options.stream_file = opt + 9;
+        }
+        else if (strncmp(opt, "--queries=", 10) == 0) {
+            options.queries_file = opt + 10;
+        }
+        else if (strncmp(opt, "--lateness=", 11) == 0) {
+            options.stream_lateness = atol(opt + 11);
+            if (options.stream_lateness < 0) {
+                printf("Error: --lateness needs a number of minutes.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--lsm=", 6) == 0) {
+            options.lsm_dir = opt + 6;
+        }
+        else if (strncmp(opt, "--lsm-query=", 12) == 0) {
+            options.lsm_query = opt + 12;
+        }
+        else if (strncmp(opt, "--retain-raw=", 13) == 0) {
+            options.retain_raw_days = atol(opt + 13);
+            if (options.retain_raw_days <= 0) {
+                printf("Error: --retain-raw needs a positive number of days.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--retain-hourly=", 16) == 0) {
+            options.retain_hourly_months = atol(opt + 16);
+            if (options.retain_hourly_months < 0) {
+                printf("Error: --retain-hourly needs a number of months.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--parquet=", 10) == 0) {
+            options.parquet_file = opt + 10;
+        }
+        else if (strncmp(opt, "--parquet-codec=", 16) == 0) {
+            if (strcmp(opt + 16, "snappy") == 0) {
+                options.parquet_codec = PARQUET_CODEC_SNAPPY;
+            }
+            else if (strcmp(opt + 16, "none") == 0) {
+                options.parquet_codec = PARQUET_CODEC_NONE;
+            }
+            else {
+                printf("Error: Unknown Parquet codec \"%s\" (snappy or none).\n", opt + 16);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--series-store=", 15) == 0) {
+            options.series_file = opt + 15;
+        }
+        else if (strncmp(opt, "--series-read=", 14) == 0) {
+            options.series_query = opt + 14;
+        }
+        else if (strncmp(opt, "--history-store=", 16) == 0) {
+            options.history_file = opt + 16;
+        }
+        else if (strncmp(opt, "--history=", 10) == 0) {
+            options.history_query = opt + 10;
+        }
+        else if (strncmp(opt, "--heatmap=", 10) == 0) {
+            char *colon = strchr(opt + 10, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                options.heatmap_metric = find_metric(opt + 10);
+                options.heatmap_file = colon + 1;
+            }
+            if (options.heatmap_metric < 0 || *options.heatmap_file == '\0') {
+                printf("Error: Expected --heatmap=METRIC:FILE.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--grid=", 7) == 0) {
+            if (sscanf(opt + 7, "%dx%d", &options.grid_width, &options.grid_height) != 2
+                    || options.grid_width < 1 || options.grid_height < 1) {
+                printf("Error: Expected --grid=WIDTHxHEIGHT.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--bbox=", 7) == 0) {
+            if (sscanf(opt + 7, "%lf,%lf,%lf,%lf", &options.bbox[0], &options.bbox[1],
+                        &options.bbox[2], &options.bbox[3]) != 4
+                    || options.bbox[2] <= options.bbox[0] || options.bbox[3] <= options.bbox[1]) {
+                printf("Error: Expected --bbox=SOUTH,WEST,NORTH,EAST.\n");
+                return EXIT_FAILURE;
+            }
+            options.has_bbox = 1;
+        }
+        else if (strncmp(opt, "--threads=", 10) == 0) {
+            options.threads = atoi(opt + 10);
+            if (options.threads < 1) {
+                printf("Error: Thread count must be at least 1.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(opt, "--unordered") == 0) {
+            options.unordered = 1;
+        }
+        else if (strncmp(opt, "--regions=", 10) == 0) {
+            options.regions_file = opt + 10;
+        }
+        else if (strncmp(opt, "--nearest=", 10) == 0) {
+            int fields = sscanf(opt + 10, "%lf,%lf,%d", &options.nearest_latitude,
+                    &options.nearest_longitude, &options.nearest_k);
+            if (fields < 2 || options.nearest_k < 1 || fabs(options.nearest_latitude) > 90
+                    || fabs(options.nearest_longitude) > 180) {
+                printf("Error: Expected --nearest=LAT,LON[,K].\n");
+                return EXIT_FAILURE;
+            }
+            options.nearest = 1;
+        }
+        else if (strcmp(opt, "--storm-cells") == 0) {
+            options.storm_cells = 1;
+        }
+        else if (strncmp(opt, "--storm-precision=", 18) == 0) {
+            options.storm_precision = atoi(opt + 18);
+            if (options.storm_precision < 1 || options.storm_precision > MAX_STORM_PRECISION) {
+                printf("Error: Storm precision must be between 1 and %d.\n", MAX_STORM_PRECISION);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(opt, "--correlate=", 12) == 0) {
+            options.correlate_metric = find_metric(opt + 12);
+            if (options.correlate_metric < 0) {
+                printf("Error: Unknown metric \"%s\".\n", opt + 12);
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            printf("Error: Unknown option \"%s\".\n", opt);
+            return EXIT_FAILURE;
+        }
+        first_file++;
+    }
+
+    // reading a series or history store needs no input files
+    if (options.series_query != NULL || options.history_query != NULL) {
+        char *query = options.series_query != NULL ? options.series_query : options.history_query;
+        char *colon = strrchr(query, ':');
+        if (colon == NULL) {
+            printf("Error: Expected FILE:GEOHASH, got \"%s\".\n", query);
+            return EXIT_FAILURE;
+        }
+        *colon = '\0';
+        if (options.series_query != NULL) {
+            return print_series(query, colon + 1) == 0 ? 0 : EXIT_FAILURE;
+        }
+        return print_history(query, colon + 1) == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    /* TODO: fix this conditional. You should be able to read multiple files. */
+    if (first_file >= argc && options.lsm_query == NULL) {
+        printf("Usage: %s [options] tdv_file1 tdv_file2 ... tdv_fileN (- for stdin)\n", argv[0]);
+        printf("Options:\n");
+        printf("  --histograms         print temperature/humidity/cloud cover histograms\n");
+        printf("  --histograms=FILE    export the histograms as CSV to FILE\n");
+        printf("  --correlate=METRIC   print the cross-state correlation of hourly METRIC\n");
+        printf("  --climatology-save=FILE  save day-of-year/hour normals to FILE\n");
+        printf("  --climatology=FILE   report departures from the normals in FILE\n");
+        printf("  --period=FROM:TO     target dates (YYYY-MM-DD:YYYY-MM-DD) for departures\n");
+        printf("  --rolling            print rolling 24h lightning and 7d temperature peaks\n");
+        printf("  --rolling=FILE       also export the hourly rolling values as CSV to FILE\n");
+        printf("  --storm-cells        cluster lightning strikes into storm cells\n");
+        printf("  --storm-precision=N  geohash length of the storm-cell grid (default %d)\n", STORM_PRECISION);
+        printf("  --snow-extent        print daily snow-cover extent per state (within --period)\n");
+        printf("  --snow-extent=FILE   also export the daily snow extents as CSV to FILE\n");
+        printf("  --where=COND,...     only use records with snow=0|1 and/or lightning=0|1\n");
+        printf("  --cache-write=FILE   write the records as a binary columnar cache to FILE\n");
+        printf("  --series-store=FILE  write Gorilla-compressed per-location series to FILE\n");
+        printf("  --series-read=FILE:GEOHASH  print one location's series from a series store\n");
+        printf("  --history-store=FILE write the records grouped by location to FILE\n");
+        printf("  --history=FILE:GEOHASH  print one location's records from a history store\n");
+        printf("  --heatmap=METRIC:FILE  rasterize the mean METRIC per lat/lon cell (.pgm or raw float32)\n");
+        printf("  --grid=WxH           heatmap size in cells (default %dx%d)\n", HEATMAP_WIDTH, HEATMAP_HEIGHT);
+        printf("  --bbox=S,W,N,E       heatmap bounds in degrees (default: extent of the data)\n");
+        printf("  --threads=N          worker threads (default: all cores)\n");
+        printf("  --unordered          merge piped input's block summaries as they finish\n");
+        printf("  --regions=FILE       summarize by the NAME<tab>WKT polygons in FILE\n");
+        printf("  --nearest=LAT,LON[,K]  print the K nearest reporting locations (default %d)\n", NEAREST_K);
+        printf("  --within=S,W,N,E     only use records inside the box (degrees)\n");
+        printf("  --between=FROM:TO    only use records from these UTC dates (YYYY-MM-DD[THH]:YYYY-MM-DD[THH])\n");
+        printf("  --cache-order=ORDER  sort cached records by location (morton) or time\n");
+        printf("  --benchmark          compare cache layouts, time the geohash kernels, check the series codec\n");
+        printf("  --profile-data       only check the files' data quality (fails on violations)\n");
+        printf("  --arrow=FILE         export the parsed columns as an Arrow IPC (Feather) file\n");
+        printf("  --parquet=FILE       export the parsed columns as a Parquet file\n");
+        printf("  --parquet-codec=CODEC  Parquet page compression: snappy or none (default)\n");
+        printf("  --lsm=DIR            also ingest the records into the log-structured store in DIR\n");
+        printf("  --lsm-query=DIR[:STATE]  analyze the store's records (of STATE, in --between)\n");
+        printf("  --retain-raw=DAYS    with --lsm, keep older records only as hourly/daily rollups\n");
+        printf("  --retain-hourly=MONTHS  keep hourly rollups this long before daily only (default %d)\n",
+                LSM_RETAIN_HOURLY_MONTHS);
+        printf("  --upsert             replace earlier records with the same timestamp and geohash\n");
+        printf("  --stream=FILE        write hourly event-time windows per state as CSV as they close\n");
+        printf("  --lateness=MINUTES   how far the --stream watermark trails the newest record (default %d)\n",
+                STREAM_LATENESS_MINUTES);
+        printf("  --queries=FILE       also evaluate each query line of FILE in the same pass\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.profile_data) {
+        return profile_files(argv + first_file, argc - first_file) == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    // corrections can only be retracted from aggregates, not from records already kept or written
+    if (options.upsert) {
+        const char *kept = options.cache_file != NULL ? "--cache-write"
+            : options.arrow_file != NULL ? "--arrow"
+            : options.parquet_file != NULL ? "--parquet"
+            : options.lsm_dir != NULL ? "--lsm"
+            : options.series_file != NULL ? "--series-store"
+            : options.history_file != NULL ? "--history-store"
+            : options.heatmap_file != NULL ? "--heatmap"
+            : options.snow_extent ? "--snow-extent"
+            : options.storm_cells ? "--storm-cells"
+            : options.stream_file != NULL ? "--stream"
+            : options.queries_file != NULL ? "--queries"
+            : options.benchmark ? "--benchmark" : NULL;
+        if (kept != NULL) {
+            printf("Error: --upsert can't be combined with %s, which keeps every version of a record.\n", kept);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct climatology *normals = NULL;
+    if (options.climatology_file != NULL) {
+        if (options.period_last_day < options.period_first_day) {
+            printf("Error: --climatology needs a --period.\n");
+            return EXIT_FAILURE;
+        }
+        normals = load_climatology(options.climatology_file);
+        if (normals == NULL) {
+            printf("Error: Could not read climatology \"%s\".\n", options.climatology_file);
+            return EXIT_FAILURE;
+        }
+        period_observed = new_climatology(options.period_first_day,
+                (int) (options.period_last_day - options.period_first_day + 1));
+    }
+    if (options.climatology_save_file != NULL) {
+        normals_build = new_climatology(0, CLIMATOLOGY_DAYS);
+    }
+    if (options.regions_file != NULL) {
+        regions = load_regions(options.regions_file);
+        if (regions == NULL) {
+            printf("Error: Could not read regions \"%s\".\n", options.regions_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.cache_file != NULL) {
+        cache_out = cache_open(options.cache_file, options.cache_order);
+        if (cache_out == NULL) {
+            printf("Error: Could not create cache \"%s\".\n", options.cache_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.arrow_file != NULL) {
+        arrow_out = arrow_open(options.arrow_file);
+        if (arrow_out == NULL) {
+            printf("Error: Could not create Arrow file \"%s\".\n", options.arrow_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.parquet_file != NULL) {
+        parquet_out = parquet_open(options.parquet_file, options.parquet_codec);
+        if (parquet_out == NULL) {
+            printf("Error: Could not create Parquet file \"%s\".\n", options.parquet_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.lsm_dir != NULL) {
+        lsm_out = lsm_open(options.lsm_dir, options.retain_raw_days * 86400,
+                options.retain_hourly_months * 30 * 86400);
+        if (lsm_out == NULL) {
+            printf("Error: Could not open store \"%s\".\n", options.lsm_dir);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.stream_file != NULL) {
+        stream_out = stream_open(options.stream_file, options.stream_lateness * 60);
+        if (stream_out == NULL) {
+            printf("Error: Could not open \"%s\".\n", options.stream_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.queries_file != NULL) {
+        int line_number;
+        if (load_queries(options.queries_file, &line_number) != 0) {
+            if (line_number > 0) {
+                printf("Error: Invalid query on line %d of \"%s\".\n", line_number, options.queries_file);
+            }
+            else {
+                printf("Error: Could not read queries \"%s\".\n", options.queries_file);
+            }
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.benchmark && open_benchmark_caches() != 0) {
+        printf("Error: Could not create the benchmark caches.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Let's create an array to store our state data in. As we know, there are
+     * 50 US states. */
+    struct climate_info *states[NUM_STATES] = {NULL};
+
+    if (options.lsm_query != NULL) {
+        // an optional state code after the last colon
+        char *colon = strrchr(options.lsm_query, ':');
+        char *state = NULL;
+        if (colon != NULL && strlen(colon + 1) == 2) {
+            *colon = '\0';
+            state = colon + 1;
+        }
+        if (analyze_lsm(options.lsm_query, state, states) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    int i;
+    for (i = first_file; i < argc; ++i) {
+        /* TODO: Open the file for reading */
+        FILE *file = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+
+        /* TODO: If the file doesn't exist, print an error message and move on
+         * to the next file. */
+        if (file == NULL) {
+            printf("Error: File \"%s\" does not exist.\n", argv[i]);
+            continue;
+        }
+
+        /* TODO: Analyze the file */
+        // binary caches start with their magic, anything else is TDV
+        char magic[8];
+        size_t magic_length = fread(magic, 1, 8, file);
+        if (magic_length == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0) {
+            analyze_cache(file, states, NUM_STATES);
+        }
+        else if (file == stdin || fseek(file, 0, SEEK_SET) != 0) {
+            // pipes cannot be rewound, so the magic bytes are parsed first
+            if (analyze_stream(file, magic, magic_length, states) != 0) {
+                printf("Error: Could not read \"%s\".\n", argv[i]);
+            }
+        }
+        else {
+            analyze_file(file, states, NUM_STATES);
+        }
+        if (file != stdin) {
+            fclose(file);
+        }
+    }
+
+    if (cache_out != NULL && cache_close(cache_out) != 0) {
+        printf("Error: Could not write cache \"%s\".\n", options.cache_file);
+        return EXIT_FAILURE;
+    }
+    if (arrow_out != NULL && arrow_close(arrow_out, states) != 0) {
+        printf("Error: Could not write Arrow file \"%s\".\n", options.arrow_file);
+        return EXIT_FAILURE;
+    }
+    if (parquet_out != NULL && parquet_close(parquet_out) != 0) {
+        printf("Error: Could not write Parquet file \"%s\".\n", options.parquet_file);
+        return EXIT_FAILURE;
+    }
+    if (lsm_out != NULL && lsm_close(lsm_out) != 0) {
+        printf("Error: Could not write store \"%s\".\n", options.lsm_dir);
+        return EXIT_FAILURE;
+    }
+    // the end of the input closes the windows still open
+    if (stream_out != NULL && stream_close(stream_out, states) != 0) {
+        printf("Error: Could not write windows to \"%s\".\n", options.stream_file);
+        return EXIT_FAILURE;
+    }
+
+    // recompute the extremes that corrections retracted
+    if (options.upsert) {
+        settle_upserts(states);
+    }
+
+    if (series_failed) {
+        printf("Error: Not enough memory for the hourly series.\n");
+        return EXIT_FAILURE;
+    }
+    if (snow_failed) {
+        printf("Error: Not enough memory for the snow extents.\n");
+        return EXIT_FAILURE;
+    }
+    if (num_snow_skipped > 0) {
+        printf("Warning: %lu snow records with out-of-range timestamps were left out of the snow extents.\n",
+                num_snow_skipped);
+    }
+    if (num_series_skipped > 0) {
+        printf("Warning: %lu records with out-of-range timestamps were left out of the hourly series.\n",
+                num_series_skipped);
+    }
 
-        /* TODO: Analyze the file */
-        analyze_file(file, states, NUM_STATES);
-        fclose(file);
-    }
-
     /* Now that we have recorded data for each file, we'll summarize them: */
     print_report(states, NUM_STATES);
 
+    if (options.upsert) {
+        printf(" -- Upserts: %u keys, %lu corrections, %lu of %u hourly buckets recomputed --\n",
+                upserts.num_entries, upserts.num_corrections, upserts.num_recomputed, upserts.num_buckets);
+    }
+    if (stream_out != NULL) {
+        printf(" -- Stream: %lu windows finalized, %lu late records dropped, at most %d windows open --\n",
+                stream_out->num_emitted, stream_out->num_late, stream_out->max_open);
+        free(stream_out);
+    }
+    for (i = 0; i < num_queries; i++) {
+        if (write_query(&queries[i], i) != 0) {
+            printf("Error: Could not write query results to \"%s\".\n", queries[i].output);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.correlate_metric >= 0) {
+        print_correlation(states, NUM_STATES, options.correlate_metric);
+    }
+
+    if (normals != NULL) {
+        print_departures(normals, period_observed);
+    }
+
+    if (options.storm_cells) {
+        print_storm_cells(states, NUM_STATES);
+    }
+
+    if (regions != NULL) {
+        print_regions(regions);
+    }
+
+    if (options.nearest) {
+        print_nearest(options.nearest_latitude, options.nearest_longitude, options.nearest_k);
+    }
+
+    if (options.snow_extent && print_snow_extent(states, NUM_STATES, options.snow_extent_file) != 0) {
+        printf("Error: Could not write snow extents to \"%s\".\n", options.snow_extent_file);
+        return EXIT_FAILURE;
+    }
+
+    if (options.rolling && print_rolling(states, NUM_STATES, options.rolling_file) != 0) {
+        printf("Error: Could not write rolling values to \"%s\".\n", options.rolling_file);
+        return EXIT_FAILURE;
+    }
+
+    if (options.series_file != NULL && write_series_store(options.series_file) != 0) {
+        printf("Error: Could not write series store \"%s\".\n", options.series_file);
+        return EXIT_FAILURE;
+    }
+
+    if (options.history_file != NULL && write_history_store(options.history_file) != 0) {
+        printf("Error: Could not write history store \"%s\".\n", options.history_file);
+        return EXIT_FAILURE;
+    }
+
+    if (options.heatmap_file != NULL && write_heatmap(options.heatmap_file) != 0) {
+        printf("Error: Could not write heatmap \"%s\".\n", options.heatmap_file);
+        return EXIT_FAILURE;
+    }
+
+    if (normals_build != NULL && save_climatology(options.climatology_save_file, normals_build) != 0) {
+        printf("Error: Could not write climatology to \"%s\".\n", options.climatology_save_file);
+        return EXIT_FAILURE;
+    }
+
+    if (options.histogram_file != NULL
+            && export_histograms(options.histogram_file, states, NUM_STATES) != 0) {
+        printf("Error: Could not write histograms to \"%s\".\n", options.histogram_file);
+        return EXIT_FAILURE;
+    }
+
+    if (options.benchmark && run_benchmark() != 0) {
+        printf("Error: Could not run the benchmark.\n");
+        return EXIT_FAILURE;
+    }
+
     return 0;
 }
 
@@ -145,9 +2168,11 @@ int main(int argc, char *argv[]) {
 void analyze_file(FILE *file, struct climate_info **states/* *states[]*/, int num_states) {
     const int line_sz = 100;
     char line[line_sz];
-    char *token;
-    char delim[2] = {'\t'};
-    struct climate_info *new_state;
+    struct climate_info *info;
+    struct record rec;
+    struct parse_batch batch;
+    batch.count = 0;
+    (void) num_states;
 
     while (fgets(line, line_sz, file) != NULL) {
 
@@ -163,151 +2188,7275 @@ void analyze_file(FILE *file, struct climate_info **states/* *states[]*/, int nu
          *       * Update the climate_info structure as necessary.
          */
 
-        // ----------------------STATE CODE TOKEN--------------------
-        token = strtok(line, delim);
-        char* state_code = token;
-
-        // determine if state already exists in array
-        int state_index = findStateIndex(states, state_code);
-
-        // if state does not exist, create new entry
-        if (state_index < 0) {
-            // allocate memory for new state
-            new_state = (struct climate_info*) malloc(sizeof(struct climate_info));
-            // copy state code
-            strcpy(new_state->code, state_code);
-
-            // initialize new state
-            new_state->num_records = 0;
-            new_state->sum_temperature = 0;
-            new_state->sum_humidity = 0;
-            new_state->max_temperature = -1000;
-            new_state->min_temperature = 1000;
-            new_state->num_lightning = 0;
-            new_state->num_snowcover = 0;
-            new_state->sum_cloudcover = 0;
-            
-            // get the index of the next open spot in the array
-            if (state_index == -50) {
-                state_index = 0;
-            }
-            else {
-                state_index = state_index * -1;
-            }
-
-            // add new state to array
-            states[state_index] = new_state;
-        }
-        // increment number of records (could be at the end????)
-        states[state_index]->num_records++;
-        // ----------------------------------------------------------
-
-        // ----------------------TIMESTAMP TOKEN---------------------
-        token = strtok(NULL, delim);
-        char* timestamp = token;
-        long timestamp_long = atol(timestamp) / 1000;
-        // ----------------------------------------------------------
-
-        // ------------------GEOLOCATION TOKEN-----------------------
-        token = strtok(NULL, delim);
-        // char* geolocation = token;
-        // ----------------------------------------------------------
-
-        // ---------------------HUMIDITY TOKEN-----------------------
-        token = strtok(NULL, delim); // 0 -- 100%
-        char* humidity = token;
-        // convert the string to a long double
-        long double humidity_val = atof(humidity);
-        // add to the total humidity to calculate average later
-        new_state->sum_humidity += humidity_val; 
-        // ----------------------------------------------------------
-
-        // ---------------------SNOW TOKEN---------------------------
-        token = strtok(NULL, delim); // 0.0 or 1.0
-        char* snow = token;
-        // convert the string to a long double
-        long double snow_val = atof(snow);
-        // add to the total amounts snow cover
-        new_state->num_snowcover += snow_val;
-        // ----------------------------------------------------------
-
-        // -------------------CLOUD COVERAGE TOKEN-------------------
-        token = strtok(NULL, delim); // 0 -- 100%
-        char* cloudcover = token;
-        // convert the string to a long double
-        long double cloudcover_val = atof(cloudcover);
-        // add to the total cloud cover to calculate average later
-        new_state->sum_cloudcover += cloudcover_val;
-        // ----------------------------------------------------------
-
-        // ---------------------LIGHTNING TOKEN----------------------
-        token = strtok(NULL, delim); // 0.0 or 1.0
-        char* lightning = token;
-        // convert the string to a long double
-        long double lightning_val = atof(lightning);
-        // add to the total number of lightning strikes
-        new_state->num_lightning +=  lightning_val;
-        // ----------------------------------------------------------
-
-        // ---------------------PRESSURE TOKEN-----------------------
-        token = strtok(NULL, delim); 
-        // char* pressure = token;
-        // ----------------------------------------------------------
-
-        // ----------------SURFACE TEMPERATURE TOKEN-----------------
-        token = strtok(NULL, delim);
-        char* temperature = token;
-        // convert string to long double
-        long double temperature_val = atof(temperature);
-        // convert the temp in 'K' to 'F'
-        temperature_val = (temperature_val * 1.8) - 459.67;
-        
-        // add temperature to sum to calculate average later
-        new_state->sum_temperature += temperature_val;
-
-        // update max temperature if necessary
-        if (temperature_val > new_state->max_temperature) {
-            new_state->max_temperature = temperature_val;
-            // update max temp timestamp
-            new_state->max_temp_date = timestamp_long;
-        }
-
-        // update min temperature if necessary
-        if (temperature_val < new_state->min_temperature) {
-            new_state->min_temperature = temperature_val;
-            // update min temp timestamp
-            new_state->min_temp_date = timestamp_long;
-        }
-        // ----------------------------------------------------------
+        // skip malformed records and those rejected by --where, --within or --between
+        if (parse_line(line, &rec) != 0 || !record_selected(&options.filter, &rec)) {
+            continue;
+        }
+
+        int state_index = get_state_index(states, rec.code);
+        info = states[state_index];
+        // add to the total amounts of snow cover and lightning strikes
+        info->num_snowcover += rec.snow;
+        info->num_lightning += rec.lightning;
+
+        add_record(states, state_index, &rec, &batch);
     }
+    flush_batch(&batch, states);
 }
 
-void print_report(struct climate_info *states[], int num_states) {
-    printf("States found:\n");
-    int i;
-    for (i = 0; i < num_states; ++i) {
-        if (states[i] != NULL) {
-            struct climate_info *info = states[i];
-            printf("%s ", info->code);
+/* Returns the index of the state's entry in the states array, allocating
+ * and initializing a new entry in the next open spot if there is none. */
+int get_state_index(struct climate_info **states, char *state_code) {
+    struct climate_info *new_state;
+
+    // determine if state already exists in array
+    int state_index = findStateIndex(states, state_code);
+
+    // if state does not exist, create new entry
+    if (state_index < 0) {
+        // allocate memory for new state
+        new_state = (struct climate_info*) malloc(sizeof(struct climate_info));
+        // copy state code
+        strcpy(new_state->code, state_code);
+
+        // initialize new state
+        new_state->num_records = 0;
+        new_state->sum_temperature = 0;
+        new_state->sum_humidity = 0;
+        new_state->max_temperature = -1000;
+        new_state->min_temperature = 1000;
+        new_state->num_lightning = 0;
+        new_state->num_snowcover = 0;
+        new_state->sum_cloudcover = 0;
+        new_state->hourly = NULL;
+        new_state->snow = NULL;
+        memset(new_state->temp_hist, 0, sizeof(new_state->temp_hist));
+        memset(new_state->humidity_hist, 0, sizeof(new_state->humidity_hist));
+        memset(new_state->cloudcover_hist, 0, sizeof(new_state->cloudcover_hist));
+
+        // get the index of the next open spot in the array
+        if (state_index == -50) {
+            state_index = 0;
         }
+        else {
+            state_index = state_index * -1;
+        }
+
+        // add new state to array
+        states[state_index] = new_state;
     }
-    printf("\n");
+    return state_index;
+}
 
-    /* TODO: Print out the summary for each state. See format above. */
-    for (i = 0; i < num_states; i++) {
-        if (states[i] != NULL) {
-            // print data in proper format
-            printf(" -- State: %s --\n", states[i]->code);
-            printf("Number of Records: %lu\n", states[i]->num_records);
-            printf("Average Humidity: %.1Lf%%\n", (states[i]->sum_humidity) / states[i]->num_records);
-            printf("Average Temperature: %.1LfF\n", (states[i]->sum_temperature) / states[i]->num_records);
-            printf("Max Temperature: %.1lfF\n", states[i]->max_temperature);
-            printf("Max Temperature on: %s", ctime(&states[i]->max_temp_date));
-            printf("Min Temperature: %.1lfF\n", states[i]->min_temperature);
-            printf("Min Temperature on: %s", ctime(&states[i]->min_temp_date));
-            printf("Lightning Strikes: %lu\n", states[i]->num_lightning);
-            printf("Records with Snow Cover: %lu\n", states[i]->num_snowcover);
-            printf("Average Cloud Cover: %.1Lf%%\n", (states[i]->sum_cloudcover) / states[i]->num_records);
+/* Updates the state's summary and every enabled analysis with a parsed
+ * record. The snow and lightning counters are left to the caller, which
+ * may have them precomputed (see analyze_cache). */
+void add_record(struct climate_info **states, int state_index, const struct record *rec,
+        struct parse_batch *batch) {
+    struct climate_info *info = states[state_index];
+    long timestamp_long = rec->timestamp;
+    double temperature_val = rec->temperature;
+
+    // take out the key's earlier version, if this is a correction
+    if (options.upsert) {
+        upsert_record(states, state_index, rec);
+    }
+
+    // increment number of records (could be at the end????)
+    info->num_records++;
+    // add to the totals to calculate averages later
+    info->sum_humidity += rec->humidity;
+    info->sum_cloudcover += rec->cloudcover;
+    info->sum_temperature += temperature_val;
+
+    // update max temperature if necessary
+    if (temperature_val > info->max_temperature) {
+        info->max_temperature = temperature_val;
+        // update max temp timestamp
+        info->max_temp_date = timestamp_long;
+    }
+
+    // update min temperature if necessary
+    if (temperature_val < info->min_temperature) {
+        info->min_temperature = temperature_val;
+        // update min temp timestamp
+        info->min_temp_date = timestamp_long;
+    }
+
+    // copy the record into the binary cache being written
+    if (cache_out != NULL) {
+        cache_append(cache_out, state_index, rec);
+    }
+    if (arrow_out != NULL) {
+        arrow_append(arrow_out, state_index, rec);
+    }
+    if (parquet_out != NULL) {
+        parquet_append(parquet_out, rec);
+    }
+    if (lsm_out != NULL) {
+        lsm_append(lsm_out, rec);
+    }
+    if (stream_out != NULL) {
+        stream_add(stream_out, states, state_index, rec);
+    }
+    if (options.benchmark) {
+        int order;
+        for (order = CACHE_ORDER_MORTON; order < NUM_CACHE_ORDERS; order++) {
+            cache_append(benchmark_caches[order], state_index, rec);
+        }
+    }
+
+    // mark the location in the state's snow bitmap for the (local) day
+    if (options.snow_extent && rec->snow != 0 && !timestamp_in_range(timestamp_long)) {
+        num_snow_skipped++;
+    }
+    else if (options.snow_extent && rec->snow != 0) {
+        long day = day_index(local_timestamp(rec->code, timestamp_long));
+        if ((options.period_last_day < options.period_first_day
+                    || (day >= options.period_first_day && day <= options.period_last_day))
+                && add_snow(info, day, intern_geohash(rec->geohash)) != 0) {
+            snow_failed = 1;
         }
     }
-}
\ No newline at end of file
+
+    // keep the location's temperature/pressure series
+    if (options.series_file != NULL) {
+        add_series_point(intern_geohash(rec->geohash), rec);
+    }
+
+    // keep the record in its location's history
+    if (options.history_file != NULL) {
+        add_history_record(intern_geohash(rec->geohash), rec);
+    }
+
+    // keep the decoded location and value for the heatmap
+    if (options.heatmap_file != NULL) {
+        add_raster_point(rec);
+    }
+
+    // add the record to the region containing its location
+    if (regions != NULL) {
+        add_region_record(rec);
+    }
+
+    // update the location's aggregates for nearest-location queries
+    if (options.nearest) {
+        add_location_stats(intern_geohash(rec->geohash), rec);
+    }
+
+    // keep lightning-positive records for storm-cell clustering
+    if (options.storm_cells && rec->lightning != 0) {
+        add_strike(state_index, timestamp_long, rec->geohash);
+    }
+
+    // add the record to its hour of the state's hourly series (out-of-range times are only counted)
+    if (options.correlate_metric >= 0 || options.rolling) {
+        struct hour_bucket *bucket = timestamp_in_range(timestamp_long)
+            ? hourly_bucket(info, hour_index(timestamp_long)) : NULL;
+        if (bucket == NULL) {
+            num_series_skipped++;
+        }
+        else {
+            if (bucket->count == 0 || temperature_val > bucket->max_temperature) {
+                bucket->max_temperature = temperature_val;
+            }
+            if (bucket->count == 0 || temperature_val < bucket->min_temperature) {
+                bucket->min_temperature = temperature_val;
+            }
+            bucket->count++;
+            bucket->sum[METRIC_TEMPERATURE] += temperature_val;
+            bucket->sum[METRIC_HUMIDITY] += rec->humidity;
+            bucket->sum[METRIC_CLOUDCOVER] += rec->cloudcover;
+            bucket->sum[METRIC_PRESSURE] += rec->pressure;
+            bucket->sum[METRIC_SNOW] += rec->snow;
+            bucket->sum[METRIC_LIGHTNING] += rec->lightning;
+        }
+    }
+
+    // add the record to its (state, local day, local hour) climatology cells
+    if (normals_build != NULL || period_observed != NULL) {
+        add_climatology(rec->code, timestamp_long, temperature_val, rec->humidity, rec->snow != 0, 1);
+    }
+
+    // queue the values for histogram binning, and the record for the queries
+    if (num_queries > 0) {
+        batch->records[batch->count] = *rec;
+    }
+    batch->state_index[batch->count] = state_index;
+    batch->temperature[batch->count] = temperature_val;
+    batch->humidity[batch->count] = rec->humidity;
+    batch->cloudcover[batch->count] = rec->cloudcover;
+    if (++batch->count == BATCH_SIZE) {
+        flush_batch(batch, states);
+    }
+}
+
+/* Computes the histogram bin of each value: floor((value - min) / width),
+ * clamped to [0, num_bins - 1]. Four values at a time with SSE2. */
+void compute_bins(const float *values, int count, float min, float width, int num_bins, int *bins) {
+    const float inv_width = 1.0f / width;
+    const float last = (float) (num_bins - 1);
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 v_min = _mm_set1_ps(min);
+    const __m128 v_inv = _mm_set1_ps(inv_width);
+    const __m128 v_zero = _mm_setzero_ps();
+    const __m128 v_last = _mm_set1_ps(last);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(values + i), v_min), v_inv);
+        // clamp before truncating so truncation equals floor (NaN ends up in bin 0)
+        x = _mm_min_ps(_mm_max_ps(x, v_zero), v_last);
+        _mm_storeu_si128((__m128i *) (bins + i), _mm_cvttps_epi32(x));
+    }
+#endif
+    for (; i < count; i++) {
+        float x = (values[i] - min) * inv_width;
+        if (!(x > 0.0f)) {
+            x = 0.0f;
+        }
+        if (x > last) {
+            x = last;
+        }
+        bins[i] = (int) x;
+    }
+}
+
+// bins the batched values into their states' histograms and empties the batch
+void flush_batch(struct parse_batch *batch, struct climate_info *states[]) {
+    int bins[BATCH_SIZE];
+    int i;
+
+    if (num_queries > 0) {
+        run_queries(batch->records, batch->count);
+    }
+    compute_bins(batch->temperature, batch->count, TEMP_HIST_MIN, 1.0f, TEMP_HIST_BINS, bins);
+    for (i = 0; i < batch->count; i++) {
+        states[batch->state_index[i]]->temp_hist[bins[i]]++;
+    }
+    compute_bins(batch->humidity, batch->count, 0.0f, PERCENT_HIST_WIDTH, PERCENT_HIST_BINS, bins);
+    for (i = 0; i < batch->count; i++) {
+        states[batch->state_index[i]]->humidity_hist[bins[i]]++;
+    }
+    compute_bins(batch->cloudcover, batch->count, 0.0f, PERCENT_HIST_WIDTH, PERCENT_HIST_BINS, bins);
+    for (i = 0; i < batch->count; i++) {
+        states[batch->state_index[i]]->cloudcover_hist[bins[i]]++;
+    }
+    batch->count = 0;
+}
+
+// returns the index of the named metric, or -1
+int find_metric(const char *name) {
+    int i;
+    for (i = 0; i < NUM_METRICS; i++) {
+        if (strcmp(name, metric_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Adds (sign 1) or retracts (sign -1) a record's values in its (state,
+ * local day, local hour) cells of the normals being built and of the
+ * target period. */
+void add_climatology(const char *code, long timestamp, double temperature, double humidity, int snow,
+        int sign) {
+    int slot = state_slot(code);
+    long local = local_timestamp(code, timestamp);
+    long day = day_index(local);
+    int hour = (int) ((local - day * 86400) / 3600);
+    struct climatology_cell *cell = NULL;
+
+    if (normals_build != NULL && slot >= 0) {
+        int year, month, day_of_month;
+        civil_from_days(day, &year, &month, &day_of_month);
+        cell = climatology_cell(normals_build, slot, climatology_day(month, day_of_month), hour);
+        cell->sum_temperature += sign * temperature;
+        cell->sum_humidity += sign * humidity;
+        cell->num_snowcover += sign * snow;
+        cell->num_records += sign;
+    }
+    if (period_observed != NULL && slot >= 0 && day >= period_observed->first_day
+            && day < period_observed->first_day + period_observed->num_days) {
+        cell = climatology_cell(period_observed, slot,
+                (int) (day - period_observed->first_day), hour);
+        cell->sum_temperature += sign * temperature;
+        cell->sum_humidity += sign * humidity;
+        cell->num_snowcover += sign * snow;
+        cell->num_records += sign;
+    }
+}
+
+// whether a timestamp is between EARLIEST_TIMESTAMP and latest_timestamp
+int timestamp_in_range(long timestamp) {
+    return timestamp >= EARLIEST_TIMESTAMP && timestamp <= latest_timestamp;
+}
+
+// hour of a timestamp for the hourly series, rounded down for times before 1970
+long hour_index(long timestamp) {
+    return (timestamp >= 0 ? timestamp : timestamp - 3599) / 3600;
+}
+
+// day of a timestamp (days since 1970-01-01), rounded down for times before 1970
+long day_index(long timestamp) {
+    return (timestamp >= 0 ? timestamp : timestamp - 86399) / 86400;
+}
+
+/* Returns the bucket for the given hour in the state's hourly series,
+ * creating the series and growing it (at either end) as needed. Returns
+ * NULL, and sets series_failed, if the series can't be allocated. */
+struct hour_bucket *hourly_bucket(struct climate_info *info, long hour) {
+    struct hourly_series *series = info->hourly;
+    if (series == NULL) {
+        series = (struct hourly_series*) malloc(sizeof(struct hourly_series));
+        if (series == NULL) {
+            series_failed = 1;
+            return NULL;
+        }
+        info->hourly = series;
+        series->first_hour = hour;
+        series->num_hours = 0;
+        series->capacity = 0;
+        series->buckets = NULL;
+    }
+
+    long offset = hour - series->first_hour;
+    if (offset < 0 || offset >= series->num_hours) {
+        long first = offset < 0 ? hour : series->first_hour;
+        long needed = (offset < 0 ? series->first_hour + series->num_hours : hour + 1) - first;
+        long shift = series->first_hour - first;
+
+        if (needed > series->capacity) {
+            long capacity = series->capacity == 0 ? 256 : series->capacity;
+            struct hour_bucket *buckets;
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+            buckets = (struct hour_bucket*) realloc(series->buckets, capacity * sizeof(struct hour_bucket));
+            if (buckets == NULL) {
+                series_failed = 1;
+                return NULL;
+            }
+            series->buckets = buckets;
+            series->capacity = capacity;
+        }
+        // slide existing buckets up when growing at the front
+        if (shift > 0) {
+            memmove(series->buckets + shift, series->buckets,
+                    series->num_hours * sizeof(struct hour_bucket));
+            memset(series->buckets, 0, shift * sizeof(struct hour_bucket));
+        }
+        memset(series->buckets + shift + series->num_hours, 0,
+                (needed - shift - series->num_hours) * sizeof(struct hour_bucket));
+        series->first_hour = first;
+        series->num_hours = needed;
+        offset = hour - first;
+    }
+    return &series->buckets[offset];
+}
+
+/* Blocked matrix product C = A * B^T, where A is m x k, B is n x k and C is
+ * m x n, all row-major. The k dimension is split into GEMM_BLOCK columns so
+ * the rows being combined stay in cache, and full 4x4 tiles of C are
+ * accumulated in registers. */
+void gemm_nt(const double *a, const double *b, double *c, int m, int n, int k) {
+    int i, j, p, kk;
+    memset(c, 0, (size_t) m * n * sizeof(double));
+
+    for (kk = 0; kk < k; kk += GEMM_BLOCK) {
+        int kend = kk + GEMM_BLOCK < k ? kk + GEMM_BLOCK : k;
+
+        for (i = 0; i < m; i += 4) {
+            for (j = 0; j < n; j += 4) {
+                if (i + 4 <= m && j + 4 <= n) {
+                    double acc[4][4] = {{0}};
+                    const double *a0 = a + (size_t) i * k, *a1 = a0 + k, *a2 = a1 + k, *a3 = a2 + k;
+                    const double *b0 = b + (size_t) j * k, *b1 = b0 + k, *b2 = b1 + k, *b3 = b2 + k;
+                    int r, s;
+                    for (p = kk; p < kend; p++) {
+                        double av[4] = {a0[p], a1[p], a2[p], a3[p]};
+                        double bv[4] = {b0[p], b1[p], b2[p], b3[p]};
+                        for (r = 0; r < 4; r++) {
+                            for (s = 0; s < 4; s++) {
+                                acc[r][s] += av[r] * bv[s];
+                            }
+                        }
+                    }
+                    for (r = 0; r < 4; r++) {
+                        for (s = 0; s < 4; s++) {
+                            c[(size_t) (i + r) * n + j + s] += acc[r][s];
+                        }
+                    }
+                }
+                else {
+                    // partial tile on the right/bottom edge
+                    int r, s;
+                    for (r = i; r < m && r < i + 4; r++) {
+                        for (s = j; s < n && s < j + 4; s++) {
+                            double sum = 0;
+                            for (p = kk; p < kend; p++) {
+                                sum += a[(size_t) r * k + p] * b[(size_t) s * k + p];
+                            }
+                            c[(size_t) r * n + s] += sum;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Prints the Pearson correlation between every pair of states of the hourly
+ * mean of a metric, after removing each state's mean for the hour of day
+ * (so the shared daily cycle doesn't dominate). Hours missing in either
+ * state are skipped pairwise: with X the anomalies (0 where missing) and M
+ * the 0/1 presence mask, the pairwise sums are X*X^T, X*M^T, X^2*M^T and
+ * M*M^T, all computed with the blocked product. */
+void print_correlation(struct climate_info *states[], int num_states, int metric) {
+    struct climate_info *found[NUM_STATES];
+    int num_found = 0;
+    long first = 0, last = 0;
+    int i, j;
+
+    for (i = 0; i < num_states; i++) {
+        if (states[i] != NULL && states[i]->hourly != NULL && states[i]->hourly->num_hours > 0) {
+            struct hourly_series *series = states[i]->hourly;
+            if (num_found == 0 || series->first_hour < first) {
+                first = series->first_hour;
+            }
+            if (num_found == 0 || series->first_hour + series->num_hours > last) {
+                last = series->first_hour + series->num_hours;
+            }
+            found[num_found++] = states[i];
+        }
+    }
+    if (num_found == 0) {
+        return;
+    }
+
+    int hours = (int) (last - first);
+    size_t cells = (size_t) num_found * hours;
+    double *x = (double*) calloc(cells, sizeof(double));
+    double *x2 = (double*) calloc(cells, sizeof(double));
+    double *mask = (double*) calloc(cells, sizeof(double));
+    size_t pairs = (size_t) num_found * num_found;
+    double *xx = (double*) malloc(pairs * sizeof(double));
+    double *xm = (double*) malloc(pairs * sizeof(double));
+    double *x2m = (double*) malloc(pairs * sizeof(double));
+    double *mm = (double*) malloc(pairs * sizeof(double));
+
+    // align the series on [first, last) as hourly mean anomalies
+    for (i = 0; i < num_found; i++) {
+        struct hourly_series *series = found[i]->hourly;
+        double diurnal_sum[24] = {0};
+        int diurnal_count[24] = {0};
+        long h;
+
+        for (h = 0; h < series->num_hours; h++) {
+            struct hour_bucket *bucket = &series->buckets[h];
+            if (bucket->count > 0) {
+                int hour_of_day = (int) (((series->first_hour + h) % 24 + 24) % 24);
+                diurnal_sum[hour_of_day] += bucket->sum[metric] / bucket->count;
+                diurnal_count[hour_of_day]++;
+            }
+        }
+        for (h = 0; h < series->num_hours; h++) {
+            struct hour_bucket *bucket = &series->buckets[h];
+            if (bucket->count > 0) {
+                int hour_of_day = (int) (((series->first_hour + h) % 24 + 24) % 24);
+                size_t cell = (size_t) i * hours + (series->first_hour - first) + h;
+                x[cell] = bucket->sum[metric] / bucket->count
+                    - diurnal_sum[hour_of_day] / diurnal_count[hour_of_day];
+                x2[cell] = x[cell] * x[cell];
+                mask[cell] = 1.0;
+            }
+        }
+    }
+
+    gemm_nt(x, x, xx, num_found, num_found, hours);
+    gemm_nt(x, mask, xm, num_found, num_found, hours);
+    gemm_nt(x2, mask, x2m, num_found, num_found, hours);
+    gemm_nt(mask, mask, mm, num_found, num_found, hours);
+
+    printf("Hourly %s anomaly correlation (%d hours):\n", metric_names[metric], hours);
+    printf("    ");
+    for (j = 0; j < num_found; j++) {
+        printf("%7s", found[j]->code);
+    }
+    printf("\n");
+    for (i = 0; i < num_found; i++) {
+        printf("%-4s", found[i]->code);
+        for (j = 0; j < num_found; j++) {
+            size_t ij = (size_t) i * num_found + j, ji = (size_t) j * num_found + i;
+            double n = mm[ij];
+            double cov = n * xx[ij] - xm[ij] * xm[ji];
+            double var_i = n * x2m[ij] - xm[ij] * xm[ij];
+            double var_j = n * x2m[ji] - xm[ji] * xm[ji];
+            if (n < 3 || var_i <= 0 || var_j <= 0) {
+                printf("%7s", "n/a");
+            }
+            else {
+                printf("%7.3f", cov / sqrt(var_i * var_j));
+            }
+        }
+        printf("\n");
+    }
+
+    free(x);
+    free(x2);
+    free(mask);
+    free(xx);
+    free(xm);
+    free(x2m);
+    free(mm);
+}
+
+/* Adds the summary in src into dst (same state, e.g. from another thread or
+ * file). Histograms merge by simple addition. */
+void merge_climate_info(struct climate_info *dst, const struct climate_info *src) {
+    int i;
+    dst->num_records += src->num_records;
+    dst->sum_temperature += src->sum_temperature;
+    dst->sum_humidity += src->sum_humidity;
+    if (src->max_temperature > dst->max_temperature) {
+        dst->max_temperature = src->max_temperature;
+        dst->max_temp_date = src->max_temp_date;
+    }
+    if (src->min_temperature < dst->min_temperature) {
+        dst->min_temperature = src->min_temperature;
+        dst->min_temp_date = src->min_temp_date;
+    }
+    dst->num_lightning += src->num_lightning;
+    dst->num_snowcover += src->num_snowcover;
+    dst->sum_cloudcover += src->sum_cloudcover;
+    for (i = 0; i < TEMP_HIST_BINS; i++) {
+        dst->temp_hist[i] += src->temp_hist[i];
+    }
+    for (i = 0; i < PERCENT_HIST_BINS; i++) {
+        dst->humidity_hist[i] += src->humidity_hist[i];
+        dst->cloudcover_hist[i] += src->cloudcover_hist[i];
+    }
+}
+
+void print_report(struct climate_info *states[], int num_states) {
+    printf("States found:\n");
+    int i;
+    for (i = 0; i < num_states; ++i) {
+        if (states[i] != NULL) {
+            struct climate_info *info = states[i];
+            printf("%s ", info->code);
+        }
+    }
+    printf("\n");
+
+    /* TODO: Print out the summary for each state. See format above. */
+    for (i = 0; i < num_states; i++) {
+        if (states[i] != NULL) {
+            // print data in proper format
+            printf(" -- State: %s --\n", states[i]->code);
+            printf("Number of Records: %lu\n", states[i]->num_records);
+            printf("Average Humidity: %.1Lf%%\n", (states[i]->sum_humidity) / states[i]->num_records);
+            printf("Average Temperature: %.1LfF\n", (states[i]->sum_temperature) / states[i]->num_records);
+            printf("Max Temperature: %.1lfF\n", states[i]->max_temperature);
+            printf("Max Temperature on: %s", local_ctime(states[i]->code, states[i]->max_temp_date));
+            printf("Min Temperature: %.1lfF\n", states[i]->min_temperature);
+            printf("Min Temperature on: %s", local_ctime(states[i]->code, states[i]->min_temp_date));
+            printf("Lightning Strikes: %lu\n", states[i]->num_lightning);
+            printf("Records with Snow Cover: %lu\n", states[i]->num_snowcover);
+            printf("Average Cloud Cover: %.1Lf%%\n", (states[i]->sum_cloudcover) / states[i]->num_records);
+            if (options.print_histograms) {
+                print_histograms(states[i]);
+            }
+        }
+    }
+}
+
+// prints the non-empty bins of a state's histograms
+void print_histograms(struct climate_info *info) {
+    int i;
+    printf("Temperature Histogram (1F bins):\n");
+    for (i = 0; i < TEMP_HIST_BINS; i++) {
+        if (info->temp_hist[i] != 0) {
+            printf("  %4.0fF: %lu\n", TEMP_HIST_MIN + i, info->temp_hist[i]);
+        }
+    }
+    printf("Humidity Histogram (5%% bins):\n");
+    for (i = 0; i < PERCENT_HIST_BINS; i++) {
+        if (info->humidity_hist[i] != 0) {
+            printf("  %3.0f%%: %lu\n", i * PERCENT_HIST_WIDTH, info->humidity_hist[i]);
+        }
+    }
+    printf("Cloud Cover Histogram (5%% bins):\n");
+    for (i = 0; i < PERCENT_HIST_BINS; i++) {
+        if (info->cloudcover_hist[i] != 0) {
+            printf("  %3.0f%%: %lu\n", i * PERCENT_HIST_WIDTH, info->cloudcover_hist[i]);
+        }
+    }
+}
+
+/* Writes every bin of every state's histograms as CSV rows:
+ * state,metric,bin_low,bin_high,count. Returns 0 on success. */
+int export_histograms(const char *path, struct climate_info *states[], int num_states) {
+    FILE *out = fopen(path, "w");
+    int i, j;
+    if (out == NULL) {
+        return -1;
+    }
+    fprintf(out, "state,metric,bin_low,bin_high,count\n");
+    for (i = 0; i < num_states; i++) {
+        if (states[i] == NULL) {
+            continue;
+        }
+        for (j = 0; j < TEMP_HIST_BINS; j++) {
+            fprintf(out, "%s,temperature,%.0f,%.0f,%lu\n", states[i]->code,
+                    TEMP_HIST_MIN + j, TEMP_HIST_MIN + j + 1, states[i]->temp_hist[j]);
+        }
+        for (j = 0; j < PERCENT_HIST_BINS; j++) {
+            fprintf(out, "%s,humidity,%.0f,%.0f,%lu\n", states[i]->code,
+                    j * PERCENT_HIST_WIDTH, (j + 1) * PERCENT_HIST_WIDTH, states[i]->humidity_hist[j]);
+        }
+        for (j = 0; j < PERCENT_HIST_BINS; j++) {
+            fprintf(out, "%s,cloudcover,%.0f,%.0f,%lu\n", states[i]->code,
+                    j * PERCENT_HIST_WIDTH, (j + 1) * PERCENT_HIST_WIDTH, states[i]->cloudcover_hist[j]);
+        }
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+void init_state_slots(void) {
+    int i;
+    memset(state_slots, -1, sizeof(state_slots));
+    for (i = 0; i < NUM_STATES; i++) {
+        state_slots[(state_codes[i][0] - 'A') * 26 + (state_codes[i][1] - 'A')] = (signed char) i;
+    }
+}
+
+/* Returns the slot (index into state_codes) of a two-letter state code, or
+ * -1. The slot comes from a 26 x 26 table, so this is an index computation
+ * rather than a search. */
+int state_slot(const char *code) {
+    pthread_once(&state_slots_once, init_state_slots);
+    if (code[0] < 'A' || code[0] > 'Z' || code[1] < 'A' || code[1] > 'Z' || code[2] != '\0') {
+        return -1;
+    }
+    return state_slots[(code[0] - 'A') * 26 + (code[1] - 'A')];
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date, and its inverse
+ * (H. Hinnant's civil calendar algorithms). */
+long days_from_civil(int year, int month, int day) {
+    long y = month <= 2 ? year - 1 : year;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+void civil_from_days(long days, int *year, int *month, int *day) {
+    long z = days + 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    long doe = z - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    *day = (int) (doy - (153 * mp + 2) / 5 + 1);
+    *month = (int) (mp < 10 ? mp + 3 : mp - 9);
+    *year = (int) (yoe + era * 400 + (*month <= 2));
+}
+
+/* Day of the year of a date in a leap year (0 - 365): Feb 29 has its own
+ * slot and 1 Mar is day 60 in every year. */
+int climatology_day(int month, int day) {
+    return (int) (days_from_civil(2000, month, day) - days_from_civil(2000, 1, 1));
+}
+
+// day of the week (0 = Sunday) of a day since 1970-01-01, a Thursday
+int weekday_from_days(long days) {
+    return (int) ((days % 7 + 11) % 7);
+}
+
+/* Returns the UTC offset in seconds of a zone at a UNIX timestamp and sets
+ * *dst if daylight saving time is in effect. The DST transitions (US rules)
+ * of every year from TZ_FIRST_YEAR to TZ_LAST_YEAR are computed once, as UTC
+ * timestamps, and looked up by binary search; outside those years, and in
+ * zones without DST, the standard offset applies. */
+long zone_offset(int zone, long timestamp, int *dst) {
+    static long transitions[NUM_ZONES][2 * TZ_YEARS];
+    static int initialized = 0;
+    const struct time_zone *tz = &time_zones[zone];
+    int low = 0, high = tz->observes_dst ? 2 * TZ_YEARS : 0;
+
+    if (!initialized) {
+        int z, year;
+        for (z = 0; z < NUM_ZONES; z++) {
+            long standard = time_zones[z].offset_hours * 3600L;
+            for (year = TZ_FIRST_YEAR; year <= TZ_LAST_YEAR; year++) {
+                long start, end, first;
+                if (year >= 2007) {
+                    // second Sunday in March to first Sunday in November
+                    first = days_from_civil(year, 3, 1);
+                    start = first + (7 - weekday_from_days(first)) % 7 + 7;
+                    first = days_from_civil(year, 11, 1);
+                    end = first + (7 - weekday_from_days(first)) % 7;
+                }
+                else {
+                    // first (from 1987) or last Sunday in April to last Sunday in October
+                    first = days_from_civil(year, 4, 1);
+                    start = first + (7 - weekday_from_days(first)) % 7;
+                    if (year < 1987) {
+                        start += (days_from_civil(year, 5, 1) - 1 - start) / 7 * 7;
+                    }
+                    first = days_from_civil(year, 11, 1) - 1;
+                    end = first - weekday_from_days(first);
+                }
+                // at 2:00 local standard time and 2:00 local daylight time
+                transitions[z][2 * (year - TZ_FIRST_YEAR)] = start * 86400 + 7200 - standard;
+                transitions[z][2 * (year - TZ_FIRST_YEAR) + 1] = end * 86400 + 3600 - standard;
+            }
+        }
+        initialized = 1;
+    }
+
+    // number of transitions at or before the timestamp; odd means DST
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (transitions[zone][mid] <= timestamp) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    *dst = low % 2;
+    return (tz->offset_hours + *dst) * 3600L;
+}
+
+// time zone of a state, -1 for codes that are not a state (reported in UTC)
+int state_zone(const char *code) {
+    int slot = state_slot(code);
+    return slot >= 0 ? state_zones[slot] : -1;
+}
+
+// shifts a UNIX timestamp to the state's local time, for bucketing by local day or hour
+long local_timestamp(const char *code, long timestamp) {
+    int zone = state_zone(code), dst;
+    return zone >= 0 ? timestamp + zone_offset(zone, timestamp, &dst) : timestamp;
+}
+
+/* Formats a timestamp like ctime() ("Mon Aug  3 06:00:00 2015 CDT\n"), but
+ * in the state's local time. Returns a static buffer. */
+const char *local_ctime(const char *code, long timestamp) {
+    static const char *weekdays[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char *months[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    static char text[40];
+    int zone = state_zone(code), dst = 0, year, month, day;
+    long local = timestamp + (zone >= 0 ? zone_offset(zone, timestamp, &dst) : 0);
+    long days = day_index(local);
+    long seconds = local - days * 86400;
+    const char *name = zone < 0 ? "UTC" : dst ? time_zones[zone].daylight_name : time_zones[zone].standard_name;
+
+    civil_from_days(days, &year, &month, &day);
+    snprintf(text, sizeof(text), "%s %s %2d %02ld:%02ld:%02ld %d %s\n", weekdays[weekday_from_days(days)],
+            months[month - 1], day, seconds / 3600, seconds / 60 % 60, seconds % 60, year, name);
+    return text;
+}
+
+// parses "YYYY-MM-DD:YYYY-MM-DD" into an inclusive range of days since 1970
+int parse_period(const char *text, long *first_day, long *last_day) {
+    int y1, m1, d1, y2, m2, d2;
+    if (sscanf(text, "%d-%d-%d:%d-%d-%d", &y1, &m1, &d1, &y2, &m2, &d2) != 6
+            || m1 < 1 || m1 > 12 || d1 < 1 || d1 > 31
+            || m2 < 1 || m2 > 12 || d2 < 1 || d2 > 31) {
+        return -1;
+    }
+    *first_day = days_from_civil(y1, m1, d1);
+    *last_day = days_from_civil(y2, m2, d2);
+    return *last_day < *first_day ? -1 : 0;
+}
+
+struct climatology *new_climatology(long first_day, int num_days) {
+    struct climatology *table = (struct climatology*) malloc(sizeof(struct climatology));
+    table->first_day = first_day;
+    table->num_days = num_days;
+    table->cells = (struct climatology_cell*) calloc(
+            (size_t) NUM_STATES * num_days * CLIMATOLOGY_HOURS, sizeof(struct climatology_cell));
+    return table;
+}
+
+struct climatology_cell *climatology_cell(struct climatology *table, int slot, int day, int hour) {
+    return &table->cells[((size_t) slot * table->num_days + day) * CLIMATOLOGY_HOURS + hour];
+}
+
+/* Climatology file: the 8-byte magic, version, then the dimensions
+ * (states, days, hours) as 32-bit integers, followed by the raw cells. */
+int save_climatology(const char *path, struct climatology *table) {
+    FILE *out = fopen(path, "wb");
+    uint32_t header[4] = {CLIMATOLOGY_VERSION, NUM_STATES, (uint32_t) table->num_days, CLIMATOLOGY_HOURS};
+    size_t num_cells = (size_t) NUM_STATES * table->num_days * CLIMATOLOGY_HOURS;
+    int ok;
+    if (out == NULL) {
+        return -1;
+    }
+    ok = fwrite(CLIMATOLOGY_MAGIC, 1, 8, out) == 8
+        && fwrite(header, sizeof(header), 1, out) == 1
+        && fwrite(table->cells, sizeof(struct climatology_cell), num_cells, out) == num_cells;
+    return fclose(out) == 0 && ok ? 0 : -1;
+}
+
+struct climatology *load_climatology(const char *path) {
+    FILE *in = fopen(path, "rb");
+    char magic[8];
+    uint32_t header[4];
+    struct climatology *table;
+    size_t num_cells = (size_t) NUM_STATES * CLIMATOLOGY_DAYS * CLIMATOLOGY_HOURS;
+    if (in == NULL) {
+        return NULL;
+    }
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, CLIMATOLOGY_MAGIC, 8) != 0
+            || fread(header, sizeof(header), 1, in) != 1 || header[0] != CLIMATOLOGY_VERSION
+            || header[1] != NUM_STATES || header[2] != CLIMATOLOGY_DAYS || header[3] != CLIMATOLOGY_HOURS) {
+        fclose(in);
+        return NULL;
+    }
+    table = new_climatology(0, CLIMATOLOGY_DAYS);
+    if (fread(table->cells, sizeof(struct climatology_cell), num_cells, in) != num_cells) {
+        free(table->cells);
+        free(table);
+        table = NULL;
+    }
+    fclose(in);
+    return table;
+}
+
+/* Prints, per state and day of the target period, the observed means minus
+ * the normals. The normal for a day is the normals' hourly means weighted by
+ * the number of records observed in each hour, so days with only a few
+ * observed hours are compared like for like. */
+void print_departures(struct climatology *normals, struct climatology *observed) {
+    int slot, day, hour;
+    for (slot = 0; slot < NUM_STATES; slot++) {
+        int printed_header = 0;
+        for (day = 0; day < observed->num_days; day++) {
+            long days = observed->first_day + day;
+            int year, month, day_of_month;
+            double obs_temperature = 0, obs_humidity = 0, obs_snow = 0;
+            double normal_temperature = 0, normal_humidity = 0, normal_snow = 0;
+            unsigned long weight = 0;
+
+            civil_from_days(days, &year, &month, &day_of_month);
+            int day_of_year = climatology_day(month, day_of_month);
+
+            for (hour = 0; hour < CLIMATOLOGY_HOURS; hour++) {
+                struct climatology_cell *obs = climatology_cell(observed, slot, day, hour);
+                struct climatology_cell *normal = climatology_cell(normals, slot, day_of_year, hour);
+                if (obs->num_records == 0 || normal->num_records == 0) {
+                    continue;
+                }
+                obs_temperature += obs->sum_temperature;
+                obs_humidity += obs->sum_humidity;
+                obs_snow += obs->num_snowcover;
+                normal_temperature += obs->num_records * (double) normal->sum_temperature / normal->num_records;
+                normal_humidity += obs->num_records * (double) normal->sum_humidity / normal->num_records;
+                normal_snow += obs->num_records * (double) normal->num_snowcover / normal->num_records;
+                weight += obs->num_records;
+            }
+            if (weight == 0) {
+                continue;
+            }
+
+            if (!printed_header) {
+                printf(" -- State: %s departures from normal --\n", state_codes[slot]);
+                printf("Date        Temperature  Humidity  Snow Cover\n");
+                printed_header = 1;
+            }
+            printf("%04d-%02d-%02d  %+10.1fF  %+7.1f%%  %+9.1f%%\n", year, month, day_of_month,
+                    (obs_temperature - normal_temperature) / weight,
+                    (obs_humidity - normal_humidity) / weight,
+                    100.0 * (obs_snow - normal_snow) / weight);
+        }
+    }
+}
+
+void ring_window_init(struct ring_window *window, int size) {
+    window->size = size;
+    window->pos = 0;
+    window->sum = 0;
+    window->values = (double*) calloc(size, sizeof(double));
+}
+
+// adds the newest value, dropping the oldest one from the sum
+void ring_window_push(struct ring_window *window, double value) {
+    window->sum += value - window->values[window->pos];
+    window->values[window->pos] = value;
+    window->pos = (window->pos + 1) % window->size;
+}
+
+void extreme_queue_init(struct extreme_queue *queue, int capacity) {
+    queue->capacity = capacity;
+    queue->in_count = 0;
+    queue->out_count = 0;
+    queue->in = (struct extreme_entry*) malloc(capacity * sizeof(struct extreme_entry));
+    queue->out = (struct extreme_entry*) malloc(capacity * sizeof(struct extreme_entry));
+}
+
+void extreme_queue_push(struct extreme_queue *queue, double max, double min) {
+    struct extreme_entry *entry = &queue->in[queue->in_count];
+    entry->max = entry->stack_max = max;
+    entry->min = entry->stack_min = min;
+    if (queue->in_count > 0) {
+        if (entry[-1].stack_max > max) {
+            entry->stack_max = entry[-1].stack_max;
+        }
+        if (entry[-1].stack_min < min) {
+            entry->stack_min = entry[-1].stack_min;
+        }
+    }
+    queue->in_count++;
+}
+
+// removes the oldest entry, refilling the out stack from the in stack when empty
+void extreme_queue_pop(struct extreme_queue *queue) {
+    if (queue->out_count == 0) {
+        while (queue->in_count > 0) {
+            struct extreme_entry *from = &queue->in[--queue->in_count];
+            struct extreme_entry *to = &queue->out[queue->out_count];
+            to->max = to->stack_max = from->max;
+            to->min = to->stack_min = from->min;
+            if (queue->out_count > 0) {
+                if (to[-1].stack_max > to->max) {
+                    to->stack_max = to[-1].stack_max;
+                }
+                if (to[-1].stack_min < to->min) {
+                    to->stack_min = to[-1].stack_min;
+                }
+            }
+            queue->out_count++;
+        }
+    }
+    queue->out_count--;
+}
+
+void extreme_queue_extremes(struct extreme_queue *queue, double *max, double *min) {
+    *max = -DBL_MAX;
+    *min = DBL_MAX;
+    if (queue->in_count > 0) {
+        *max = queue->in[queue->in_count - 1].stack_max;
+        *min = queue->in[queue->in_count - 1].stack_min;
+    }
+    if (queue->out_count > 0) {
+        if (queue->out[queue->out_count - 1].stack_max > *max) {
+            *max = queue->out[queue->out_count - 1].stack_max;
+        }
+        if (queue->out[queue->out_count - 1].stack_min < *min) {
+            *min = queue->out[queue->out_count - 1].stack_min;
+        }
+    }
+}
+
+/* Slides 24-hour and 7-day windows over each state's hourly series in time
+ * order: each hour enters the ring buffers / extreme queue and the hour that
+ * falls out of the window leaves, so every step is constant time. Prints
+ * the peak windows per state and, if csv_path is set, writes the rolling
+ * values for every hour. Returns 0 on success. */
+int print_rolling(struct climate_info *states[], int num_states, const char *csv_path) {
+    FILE *csv = NULL;
+    int i;
+
+    if (csv_path != NULL) {
+        csv = fopen(csv_path, "w");
+        if (csv == NULL) {
+            return -1;
+        }
+        fprintf(csv, "state,window_end,lightning_24h,mean_temperature_7d,max_temperature_24h,min_temperature_24h\n");
+    }
+
+    for (i = 0; i < num_states; i++) {
+        if (states[i] == NULL || states[i]->hourly == NULL) {
+            continue;
+        }
+        struct hourly_series *series = states[i]->hourly;
+        struct ring_window lightning, temperature_sum, temperature_count;
+        struct extreme_queue extremes;
+        double peak_lightning = -1, max_mean = -DBL_MAX, min_mean = DBL_MAX, max_range = -1;
+        time_t peak_lightning_end = 0, max_mean_end = 0, min_mean_end = 0, max_range_end = 0;
+        long h;
+
+        ring_window_init(&lightning, SHORT_WINDOW_HOURS);
+        ring_window_init(&temperature_sum, LONG_WINDOW_HOURS);
+        ring_window_init(&temperature_count, LONG_WINDOW_HOURS);
+        extreme_queue_init(&extremes, SHORT_WINDOW_HOURS + 1);
+
+        for (h = 0; h < series->num_hours; h++) {
+            struct hour_bucket *bucket = &series->buckets[h];
+            time_t window_end = (time_t) (series->first_hour + h + 1) * 3600;
+            double mean = 0, max, min;
+            int full_short = h + 1 >= SHORT_WINDOW_HOURS, full_long = h + 1 >= LONG_WINDOW_HOURS;
+
+            ring_window_push(&lightning, bucket->sum[METRIC_LIGHTNING]);
+            ring_window_push(&temperature_sum, bucket->sum[METRIC_TEMPERATURE]);
+            ring_window_push(&temperature_count, (double) bucket->count);
+            if (h >= SHORT_WINDOW_HOURS) {
+                extreme_queue_pop(&extremes);
+            }
+            if (bucket->count > 0) {
+                extreme_queue_push(&extremes, bucket->max_temperature, bucket->min_temperature);
+            }
+            else {
+                // empty hours hold the identity so they never win
+                extreme_queue_push(&extremes, -DBL_MAX, DBL_MAX);
+            }
+            extreme_queue_extremes(&extremes, &max, &min);
+
+            if (full_short && lightning.sum > peak_lightning) {
+                peak_lightning = lightning.sum;
+                peak_lightning_end = window_end;
+            }
+            if (full_long && temperature_count.sum > 0) {
+                mean = temperature_sum.sum / temperature_count.sum;
+                if (mean > max_mean) {
+                    max_mean = mean;
+                    max_mean_end = window_end;
+                }
+                if (mean < min_mean) {
+                    min_mean = mean;
+                    min_mean_end = window_end;
+                }
+            }
+            if (full_short && max >= min && max - min > max_range) {
+                max_range = max - min;
+                max_range_end = window_end;
+            }
+
+            if (csv != NULL && full_short) {
+                fprintf(csv, "%s,%ld,%.0f,", states[i]->code, (long) window_end, lightning.sum);
+                if (full_long && temperature_count.sum > 0) {
+                    fprintf(csv, "%.2f", mean);
+                }
+                if (max >= min) {
+                    fprintf(csv, ",%.2f,%.2f\n", max, min);
+                }
+                else {
+                    fprintf(csv, ",,\n");
+                }
+            }
+        }
+
+        printf(" -- State: %s rolling windows --\n", states[i]->code);
+        if (peak_lightning >= 0) {
+            printf("Peak 24h Lightning Strikes: %.0f\n", peak_lightning);
+            printf("Peak 24h Lightning ending: %s", local_ctime(states[i]->code, peak_lightning_end));
+        }
+        if (max_mean_end != 0) {
+            printf("Max 7d Mean Temperature: %.1fF\n", max_mean);
+            printf("Max 7d Mean Temperature ending: %s", local_ctime(states[i]->code, max_mean_end));
+            printf("Min 7d Mean Temperature: %.1fF\n", min_mean);
+            printf("Min 7d Mean Temperature ending: %s", local_ctime(states[i]->code, min_mean_end));
+        }
+        if (max_range >= 0) {
+            printf("Max 24h Temperature Range: %.1fF\n", max_range);
+            printf("Max 24h Temperature Range ending: %s", local_ctime(states[i]->code, max_range_end));
+        }
+
+        free(lightning.values);
+        free(temperature_sum.values);
+        free(temperature_count.values);
+        free(extremes.in);
+        free(extremes.out);
+    }
+
+    if (csv != NULL) {
+        return fclose(csv) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/* Maps a geohash character to its 5-bit value, -1 for invalid characters. */
+int geohash_value(char c) {
+    static const char alphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    const char *found = c != '\0' ? strchr(alphabet, c) : NULL;
+    return found != NULL ? (int) (found - alphabet) : -1;
+}
+
+/* Grid cell of the first `length` characters of a geohash: the bits are
+ * de-interleaved into a longitude column x and latitude row y (longitude
+ * takes the even bits). Returns -1 for invalid or short geohashes. */
+int geohash_cell(const char *hash, int length, uint32_t *x, uint32_t *y) {
+    int i, bit, bit_index = 0;
+    *x = 0;
+    *y = 0;
+    for (i = 0; i < length; i++) {
+        int value = geohash_value(hash[i]);
+        if (value < 0) {
+            return -1;
+        }
+        for (bit = 4; bit >= 0; bit--, bit_index++) {
+            if (bit_index % 2 == 0) {
+                *x = (*x << 1) | ((value >> bit) & 1);
+            }
+            else {
+                *y = (*y << 1) | ((value >> bit) & 1);
+            }
+        }
+    }
+    return 0;
+}
+
+// decodes a geohash (up to 12 characters) to the center of its cell, returns -1 if invalid
+int geohash_decode(const char *hash, int length, double *latitude, double *longitude) {
+    uint32_t x, y;
+    int lon_bits = (5 * length + 1) / 2, lat_bits = 5 * length / 2;
+    if (length > GEOHASH_LENGTH || geohash_cell(hash, length, &x, &y) != 0) {
+        return -1;
+    }
+    *latitude = -90.0 + (y + 0.5) * 180.0 / ldexp(1.0, lat_bits);
+    *longitude = -180.0 + (x + 0.5) * 360.0 / ldexp(1.0, lon_bits);
+    return 0;
+}
+
+/* Geohash character codes: 1 + the character's 5-bit value, 0 for
+ * characters outside the alphabet. */
+static const uint8_t geohash_codes[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8,
+    ['8'] = 9, ['9'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15, ['g'] = 16,
+    ['h'] = 17, ['j'] = 18, ['k'] = 19, ['m'] = 20, ['n'] = 21, ['p'] = 22, ['q'] = 23, ['r'] = 24,
+    ['s'] = 25, ['t'] = 26, ['u'] = 27, ['v'] = 28, ['w'] = 29, ['x'] = 30, ['y'] = 31, ['z'] = 32,
+};
+
+// spreads the low 32 bits of value to the even bits of the result
+uint64_t spread_bits(uint64_t value) {
+#ifdef __BMI2__
+    return _pdep_u64(value, 0x5555555555555555ULL);
+#else
+    value &= 0xFFFFFFFFULL;
+    value = (value | (value << 16)) & 0x0000FFFF0000FFFFULL;
+    value = (value | (value << 8)) & 0x00FF00FF00FF00FFULL;
+    value = (value | (value << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    value = (value | (value << 2)) & 0x3333333333333333ULL;
+    value = (value | (value << 1)) & 0x5555555555555555ULL;
+    return value;
+#endif
+}
+
+// gathers the even bits of value into the low 32 bits of the result
+uint32_t compact_bits(uint64_t value) {
+#ifdef __BMI2__
+    return (uint32_t) _pext_u64(value, 0x5555555555555555ULL);
+#else
+    value &= 0x5555555555555555ULL;
+    value = (value | (value >> 1)) & 0x3333333333333333ULL;
+    value = (value | (value >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    value = (value | (value >> 4)) & 0x00FF00FF00FF00FFULL;
+    value = (value | (value >> 8)) & 0x0000FFFF0000FFFFULL;
+    value = (value | (value >> 16)) & 0x00000000FFFFFFFFULL;
+    return (uint32_t) value;
+#endif
+}
+
+// packs a 12-character geohash into its 60 bits, setting *invalid if a character is not in the alphabet
+uint64_t geohash_pack(const char *hash, uint32_t *invalid) {
+    uint64_t bits = 0;
+    int c;
+    for (c = 0; c < GEOHASH_LENGTH; c++) {
+        uint32_t code = geohash_codes[(unsigned char) hash[c]];
+        *invalid |= code == 0;
+        bits = (bits << 5) | ((code - 1) & 31);
+    }
+    return bits;
+}
+
+/* Decodes count 12-character geohashes (not terminated, as in a cache
+ * block's column) to the centers of their cells, giving the same values as
+ * geohash_decode without branching per bit: characters map through a lookup
+ * table, longitude and latitude bits are split with pext (BMI2) or shifts
+ * and masks, and the cells are scaled to degrees two at a time with SSE2.
+ * Invalid geohashes decode to NaN. Returns the number of invalid geohashes. */
+int geohash_decode_batch(const char (*hashes)[GEOHASH_LENGTH], int count, double *latitudes,
+        double *longitudes) {
+    const double lat_scale = 180.0 / (1 << GEOHASH_AXIS_BITS);
+    const double lon_scale = 360.0 / (1 << GEOHASH_AXIS_BITS);
+    int i = 0, num_invalid = 0;
+
+#ifdef __SSE2__
+    const __m128d half = _mm_set1_pd(0.5);
+    for (; i + 2 <= count; i += 2) {
+        uint32_t invalid0 = 0, invalid1 = 0;
+        uint64_t bits0 = geohash_pack(hashes[i], &invalid0);
+        uint64_t bits1 = geohash_pack(hashes[i + 1], &invalid1);
+        __m128i x = _mm_set_epi32(0, 0, (int) compact_bits(bits1 >> 1), (int) compact_bits(bits0 >> 1));
+        __m128i y = _mm_set_epi32(0, 0, (int) compact_bits(bits1), (int) compact_bits(bits0));
+        // all-one bits (a NaN) in the lanes of invalid geohashes
+        __m128d nan = _mm_castsi128_pd(_mm_set_epi64x(-(int64_t) invalid1, -(int64_t) invalid0));
+        __m128d latitude = _mm_add_pd(_mm_mul_pd(_mm_add_pd(_mm_cvtepi32_pd(y), half),
+                    _mm_set1_pd(lat_scale)), _mm_set1_pd(-90.0));
+        __m128d longitude = _mm_add_pd(_mm_mul_pd(_mm_add_pd(_mm_cvtepi32_pd(x), half),
+                    _mm_set1_pd(lon_scale)), _mm_set1_pd(-180.0));
+        _mm_storeu_pd(latitudes + i, _mm_or_pd(latitude, nan));
+        _mm_storeu_pd(longitudes + i, _mm_or_pd(longitude, nan));
+        num_invalid += invalid0 + invalid1;
+    }
+#endif
+    for (; i < count; i++) {
+        uint32_t invalid = 0;
+        uint64_t bits = geohash_pack(hashes[i], &invalid);
+        latitudes[i] = invalid ? NAN : -90.0 + (compact_bits(bits) + 0.5) * lat_scale;
+        longitudes[i] = invalid ? NAN : -180.0 + (compact_bits(bits >> 1) + 0.5) * lon_scale;
+        num_invalid += invalid;
+    }
+    return num_invalid;
+}
+
+/* Encodes count locations to 12-character geohashes (not terminated), the
+ * inverse of geohash_decode_batch: the cell coordinates are interleaved with
+ * pdep (BMI2) or shifts and masks and mapped 5 bits at a time through the
+ * alphabet. Coordinates outside the valid range are clamped. */
+void geohash_encode_batch(const double *latitudes, const double *longitudes, int count,
+        char (*hashes)[GEOHASH_LENGTH]) {
+    static const char alphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    const double cells = (double) (1 << GEOHASH_AXIS_BITS);
+    int i, c;
+    for (i = 0; i < count; i++) {
+        double x = fmin(fmax((longitudes[i] + 180.0) / 360.0 * cells, 0.0), cells - 1);
+        double y = fmin(fmax((latitudes[i] + 90.0) / 180.0 * cells, 0.0), cells - 1);
+        uint64_t bits = (spread_bits((uint32_t) x) << 1) | spread_bits((uint32_t) y);
+        for (c = 0; c < GEOHASH_LENGTH; c++) {
+            hashes[i][c] = alphabet[(bits >> (GEOHASH_BITS - 5 - 5 * c)) & 31];
+        }
+    }
+}
+
+void add_strike(int state_index, long timestamp, const char *geolocation) {
+    struct strike *strike;
+    if (num_strikes == strikes_capacity) {
+        strikes_capacity = strikes_capacity == 0 ? 1024 : strikes_capacity * 2;
+        strikes = (struct strike*) realloc(strikes, strikes_capacity * sizeof(struct strike));
+    }
+    strike = &strikes[num_strikes];
+    if (geohash_decode(geolocation, GEOHASH_LENGTH, &strike->latitude, &strike->longitude) != 0
+            || geohash_cell(geolocation, options.storm_precision, &strike->cell_x, &strike->cell_y) != 0) {
+        return;
+    }
+    strike->state_index = state_index;
+    strike->timestamp = timestamp;
+    num_strikes++;
+}
+
+/* Returns the strike slot for (state, hour, cell), either holding the first
+ * strike seen there or -1 for a free entry that the caller may claim. */
+int *cell_map_find(struct cell_map *map, int state_index, long hour, uint32_t x, uint32_t y) {
+    uint64_t hash = ((uint64_t) hour * 0x9E3779B97F4A7C15ULL)
+        ^ ((((uint64_t) x << 32) | y) * 0xC2B2AE3D27D4EB4FULL) ^ (uint64_t) state_index;
+    size_t i = (size_t) (hash ^ (hash >> 29)) & (map->capacity - 1);
+    for (;; i = (i + 1) & (map->capacity - 1)) {
+        struct cell_map_entry *entry = &map->entries[i];
+        if (entry->strike < 0) {
+            entry->hour = hour;
+            entry->state_index = state_index;
+            entry->cell_x = x;
+            entry->cell_y = y;
+            return &entry->strike;
+        }
+        if (entry->hour == hour && entry->state_index == state_index
+                && entry->cell_x == x && entry->cell_y == y) {
+            return &entry->strike;
+        }
+    }
+}
+
+// union-find with path halving and union by size
+int find_root(int *parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+void union_sets(int *parent, int *size, int a, int b) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a == b) {
+        return;
+    }
+    if (size[a] < size[b]) {
+        int tmp = a;
+        a = b;
+        b = tmp;
+    }
+    parent[b] = a;
+    size[a] += size[b];
+}
+
+/* Groups lightning strikes into storm cells: strikes in the same or
+ * neighboring grid cells (8-neighborhood) in the same or the next hour
+ * belong to the same cell. Strikes are first bucketed by (state, hour,
+ * grid cell) in a hash map, then each occupied bucket is joined with its
+ * neighbors through union-find, so the pass stays near-linear in the
+ * number of strikes. */
+void print_storm_cells(struct climate_info *states[], int num_states) {
+    int n = (int) num_strikes;
+    int *parent = (int*) malloc((n + 1) * sizeof(int));
+    int *size = (int*) malloc((n + 1) * sizeof(int));
+    struct cell_map map;
+    uint32_t lon_cells = 1u << ((5 * options.storm_precision + 1) / 2);
+    uint32_t lat_cells = 1u << (5 * options.storm_precision / 2);
+    size_t i;
+    int s;
+
+    map.capacity = 16;
+    while (map.capacity < 2 * (size_t) n) {
+        map.capacity *= 2;
+    }
+    map.entries = (struct cell_map_entry*) malloc(map.capacity * sizeof(struct cell_map_entry));
+    for (i = 0; i < map.capacity; i++) {
+        map.entries[i].strike = -1;
+    }
+
+    // strikes sharing a bucket are one cell
+    for (s = 0; s < n; s++) {
+        struct strike *strike = &strikes[s];
+        int *first = cell_map_find(&map, strike->state_index, hour_index(strike->timestamp),
+                strike->cell_x, strike->cell_y);
+        parent[s] = s;
+        size[s] = 1;
+        if (*first < 0) {
+            *first = s;
+        }
+        else {
+            union_sets(parent, size, *first, s);
+        }
+    }
+
+    // join each bucket with its occupied neighbors in this and the next hour
+    for (i = 0; i < map.capacity; i++) {
+        struct cell_map_entry entry = map.entries[i];
+        int dh, dx, dy;
+        if (entry.strike < 0) {
+            continue;
+        }
+        for (dh = 0; dh <= 1; dh++) {
+            for (dx = -1; dx <= 1; dx++) {
+                for (dy = -1; dy <= 1; dy++) {
+                    uint32_t x = (entry.cell_x + lon_cells + dx) % lon_cells;
+                    int64_t y = (int64_t) entry.cell_y + dy;
+                    size_t j;
+                    if ((dh == 0 && dx == 0 && dy == 0) || y < 0 || y >= lat_cells) {
+                        continue;
+                    }
+                    // probe without inserting: stop at the first free entry
+                    uint64_t hash = ((uint64_t) (entry.hour + dh) * 0x9E3779B97F4A7C15ULL)
+                        ^ ((((uint64_t) x << 32) | (uint32_t) y) * 0xC2B2AE3D27D4EB4FULL)
+                        ^ (uint64_t) entry.state_index;
+                    for (j = (size_t) (hash ^ (hash >> 29)) & (map.capacity - 1);
+                            map.entries[j].strike >= 0; j = (j + 1) & (map.capacity - 1)) {
+                        struct cell_map_entry *other = &map.entries[j];
+                        if (other->hour == entry.hour + dh && other->state_index == entry.state_index
+                                && other->cell_x == x && other->cell_y == (uint32_t) y) {
+                            union_sets(parent, size, entry.strike, other->strike);
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* Per-cell extents, kept at the root strike of each cell. */
+    long *first_time = (long*) malloc((n + 1) * sizeof(long));
+    long *last_time = (long*) malloc((n + 1) * sizeof(long));
+    double *bounds = (double*) malloc((n + 1) * 4 * sizeof(double));
+    for (s = 0; s < n; s++) {
+        if (find_root(parent, s) == s) {
+            first_time[s] = last_time[s] = strikes[s].timestamp;
+            bounds[s * 4] = bounds[s * 4 + 1] = strikes[s].latitude;
+            bounds[s * 4 + 2] = bounds[s * 4 + 3] = strikes[s].longitude;
+        }
+    }
+    for (s = 0; s < n; s++) {
+        int root = find_root(parent, s);
+        struct strike *strike = &strikes[s];
+        double *box = &bounds[root * 4];
+        if (strike->timestamp < first_time[root]) {
+            first_time[root] = strike->timestamp;
+        }
+        if (strike->timestamp > last_time[root]) {
+            last_time[root] = strike->timestamp;
+        }
+        if (strike->latitude < box[0]) {
+            box[0] = strike->latitude;
+        }
+        if (strike->latitude > box[1]) {
+            box[1] = strike->latitude;
+        }
+        if (strike->longitude < box[2]) {
+            box[2] = strike->longitude;
+        }
+        if (strike->longitude > box[3]) {
+            box[3] = strike->longitude;
+        }
+    }
+
+    int state;
+    for (state = 0; state < num_states; state++) {
+        if (states[state] == NULL) {
+            continue;
+        }
+        unsigned long num_cells = 0, num_in_cells = 0;
+        int largest = -1, longest = -1, widest = -1;
+        double widest_area = -1;
+        for (s = 0; s < n; s++) {
+            if (parent[s] != s || strikes[s].state_index != state) {
+                continue;
+            }
+            double *box = &bounds[s * 4];
+            double height = (box[1] - box[0]) * 111.32;
+            double width = (box[3] - box[2]) * 111.32 * cos((box[0] + box[1]) / 2 * PI / 180);
+            num_cells++;
+            num_in_cells += size[s];
+            if (largest < 0 || size[s] > size[largest]) {
+                largest = s;
+            }
+            if (longest < 0 || last_time[s] - first_time[s] > last_time[longest] - first_time[longest]) {
+                longest = s;
+            }
+            if (width * height > widest_area) {
+                widest_area = width * height;
+                widest = s;
+            }
+        }
+
+        printf(" -- State: %s storm cells --\n", states[state]->code);
+        printf("Storm Cells: %lu\n", num_cells);
+        if (num_cells == 0) {
+            continue;
+        }
+        long start = first_time[largest];
+        double *box = &bounds[widest * 4];
+        printf("Average Cell Size: %.1f strikes\n", (double) num_in_cells / num_cells);
+        printf("Largest Cell: %d strikes over %.0f hours\n", size[largest],
+                (last_time[largest] - first_time[largest]) / 3600.0 + 1);
+        printf("Largest Cell started: %s", local_ctime(states[state]->code, start));
+        printf("Longest Cell Duration: %.0f hours\n", (last_time[longest] - first_time[longest]) / 3600.0 + 1);
+        printf("Widest Cell Extent: %.0f x %.0f km\n",
+                (box[3] - box[2]) * 111.32 * cos((box[0] + box[1]) / 2 * PI / 180),
+                (box[1] - box[0]) * 111.32);
+    }
+
+    free(parent);
+    free(size);
+    free(map.entries);
+    free(first_time);
+    free(last_time);
+    free(bounds);
+}
+
+/* Returns the dense ID of a geohash, assigning the next ID to geohashes not
+ * seen before. IDs index geohashes.names. */
+uint32_t intern_geohash(const char *hash) {
+    uint64_t h = 1469598103934665603ULL;
+    size_t i;
+    int c;
+
+    // grow the slot table at 50% load
+    if (2 * (size_t) (geohashes.count + 1) > geohashes.capacity) {
+        size_t capacity = geohashes.capacity == 0 ? 1024 : geohashes.capacity * 2;
+        uint32_t *slots = (uint32_t*) malloc(capacity * sizeof(uint32_t));
+        memset(slots, 0xff, capacity * sizeof(uint32_t));
+        for (i = 0; i < geohashes.capacity; i++) {
+            if (geohashes.slots[i] != UINT32_MAX) {
+                const char *name = geohashes.names[geohashes.slots[i]];
+                uint64_t rh = 1469598103934665603ULL;
+                size_t j;
+                for (c = 0; name[c] != '\0'; c++) {
+                    rh = (rh ^ (unsigned char) name[c]) * 1099511628211ULL;
+                }
+                for (j = rh & (capacity - 1); slots[j] != UINT32_MAX; j = (j + 1) & (capacity - 1)) {
+                }
+                slots[j] = geohashes.slots[i];
+            }
+        }
+        free(geohashes.slots);
+        geohashes.slots = slots;
+        geohashes.capacity = capacity;
+    }
+
+    // FNV-1a over the (at most GEOHASH_LENGTH) characters
+    for (c = 0; c < GEOHASH_LENGTH && hash[c] != '\0'; c++) {
+        h = (h ^ (unsigned char) hash[c]) * 1099511628211ULL;
+    }
+    for (i = h & (geohashes.capacity - 1); geohashes.slots[i] != UINT32_MAX;
+            i = (i + 1) & (geohashes.capacity - 1)) {
+        if (strncmp(geohashes.names[geohashes.slots[i]], hash, GEOHASH_LENGTH) == 0
+                && geohashes.names[geohashes.slots[i]][c] == '\0') {
+            return geohashes.slots[i];
+        }
+    }
+
+    if (geohashes.count == geohashes.names_capacity) {
+        geohashes.names_capacity = geohashes.names_capacity == 0 ? 1024 : geohashes.names_capacity * 2;
+        geohashes.names = realloc(geohashes.names, geohashes.names_capacity * sizeof(*geohashes.names));
+    }
+    memcpy(geohashes.names[geohashes.count], hash, c);
+    geohashes.names[geohashes.count][c] = '\0';
+    geohashes.slots[i] = geohashes.count;
+    return geohashes.count++;
+}
+
+struct roaring *roaring_new(void) {
+    struct roaring *bitmap = (struct roaring*) malloc(sizeof(struct roaring));
+    bitmap->num_containers = 0;
+    bitmap->capacity = 0;
+    bitmap->containers = NULL;
+    return bitmap;
+}
+
+void roaring_free(struct roaring *bitmap) {
+    int i;
+    if (bitmap == NULL) {
+        return;
+    }
+    for (i = 0; i < bitmap->num_containers; i++) {
+        free(bitmap->containers[i].array);
+        free(bitmap->containers[i].bitset);
+    }
+    free(bitmap->containers);
+    free(bitmap);
+}
+
+// appends an empty array container with the given key (keys must ascend)
+struct roaring_container *roaring_append(struct roaring *bitmap, uint16_t key) {
+    struct roaring_container *container;
+    if (bitmap->num_containers == bitmap->capacity) {
+        bitmap->capacity = bitmap->capacity == 0 ? 4 : bitmap->capacity * 2;
+        bitmap->containers = (struct roaring_container*) realloc(bitmap->containers,
+                bitmap->capacity * sizeof(struct roaring_container));
+    }
+    container = &bitmap->containers[bitmap->num_containers++];
+    container->key = key;
+    container->cardinality = 0;
+    container->capacity = 0;
+    container->array = NULL;
+    container->bitset = NULL;
+    return container;
+}
+
+// converts an array container holding too many values into a bitset
+void roaring_to_bitset(struct roaring_container *container) {
+    int i;
+    container->bitset = (uint64_t*) calloc(ROARING_BITSET_WORDS, sizeof(uint64_t));
+    for (i = 0; i < container->cardinality; i++) {
+        container->bitset[container->array[i] >> 6] |= 1ULL << (container->array[i] & 63);
+    }
+    free(container->array);
+    container->array = NULL;
+    container->capacity = 0;
+}
+
+// converts a bitset container that became sparse back into an array
+void roaring_to_array(struct roaring_container *container) {
+    int word, n = 0;
+    container->capacity = container->cardinality > 0 ? container->cardinality : 1;
+    container->array = (uint16_t*) malloc(container->capacity * sizeof(uint16_t));
+    for (word = 0; word < ROARING_BITSET_WORDS; word++) {
+        uint64_t bits = container->bitset[word];
+        while (bits != 0) {
+            container->array[n++] = (uint16_t) (word * 64 + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+    free(container->bitset);
+    container->bitset = NULL;
+}
+
+void roaring_add(struct roaring *bitmap, uint32_t value) {
+    uint16_t key = (uint16_t) (value >> 16), low = (uint16_t) value;
+    int lo = 0, hi = bitmap->num_containers, i;
+    struct roaring_container *container;
+
+    // binary search for the container, inserting it in order if missing
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (bitmap->containers[mid].key < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo == bitmap->num_containers || bitmap->containers[lo].key != key) {
+        roaring_append(bitmap, key);
+        memmove(&bitmap->containers[lo + 1], &bitmap->containers[lo],
+                (bitmap->num_containers - 1 - lo) * sizeof(struct roaring_container));
+        bitmap->containers[lo].key = key;
+        bitmap->containers[lo].cardinality = 0;
+        bitmap->containers[lo].capacity = 0;
+        bitmap->containers[lo].array = NULL;
+        bitmap->containers[lo].bitset = NULL;
+    }
+    container = &bitmap->containers[lo];
+
+    if (container->bitset != NULL) {
+        uint64_t bit = 1ULL << (low & 63);
+        if ((container->bitset[low >> 6] & bit) == 0) {
+            container->bitset[low >> 6] |= bit;
+            container->cardinality++;
+        }
+        return;
+    }
+
+    lo = 0;
+    hi = container->cardinality;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (container->array[mid] < low) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < container->cardinality && container->array[lo] == low) {
+        return;
+    }
+    if (container->cardinality == ROARING_ARRAY_MAX) {
+        roaring_to_bitset(container);
+        container->bitset[low >> 6] |= 1ULL << (low & 63);
+        container->cardinality++;
+        return;
+    }
+    if (container->cardinality == container->capacity) {
+        container->capacity = container->capacity == 0 ? 4 : container->capacity * 2;
+        container->array = (uint16_t*) realloc(container->array, container->capacity * sizeof(uint16_t));
+    }
+    for (i = container->cardinality; i > lo; i--) {
+        container->array[i] = container->array[i - 1];
+    }
+    container->array[lo] = low;
+    container->cardinality++;
+}
+
+unsigned long roaring_cardinality(const struct roaring *bitmap) {
+    unsigned long total = 0;
+    int i;
+    for (i = 0; i < bitmap->num_containers; i++) {
+        total += bitmap->containers[i].cardinality;
+    }
+    return total;
+}
+
+// copies a container's values into a (zeroed) bitset
+void roaring_fill_bitset(const struct roaring_container *container, uint64_t *bitset) {
+    int i;
+    if (container->bitset != NULL) {
+        memcpy(bitset, container->bitset, ROARING_BITSET_WORDS * sizeof(uint64_t));
+        return;
+    }
+    for (i = 0; i < container->cardinality; i++) {
+        bitset[container->array[i] >> 6] |= 1ULL << (container->array[i] & 63);
+    }
+}
+
+// appends a copy of a container to bitmap
+void roaring_append_copy(struct roaring *bitmap, const struct roaring_container *from) {
+    struct roaring_container *to = roaring_append(bitmap, from->key);
+    to->cardinality = from->cardinality;
+    if (from->bitset != NULL) {
+        to->bitset = (uint64_t*) malloc(ROARING_BITSET_WORDS * sizeof(uint64_t));
+        memcpy(to->bitset, from->bitset, ROARING_BITSET_WORDS * sizeof(uint64_t));
+    }
+    else {
+        to->capacity = from->cardinality > 0 ? from->cardinality : 1;
+        to->array = (uint16_t*) malloc(to->capacity * sizeof(uint16_t));
+        memcpy(to->array, from->array, from->cardinality * sizeof(uint16_t));
+    }
+}
+
+/* Union of two bitmaps. Two arrays are merged as sorted lists (spilling to
+ * a bitset when the result is large); otherwise bitsets are OR-ed a word
+ * at a time and the cardinality is recounted with popcount. */
+struct roaring *roaring_union(const struct roaring *a, const struct roaring *b) {
+    struct roaring *result = roaring_new();
+    int i = 0, j = 0;
+    while (i < a->num_containers || j < b->num_containers) {
+        const struct roaring_container *ca = i < a->num_containers ? &a->containers[i] : NULL;
+        const struct roaring_container *cb = j < b->num_containers ? &b->containers[j] : NULL;
+        struct roaring_container *out;
+        int w;
+
+        if (cb == NULL || (ca != NULL && ca->key < cb->key)) {
+            roaring_append_copy(result, ca);
+            i++;
+            continue;
+        }
+        if (ca == NULL || cb->key < ca->key) {
+            roaring_append_copy(result, cb);
+            j++;
+            continue;
+        }
+
+        out = roaring_append(result, ca->key);
+        if (ca->bitset == NULL && cb->bitset == NULL
+                && ca->cardinality + cb->cardinality <= ROARING_ARRAY_MAX) {
+            int x = 0, y = 0;
+            out->capacity = ca->cardinality + cb->cardinality > 0 ? ca->cardinality + cb->cardinality : 1;
+            out->array = (uint16_t*) malloc(out->capacity * sizeof(uint16_t));
+            while (x < ca->cardinality || y < cb->cardinality) {
+                if (y == cb->cardinality || (x < ca->cardinality && ca->array[x] < cb->array[y])) {
+                    out->array[out->cardinality++] = ca->array[x++];
+                }
+                else if (x == ca->cardinality || cb->array[y] < ca->array[x]) {
+                    out->array[out->cardinality++] = cb->array[y++];
+                }
+                else {
+                    out->array[out->cardinality++] = ca->array[x++];
+                    y++;
+                }
+            }
+        }
+        else {
+            uint64_t *other = (uint64_t*) calloc(ROARING_BITSET_WORDS, sizeof(uint64_t));
+            out->bitset = (uint64_t*) calloc(ROARING_BITSET_WORDS, sizeof(uint64_t));
+            roaring_fill_bitset(ca, out->bitset);
+            roaring_fill_bitset(cb, other);
+            for (w = 0; w < ROARING_BITSET_WORDS; w++) {
+                out->bitset[w] |= other[w];
+                out->cardinality += __builtin_popcountll(out->bitset[w]);
+            }
+            free(other);
+            if (out->cardinality <= ROARING_ARRAY_MAX) {
+                roaring_to_array(out);
+            }
+        }
+        i++;
+        j++;
+    }
+    return result;
+}
+
+/* Intersection of two bitmaps: sorted-list intersection for two arrays,
+ * bit tests for an array against a bitset, and word-wise AND plus popcount
+ * for two bitsets. */
+struct roaring *roaring_intersection(const struct roaring *a, const struct roaring *b) {
+    struct roaring *result = roaring_new();
+    int i = 0, j = 0;
+    while (i < a->num_containers && j < b->num_containers) {
+        const struct roaring_container *ca = &a->containers[i];
+        const struct roaring_container *cb = &b->containers[j];
+        struct roaring_container *out;
+        int x, y, w;
+
+        if (ca->key != cb->key) {
+            if (ca->key < cb->key) {
+                i++;
+            }
+            else {
+                j++;
+            }
+            continue;
+        }
+        i++;
+        j++;
+
+        out = roaring_append(result, ca->key);
+        if (ca->bitset != NULL && cb->bitset != NULL) {
+            out->bitset = (uint64_t*) malloc(ROARING_BITSET_WORDS * sizeof(uint64_t));
+            for (w = 0; w < ROARING_BITSET_WORDS; w++) {
+                out->bitset[w] = ca->bitset[w] & cb->bitset[w];
+                out->cardinality += __builtin_popcountll(out->bitset[w]);
+            }
+            if (out->cardinality <= ROARING_ARRAY_MAX) {
+                roaring_to_array(out);
+            }
+        }
+        else {
+            const struct roaring_container *small = ca->bitset == NULL ? ca : cb;
+            const struct roaring_container *other = small == ca ? cb : ca;
+            out->capacity = small->cardinality > 0 ? small->cardinality : 1;
+            out->array = (uint16_t*) malloc(out->capacity * sizeof(uint16_t));
+            if (other->bitset != NULL) {
+                for (x = 0; x < small->cardinality; x++) {
+                    uint16_t v = small->array[x];
+                    if (other->bitset[v >> 6] & (1ULL << (v & 63))) {
+                        out->array[out->cardinality++] = v;
+                    }
+                }
+            }
+            else {
+                for (x = 0, y = 0; x < small->cardinality && y < other->cardinality;) {
+                    if (small->array[x] < other->array[y]) {
+                        x++;
+                    }
+                    else if (other->array[y] < small->array[x]) {
+                        y++;
+                    }
+                    else {
+                        out->array[out->cardinality++] = small->array[x];
+                        x++;
+                        y++;
+                    }
+                }
+            }
+        }
+        if (out->cardinality == 0) {
+            free(out->array);
+            free(out->bitset);
+            result->num_containers--;
+        }
+    }
+    return result;
+}
+
+/* Marks a location as snow-covered on a day in the state's per-day bitmaps,
+ * growing the day range (at either end) as needed. Returns -1 if it can't
+ * be allocated. */
+int add_snow(struct climate_info *info, long day, uint32_t location) {
+    struct snow_days *snow = info->snow;
+    if (snow == NULL) {
+        snow = (struct snow_days*) malloc(sizeof(struct snow_days));
+        if (snow == NULL) {
+            return -1;
+        }
+        info->snow = snow;
+        snow->first_day = day;
+        snow->num_days = 0;
+        snow->capacity = 0;
+        snow->days = NULL;
+    }
+    if (day < snow->first_day || day >= snow->first_day + snow->num_days) {
+        long first = day < snow->first_day ? day : snow->first_day;
+        long end = day >= snow->first_day + snow->num_days ? day + 1 : snow->first_day + snow->num_days;
+        long shift = snow->first_day - first;
+        if (end - first > snow->capacity) {
+            long capacity = snow->capacity == 0 ? 64 : snow->capacity;
+            struct roaring **days;
+            while (capacity < end - first) {
+                capacity *= 2;
+            }
+            days = (struct roaring**) realloc(snow->days, capacity * sizeof(struct roaring*));
+            if (days == NULL) {
+                return -1;
+            }
+            snow->days = days;
+            snow->capacity = (int) capacity;
+        }
+        memmove(snow->days + shift, snow->days, snow->num_days * sizeof(struct roaring*));
+        memset(snow->days, 0, shift * sizeof(struct roaring*));
+        memset(snow->days + shift + snow->num_days, 0,
+                (end - first - shift - snow->num_days) * sizeof(struct roaring*));
+        snow->first_day = first;
+        snow->num_days = (int) (end - first);
+    }
+    if (snow->days[day - snow->first_day] == NULL) {
+        snow->days[day - snow->first_day] = roaring_new();
+    }
+    roaring_add(snow->days[day - snow->first_day], location);
+    return 0;
+}
+
+/* Prints each state's daily snow-cover extent (distinct locations with snow
+ * on a day), the union of all snow days and their intersection, all as
+ * bitmap operations on the per-day bitmaps. If csv_path is set, also writes
+ * state,date,extent,cumulative_extent per snow day. Returns 0 on success. */
+int print_snow_extent(struct climate_info *states[], int num_states, const char *csv_path) {
+    FILE *csv = NULL;
+    int i, d;
+
+    if (csv_path != NULL) {
+        csv = fopen(csv_path, "w");
+        if (csv == NULL) {
+            return -1;
+        }
+        fprintf(csv, "state,date,extent,cumulative_extent\n");
+    }
+
+    for (i = 0; i < num_states; i++) {
+        if (states[i] == NULL) {
+            continue;
+        }
+        struct snow_days *snow = states[i]->snow;
+        struct roaring *all = roaring_new(), *every = NULL;
+        unsigned long max_extent = 0;
+        long max_day = 0;
+        int snow_days = 0;
+
+        for (d = 0; snow != NULL && d < snow->num_days; d++) {
+            struct roaring *day = snow->days[d];
+            struct roaring *merged;
+            int year, month, day_of_month;
+            if (day == NULL) {
+                continue;
+            }
+            unsigned long extent = roaring_cardinality(day);
+            snow_days++;
+            if (extent > max_extent) {
+                max_extent = extent;
+                max_day = snow->first_day + d;
+            }
+
+            merged = roaring_union(all, day);
+            roaring_free(all);
+            all = merged;
+            if (every == NULL) {
+                every = roaring_union(day, day);
+            }
+            else {
+                merged = roaring_intersection(every, day);
+                roaring_free(every);
+                every = merged;
+            }
+
+            if (csv != NULL) {
+                civil_from_days(snow->first_day + d, &year, &month, &day_of_month);
+                fprintf(csv, "%s,%04d-%02d-%02d,%lu,%lu\n", states[i]->code, year, month, day_of_month,
+                        extent, roaring_cardinality(all));
+            }
+        }
+
+        printf(" -- State: %s snow extent --\n", states[i]->code);
+        printf("Days with Snow Cover: %d\n", snow_days);
+        if (snow_days > 0) {
+            int year, month, day_of_month;
+            civil_from_days(max_day, &year, &month, &day_of_month);
+            printf("Max Daily Snow Extent: %lu locations\n", max_extent);
+            printf("Max Daily Snow Extent on: %04d-%02d-%02d\n", year, month, day_of_month);
+            printf("Snow Extent Union: %lu locations\n", roaring_cardinality(all));
+            printf("Snow Extent Intersection: %lu locations\n", roaring_cardinality(every));
+        }
+        roaring_free(all);
+        roaring_free(every);
+    }
+
+    if (csv != NULL) {
+        return fclose(csv) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/* Parses --where conditions ("snow=1,lightning=0"). Returns 0 on success. */
+int parse_where(const char *text, struct record_filter *filter) {
+    char condition[32];
+    int value;
+    while (*text != '\0') {
+        size_t length = strcspn(text, ",");
+        if (length >= sizeof(condition)) {
+            return -1;
+        }
+        memcpy(condition, text, length);
+        condition[length] = '\0';
+        if (sscanf(condition, "snow=%d", &value) == 1 && (value == 0 || value == 1)) {
+            filter->snow = value;
+        }
+        else if (sscanf(condition, "lightning=%d", &value) == 1 && (value == 0 || value == 1)) {
+            filter->lightning = value;
+        }
+        else {
+            return -1;
+        }
+        text += length;
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return 0;
+}
+
+// geohash bits, most significant first: as geohashes interleave longitude
+// and latitude bits, this is the Morton (Z-order) code of the cell
+uint64_t geohash_bits(const char *hash) {
+    int i, length = (int) strnlen(hash, GEOHASH_LENGTH);
+    uint64_t bits = 0;
+    for (i = 0; i < GEOHASH_LENGTH; i++) {
+        int value = i < length ? geohash_value(hash[i]) : 0;
+        bits = (bits << 5) | (uint64_t) (value < 0 ? 0 : value);
+    }
+    return bits;
+}
+
+/* Returns 1 if a record's time and location pass the --between and --within
+ * parts of the filter. */
+int filter_match(const struct record_filter *filter, long timestamp, const char *geohash) {
+    double latitude, longitude;
+    if (filter->has_between && (timestamp < filter->from || timestamp >= filter->to)) {
+        return 0;
+    }
+    if (filter->has_within) {
+        if (geohash_decode(geohash, (int) strnlen(geohash, GEOHASH_LENGTH), &latitude, &longitude) != 0) {
+            return 0;
+        }
+        return latitude >= filter->within[0] && longitude >= filter->within[1]
+            && latitude <= filter->within[2] && longitude <= filter->within[3];
+    }
+    return 1;
+}
+
+/* Returns 0 if a block's header rules out every record passing the filter:
+ * its time range or zone map misses the query, or it has no snow/lightning
+ * records when those are required. */
+int filter_block(const struct record_filter *filter, const struct cache_block_header *header) {
+    if ((filter->snow == 1 && header->num_snow == 0)
+            || (filter->snow == 0 && header->num_snow == header->num_records)
+            || (filter->lightning == 1 && header->num_lightning == 0)
+            || (filter->lightning == 0 && header->num_lightning == header->num_records)) {
+        return 0;
+    }
+    if (filter->has_between && (header->max_timestamp < filter->from || header->min_timestamp >= filter->to)) {
+        return 0;
+    }
+    if (filter->has_within && (header->max_latitude < filter->within[0]
+                || header->max_longitude < filter->within[1]
+                || header->min_latitude > filter->within[2]
+                || header->min_longitude > filter->within[3])) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Computes the selection mask of each 64-record word of a block. The snow
+ * and lightning conditions are applied to whole words of the bitmaps, time
+ * and location (from the batch-decoded geohash column) only to the records
+ * still selected. Returns the OR of the
+ * masks, 0 if nothing is selected. */
+uint64_t select_records(const struct record_filter *filter, const struct cache_block *block, uint64_t *masks) {
+    uint32_t n = block->header.num_records;
+    int words = (int) (n + 63) / 64;
+    double latitudes[CACHE_BLOCK_RECORDS], longitudes[CACHE_BLOCK_RECORDS];
+    uint64_t selected = 0;
+    int w;
+
+    if (filter->has_within) {
+        geohash_decode_batch(block->geohash, (int) n, latitudes, longitudes);
+    }
+    for (w = 0; w < words; w++) {
+        masks[w] = (n - w * 64 >= 64) ? ~0ULL : (1ULL << (n - w * 64)) - 1;
+        if (filter->snow >= 0) {
+            masks[w] &= filter->snow ? block->snow[w] : ~block->snow[w];
+        }
+        if (filter->lightning >= 0) {
+            masks[w] &= filter->lightning ? block->lightning[w] : ~block->lightning[w];
+        }
+        if (filter->has_within || filter->has_between) {
+            uint64_t candidates = masks[w];
+            while (candidates != 0) {
+                int i = w * 64 + __builtin_ctzll(candidates);
+                uint64_t bit = candidates & -candidates;
+                candidates &= candidates - 1;
+                long timestamp = block->timestamp[i];
+                // NaN (invalid geohash) fails every comparison
+                if ((filter->has_between && (timestamp < filter->from || timestamp >= filter->to))
+                        || (filter->has_within && !(latitudes[i] >= filter->within[0]
+                                && longitudes[i] >= filter->within[1] && latitudes[i] <= filter->within[2]
+                                && longitudes[i] <= filter->within[3]))) {
+                    masks[w] &= ~bit;
+                }
+            }
+        }
+        selected |= masks[w];
+    }
+    return selected;
+}
+
+/* Cache file: the 8-byte magic, version and records per block as 32-bit
+ * integers, then the blocks back to back. Blocks are written as records
+ * arrive, or, for an ordered writer, when it is closed. */
+struct cache_writer *cache_open(const char *path, int order) {
+    struct cache_writer *writer;
+    uint32_t header[2] = {CACHE_VERSION, CACHE_BLOCK_RECORDS};
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return NULL;
+    }
+    writer = (struct cache_writer*) calloc(1, sizeof(struct cache_writer));
+    writer->out = out;
+    writer->order = order;
+    writer->failed = fwrite(CACHE_MAGIC, 1, 8, out) != 8 || fwrite(header, sizeof(header), 1, out) != 1;
+    return writer;
+}
+
+// rounds toward -inf / +inf when converting to float, so zone maps stay conservative
+float float_below(double value) {
+    float result = (float) value;
+    return result > value ? nextafterf(result, -INFINITY) : result;
+}
+
+float float_above(double value) {
+    float result = (float) value;
+    return result < value ? nextafterf(result, INFINITY) : result;
+}
+
+// writes a block's header and its columns, trimmed to the records it holds
+void cache_write_block(struct cache_writer *writer, struct cache_block *block) {
+    size_t n = block->header.num_records;
+    size_t words = (n + 63) / 64;
+    double latitudes[CACHE_BLOCK_RECORDS], longitudes[CACHE_BLOCK_RECORDS];
+    double south = INFINITY, west = INFINITY, north = -INFINITY, east = -INFINITY;
+    int w, i;
+    block->header.num_snow = 0;
+    block->header.num_lightning = 0;
+    for (w = 0; w < (int) words; w++) {
+        block->header.num_snow += __builtin_popcountll(block->snow[w]);
+        block->header.num_lightning += __builtin_popcountll(block->lightning[w]);
+    }
+
+    // zone map of the decoded column (invalid geohashes are NaN and left out)
+    geohash_decode_batch(block->geohash, (int) n, latitudes, longitudes);
+    for (i = 0; i < (int) n; i++) {
+        south = latitudes[i] < south ? latitudes[i] : south;
+        north = latitudes[i] > north ? latitudes[i] : north;
+        west = longitudes[i] < west ? longitudes[i] : west;
+        east = longitudes[i] > east ? longitudes[i] : east;
+    }
+    block->header.min_latitude = float_below(south);
+    block->header.max_latitude = float_above(north);
+    block->header.min_longitude = float_below(west);
+    block->header.max_longitude = float_above(east);
+    if (fwrite(&block->header, sizeof(block->header), 1, writer->out) != 1
+            || fwrite(block->timestamp, sizeof(int64_t), n, writer->out) != n
+            || fwrite(block->geohash, GEOHASH_LENGTH, n, writer->out) != n
+            || fwrite(block->humidity, sizeof(double), n, writer->out) != n
+            || fwrite(block->cloudcover, sizeof(double), n, writer->out) != n
+            || fwrite(block->pressure, sizeof(double), n, writer->out) != n
+            || fwrite(block->temperature, sizeof(double), n, writer->out) != n
+            || fwrite(block->snow, sizeof(uint64_t), words, writer->out) != words
+            || fwrite(block->lightning, sizeof(uint64_t), words, writer->out) != words) {
+        writer->failed = 1;
+    }
+}
+
+// adds a record to its state's pending block, writing the block once full
+void cache_block_append(struct cache_writer *writer, int state_index, const struct record *rec) {
+    struct cache_block *block = writer->pending[state_index];
+    uint32_t i;
+    if (block == NULL) {
+        block = writer->pending[state_index] = (struct cache_block*) malloc(sizeof(struct cache_block));
+        block->header.num_records = 0;
+    }
+    if (block->header.num_records == 0) {
+        memset(block->header.code, 0, sizeof(block->header.code));
+        memcpy(block->header.code, rec->code, 2);
+        block->header.min_timestamp = rec->timestamp;
+        block->header.max_timestamp = rec->timestamp;
+        memset(block->snow, 0, sizeof(block->snow));
+        memset(block->lightning, 0, sizeof(block->lightning));
+    }
+
+    i = block->header.num_records++;
+    block->timestamp[i] = rec->timestamp;
+    memset(block->geohash[i], 0, GEOHASH_LENGTH);
+    memcpy(block->geohash[i], rec->geohash, strlen(rec->geohash));
+    block->humidity[i] = rec->humidity;
+    block->cloudcover[i] = rec->cloudcover;
+    block->pressure[i] = rec->pressure;
+    block->temperature[i] = rec->temperature;
+    block->snow[i / 64] |= (uint64_t) (rec->snow != 0) << (i % 64);
+    block->lightning[i / 64] |= (uint64_t) (rec->lightning != 0) << (i % 64);
+    if (rec->timestamp < block->header.min_timestamp) {
+        block->header.min_timestamp = rec->timestamp;
+    }
+    if (rec->timestamp > block->header.max_timestamp) {
+        block->header.max_timestamp = rec->timestamp;
+    }
+
+    if (block->header.num_records == CACHE_BLOCK_RECORDS) {
+        cache_write_block(writer, block);
+        block->header.num_records = 0;
+    }
+}
+
+// adds a record to the cache, or holds it back until close if the writer is ordered
+void cache_append(struct cache_writer *writer, int state_index, const struct record *rec) {
+    struct cache_row *row;
+    if (writer->order == CACHE_ORDER_ARRIVAL) {
+        cache_block_append(writer, state_index, rec);
+        return;
+    }
+    if (writer->num_rows[state_index] == writer->rows_capacity[state_index]) {
+        writer->rows_capacity[state_index] = writer->rows_capacity[state_index] == 0
+            ? CACHE_BLOCK_RECORDS : 2 * writer->rows_capacity[state_index];
+        writer->rows[state_index] = (struct cache_row*) realloc(writer->rows[state_index],
+                writer->rows_capacity[state_index] * sizeof(struct cache_row));
+    }
+    row = &writer->rows[state_index][writer->num_rows[state_index]++];
+    row->key = writer->order == CACHE_ORDER_MORTON ? geohash_bits(rec->geohash) : 0;
+    row->rec = *rec;
+}
+
+// orders rows by their key, then by time
+int compare_cache_rows(const void *a, const void *b) {
+    const struct cache_row *row_a = (const struct cache_row*) a;
+    const struct cache_row *row_b = (const struct cache_row*) b;
+    if (row_a->key != row_b->key) {
+        return row_a->key < row_b->key ? -1 : 1;
+    }
+    return (row_a->rec.timestamp > row_b->rec.timestamp) - (row_a->rec.timestamp < row_b->rec.timestamp);
+}
+
+// writes the held back and partly filled blocks and closes the cache, returns 0 on success
+int cache_close(struct cache_writer *writer) {
+    int i, failed;
+    size_t r;
+    for (i = 0; i < NUM_STATES; i++) {
+        if (writer->num_rows[i] > 0) {
+            qsort(writer->rows[i], writer->num_rows[i], sizeof(struct cache_row), compare_cache_rows);
+            for (r = 0; r < writer->num_rows[i]; r++) {
+                cache_block_append(writer, i, &writer->rows[i][r].rec);
+            }
+        }
+        free(writer->rows[i]);
+        if (writer->pending[i] != NULL) {
+            if (writer->pending[i]->header.num_records > 0) {
+                cache_write_block(writer, writer->pending[i]);
+            }
+            free(writer->pending[i]);
+        }
+    }
+    failed = fclose(writer->out) != 0 || writer->failed;
+    free(writer);
+    return failed ? -1 : 0;
+}
+
+/* Reads the next block of a cache that may hold records passing the filter
+ * (NULL for any block), seeking past the columns of blocks whose header
+ * rules them out. Returns 1 if a block was read, 0 at the end of the file
+ * and -1 if the block is truncated or invalid. */
+int read_cache_block(FILE *file, struct cache_block *block, const struct record_filter *filter,
+        struct cache_stats *stats) {
+    size_t n, words;
+    while (fread(&block->header, sizeof(block->header), 1, file) == 1) {
+        n = block->header.num_records;
+        words = (n + 63) / 64;
+        if (n == 0 || n > CACHE_BLOCK_RECORDS) {
+            return -1;
+        }
+        if (filter != NULL && !filter_block(filter, &block->header)) {
+            long columns = (long) (n * (sizeof(int64_t) + GEOHASH_LENGTH + 4 * sizeof(double))
+                    + 2 * words * sizeof(uint64_t));
+            if (fseek(file, columns, SEEK_CUR) != 0) {
+                return -1;
+            }
+            stats->blocks_skipped++;
+            continue;
+        }
+        if (fread(block->timestamp, sizeof(int64_t), n, file) != n
+                || fread(block->geohash, GEOHASH_LENGTH, n, file) != n
+                || fread(block->humidity, sizeof(double), n, file) != n
+                || fread(block->cloudcover, sizeof(double), n, file) != n
+                || fread(block->pressure, sizeof(double), n, file) != n
+                || fread(block->temperature, sizeof(double), n, file) != n
+                || fread(block->snow, sizeof(uint64_t), words, file) != words
+                || fread(block->lightning, sizeof(uint64_t), words, file) != words) {
+            return -1;
+        }
+        stats->blocks_read++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Analyzes a binary cache (positioned after its magic). Blocks that the
+ * filter rules out by their headers are skipped unread. The --where filter
+ * is evaluated on the snow and lightning bitmaps 64 records at a time, and
+ * the snow/lightning counts come from the blocks' popcounts (or, when
+ * filtering, from popcounts of the filtered words) instead of per record. */
+void analyze_cache(FILE *file, struct climate_info *states[], int num_states) {
+    struct cache_block *block = (struct cache_block*) malloc(sizeof(struct cache_block));
+    struct cache_stats stats = {0, 0};
+    struct parse_batch batch;
+    struct record rec;
+    uint32_t header[2];
+    int status;
+    int filtered = options.filter.snow >= 0 || options.filter.lightning >= 0
+        || options.filter.has_within || options.filter.has_between;
+    (void) num_states;
+
+    batch.count = 0;
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != CACHE_VERSION
+            || header[1] != CACHE_BLOCK_RECORDS) {
+        printf("Error: Unsupported cache version.\n");
+        free(block);
+        return;
+    }
+
+    while ((status = read_cache_block(file, block, &options.filter, &stats)) == 1) {
+        uint32_t n = block->header.num_records;
+        int words = (int) (n + 63) / 64;
+        uint64_t masks[CACHE_BLOCK_WORDS];
+        int w;
+
+        if (select_records(&options.filter, block, masks) == 0) {
+            continue;
+        }
+
+        char code[3] = {block->header.code[0], block->header.code[1], '\0'};
+        int state_index = get_state_index(states, code);
+        struct climate_info *info = states[state_index];
+
+        if (!filtered) {
+            info->num_snowcover += block->header.num_snow;
+            info->num_lightning += block->header.num_lightning;
+        }
+
+        memcpy(rec.code, code, sizeof(rec.code));
+        for (w = 0; w < words; w++) {
+            uint64_t mask = masks[w];
+            if (filtered) {
+                info->num_snowcover += __builtin_popcountll(mask & block->snow[w]);
+                info->num_lightning += __builtin_popcountll(mask & block->lightning[w]);
+            }
+
+            while (mask != 0) {
+                int i = w * 64 + __builtin_ctzll(mask);
+                mask &= mask - 1;
+                rec.timestamp = block->timestamp[i];
+                memcpy(rec.geohash, block->geohash[i], GEOHASH_LENGTH);
+                rec.geohash[GEOHASH_LENGTH] = '\0';
+                rec.humidity = block->humidity[i];
+                rec.cloudcover = block->cloudcover[i];
+                rec.pressure = block->pressure[i];
+                rec.temperature = block->temperature[i];
+                rec.snow = (block->snow[w] >> (i % 64)) & 1;
+                rec.lightning = (block->lightning[w] >> (i % 64)) & 1;
+                add_record(states, state_index, &rec, &batch);
+            }
+        }
+    }
+    if (status < 0) {
+        printf("Error: Cache block is truncated or invalid.\n");
+    }
+    flush_batch(&batch, states);
+    free(block);
+}
+
+void add_series_point(uint32_t location, const struct record *rec) {
+    struct point_list *list;
+    if (location >= location_points_capacity) {
+        uint32_t capacity = location_points_capacity == 0 ? 1024 : location_points_capacity;
+        while (capacity <= location) {
+            capacity *= 2;
+        }
+        location_points = (struct point_list*) realloc(location_points, capacity * sizeof(struct point_list));
+        memset(location_points + location_points_capacity, 0,
+                (capacity - location_points_capacity) * sizeof(struct point_list));
+        location_points_capacity = capacity;
+    }
+    list = &location_points[location];
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->points = (struct series_point*) realloc(list->points, list->capacity * sizeof(struct series_point));
+    }
+    list->points[list->count].timestamp = rec->timestamp;
+    list->points[list->count].temperature = rec->temperature;
+    list->points[list->count].pressure = rec->pressure;
+    list->count++;
+}
+
+// appends the low `count` bits of value, most significant first
+void bit_write(struct bit_writer *writer, uint64_t value, int count) {
+    while (count > 0) {
+        size_t byte = writer->num_bits / 8;
+        int free_bits = 8 - (int) (writer->num_bits % 8);
+        int take = count < free_bits ? count : free_bits;
+        if (byte >= writer->capacity) {
+            writer->capacity = writer->capacity == 0 ? 64 : writer->capacity * 2;
+            writer->bytes = (uint8_t*) realloc(writer->bytes, writer->capacity);
+            memset(writer->bytes + byte, 0, writer->capacity - byte);
+        }
+        uint64_t chunk = (value >> (count - take)) & ((1ULL << take) - 1);
+        writer->bytes[byte] |= (uint8_t) (chunk << (free_bits - take));
+        writer->num_bits += take;
+        count -= take;
+    }
+}
+
+// reads `count` (at most 64) bits; past the end reads as zeros
+uint64_t bit_read(struct bit_reader *reader, int count) {
+    uint64_t value = 0;
+    while (count > 0) {
+        size_t byte = reader->position / 8;
+        int avail = 8 - (int) (reader->position % 8);
+        int take = count < avail ? count : avail;
+        uint8_t current = byte < reader->num_bytes ? reader->bytes[byte] : 0;
+        value = (value << take) | ((current >> (avail - take)) & ((1u << take) - 1));
+        reader->position += take;
+        count -= take;
+    }
+    return value;
+}
+
+void gorilla_init(struct gorilla_encoder *encoder, uint32_t time_unit) {
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->time_unit = time_unit;
+}
+
+// appends one value as the XOR with the previous one (Gorilla section 4.1.2)
+void gorilla_append_value(struct gorilla_encoder *encoder, int column, double value) {
+    uint64_t bits, xor;
+    int leading, trailing;
+    memcpy(&bits, &value, sizeof(bits));
+    xor = bits ^ encoder->last_value[column];
+    encoder->last_value[column] = bits;
+
+    if (xor == 0) {
+        bit_write(&encoder->bits, 0, 1);
+        return;
+    }
+    leading = __builtin_clzll(xor);
+    trailing = __builtin_ctzll(xor);
+    if (leading > 31) {
+        leading = 31;
+    }
+    bit_write(&encoder->bits, 1, 1);
+    if (encoder->leading[column] >= 0 && leading >= encoder->leading[column]
+            && trailing >= encoder->trailing[column]) {
+        // fits in the previous window of meaningful bits
+        bit_write(&encoder->bits, 0, 1);
+        bit_write(&encoder->bits, xor >> encoder->trailing[column],
+                64 - encoder->leading[column] - encoder->trailing[column]);
+    }
+    else {
+        int length = 64 - leading - trailing;
+        bit_write(&encoder->bits, 1, 1);
+        bit_write(&encoder->bits, (uint64_t) leading, 5);
+        // 64 meaningful bits is stored as 0
+        bit_write(&encoder->bits, (uint64_t) (length & 63), 6);
+        bit_write(&encoder->bits, xor >> trailing, length);
+        encoder->leading[column] = leading;
+        encoder->trailing[column] = trailing;
+    }
+}
+
+/* Appends a point; timestamps must not decrease. The first timestamp is
+ * stored in full, the first delta in 32 bits, and then delta-of-deltas
+ * in the paper's '0' / '10'+7 / '110'+9 / '1110'+12 / '1111'+32 buckets,
+ * each holding the two's-complement range of its width ([-64,63] for 7
+ * bits), which is what gorilla_decode sign-extends. */
+void gorilla_append(struct gorilla_encoder *encoder, long timestamp, double temperature, double pressure) {
+    if (encoder->count == 0) {
+        bit_write(&encoder->bits, (uint64_t) timestamp, 64);
+        encoder->leading[0] = encoder->leading[1] = -1;
+    }
+    else {
+        long delta = (timestamp - encoder->last_timestamp) / encoder->time_unit;
+        if (encoder->count == 1) {
+            bit_write(&encoder->bits, (uint64_t) delta, 32);
+        }
+        else {
+            long dod = delta - encoder->last_delta;
+            if (dod == 0) {
+                bit_write(&encoder->bits, 0, 1);
+            }
+            else if (dod >= -64 && dod <= 63) {
+                bit_write(&encoder->bits, 2, 2);
+                bit_write(&encoder->bits, (uint64_t) dod, 7);
+            }
+            else if (dod >= -256 && dod <= 255) {
+                bit_write(&encoder->bits, 6, 3);
+                bit_write(&encoder->bits, (uint64_t) dod, 9);
+            }
+            else if (dod >= -2048 && dod <= 2047) {
+                bit_write(&encoder->bits, 14, 4);
+                bit_write(&encoder->bits, (uint64_t) dod, 12);
+            }
+            else {
+                bit_write(&encoder->bits, 15, 4);
+                bit_write(&encoder->bits, (uint64_t) dod, 32);
+            }
+        }
+        encoder->last_delta = delta;
+    }
+    encoder->last_timestamp = timestamp;
+
+    if (encoder->count == 0) {
+        memcpy(&encoder->last_value[0], &temperature, sizeof(double));
+        memcpy(&encoder->last_value[1], &pressure, sizeof(double));
+        bit_write(&encoder->bits, encoder->last_value[0], 64);
+        bit_write(&encoder->bits, encoder->last_value[1], 64);
+    }
+    else {
+        gorilla_append_value(encoder, 0, temperature);
+        gorilla_append_value(encoder, 1, pressure);
+    }
+    encoder->count++;
+}
+
+// sign-extends the low `bits` bits of value
+long sign_extend(uint64_t value, int bits) {
+    uint64_t sign = 1ULL << (bits - 1);
+    return (long) ((value ^ sign) - sign);
+}
+
+/* Decodes a whole encoded series into points (which must hold count
+ * entries). Returns the number of points decoded. */
+uint32_t gorilla_decode(const uint8_t *bytes, size_t num_bytes, uint32_t count, uint32_t time_unit,
+        struct series_point *points) {
+    struct bit_reader reader = {bytes, num_bytes, 0};
+    uint64_t value[2] = {0, 0};
+    int leading[2] = {0, 0}, trailing[2] = {0, 0};
+    long timestamp = 0, delta = 0;
+    uint32_t i;
+    int column;
+
+    for (i = 0; i < count; i++) {
+        if (i == 0) {
+            timestamp = (long) bit_read(&reader, 64);
+            value[0] = bit_read(&reader, 64);
+            value[1] = bit_read(&reader, 64);
+        }
+        else {
+            if (i == 1) {
+                delta = sign_extend(bit_read(&reader, 32), 32);
+            }
+            else if (bit_read(&reader, 1) == 0) {
+                // same delta as before
+            }
+            else if (bit_read(&reader, 1) == 0) {
+                delta += sign_extend(bit_read(&reader, 7), 7);
+            }
+            else if (bit_read(&reader, 1) == 0) {
+                delta += sign_extend(bit_read(&reader, 9), 9);
+            }
+            else if (bit_read(&reader, 1) == 0) {
+                delta += sign_extend(bit_read(&reader, 12), 12);
+            }
+            else {
+                delta += sign_extend(bit_read(&reader, 32), 32);
+            }
+            timestamp += delta * (long) time_unit;
+
+            for (column = 0; column < 2; column++) {
+                if (bit_read(&reader, 1) == 0) {
+                    continue;
+                }
+                if (bit_read(&reader, 1) != 0) {
+                    int length;
+                    leading[column] = (int) bit_read(&reader, 5);
+                    length = (int) bit_read(&reader, 6);
+                    if (length == 0) {
+                        length = 64;
+                    }
+                    trailing[column] = 64 - leading[column] - length;
+                }
+                value[column] ^= bit_read(&reader, 64 - leading[column] - trailing[column]) << trailing[column];
+            }
+        }
+        if (reader.position > num_bytes * 8) {
+            break;
+        }
+        points[i].timestamp = timestamp;
+        memcpy(&points[i].temperature, &value[0], sizeof(double));
+        memcpy(&points[i].pressure, &value[1], sizeof(double));
+    }
+    return i;
+}
+
+int compare_points(const void *a, const void *b) {
+    long ta = ((const struct series_point*) a)->timestamp;
+    long tb = ((const struct series_point*) b)->timestamp;
+    return (ta > tb) - (ta < tb);
+}
+
+long gcd(long a, long b) {
+    while (b != 0) {
+        long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Series store file: the 8-byte magic, version and number of series as
+ * 32-bit integers, then per location its geohash (12 chars), point count,
+ * time unit in seconds and encoded length in bytes (32-bit each), followed
+ * by the encoded bytes. Points arrive out of order, so each location's
+ * points are sorted before encoding. Returns 0 on success. */
+int write_series_store(const char *path) {
+    FILE *out = fopen(path, "wb");
+    uint32_t header[2] = {SERIES_VERSION, geohashes.count};
+    unsigned long long raw_bytes = 0, encoded_bytes = 0, num_points = 0;
+    uint32_t id;
+    int ok;
+    if (out == NULL) {
+        return -1;
+    }
+    ok = fwrite(SERIES_MAGIC, 1, 8, out) == 8 && fwrite(header, sizeof(header), 1, out) == 1;
+
+    for (id = 0; ok && id < geohashes.count; id++) {
+        struct point_list empty = {0, 0, NULL};
+        struct point_list *list = id < location_points_capacity ? &location_points[id] : &empty;
+        struct gorilla_encoder encoder;
+        char geohash[GEOHASH_LENGTH] = {0};
+        long unit = 0;
+        uint32_t i, entry[3];
+
+        qsort(list->points, list->count, sizeof(struct series_point), compare_points);
+        // common time step, so regular series have delta-of-delta 0 in few bits
+        for (i = 1; i < list->count; i++) {
+            unit = gcd(unit, list->points[i].timestamp - list->points[0].timestamp);
+        }
+        gorilla_init(&encoder, unit > 0 && unit <= UINT32_MAX ? (uint32_t) unit : 1);
+        for (i = 0; i < list->count; i++) {
+            gorilla_append(&encoder, list->points[i].timestamp, list->points[i].temperature,
+                    list->points[i].pressure);
+        }
+
+        memcpy(geohash, geohashes.names[id], strlen(geohashes.names[id]));
+        entry[0] = encoder.count;
+        entry[1] = encoder.time_unit;
+        entry[2] = (uint32_t) ((encoder.bits.num_bits + 7) / 8);
+        ok = fwrite(geohash, 1, GEOHASH_LENGTH, out) == GEOHASH_LENGTH
+            && fwrite(entry, sizeof(entry), 1, out) == 1
+            && fwrite(encoder.bits.bytes, 1, entry[2], out) == entry[2];
+
+        num_points += list->count;
+        raw_bytes += (unsigned long long) list->count * 3 * sizeof(double);
+        encoded_bytes += entry[2];
+        free(encoder.bits.bytes);
+        free(list->points);
+        list->points = NULL;
+        list->count = list->capacity = 0;
+    }
+
+    if (fclose(out) != 0 || !ok) {
+        return -1;
+    }
+    printf("Series Store: %u locations, %llu points\n", geohashes.count, num_points);
+    printf("Series Store Size: %llu bytes encoded, %llu bytes raw (%.1fx)\n", encoded_bytes, raw_bytes,
+            encoded_bytes > 0 ? (double) raw_bytes / encoded_bytes : 0.0);
+    return 0;
+}
+
+// prints the decoded series of one location from a series store
+int print_series(const char *path, const char *geohash) {
+    FILE *in = fopen(path, "rb");
+    char magic[8], name[GEOHASH_LENGTH + 1];
+    uint32_t header[2], entry[3], s;
+    if (in == NULL) {
+        printf("Error: File \"%s\" does not exist.\n", path);
+        return -1;
+    }
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, SERIES_MAGIC, 8) != 0
+            || fread(header, sizeof(header), 1, in) != 1 || header[0] != SERIES_VERSION) {
+        printf("Error: \"%s\" is not a series store.\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    name[GEOHASH_LENGTH] = '\0';
+    for (s = 0; s < header[1]; s++) {
+        if (fread(name, 1, GEOHASH_LENGTH, in) != GEOHASH_LENGTH || fread(entry, sizeof(entry), 1, in) != 1) {
+            break;
+        }
+        if (strcmp(name, geohash) != 0) {
+            fseek(in, entry[2], SEEK_CUR);
+            continue;
+        }
+
+        uint8_t *bytes = (uint8_t*) malloc(entry[2] + 1);
+        struct series_point *points = (struct series_point*) malloc((entry[0] + 1) * sizeof(struct series_point));
+        uint32_t n = fread(bytes, 1, entry[2], in) == entry[2]
+            ? gorilla_decode(bytes, entry[2], entry[0], entry[1], points) : 0;
+        uint32_t i;
+        printf("Location: %s (%u points)\n", name, n);
+        // a location's series does not record its state, so its times are in UTC
+        for (i = 0; i < n; i++) {
+            printf("%ld  %7.2fF  %9.1f Pa  %s", points[i].timestamp, points[i].temperature,
+                    points[i].pressure, local_ctime("", points[i].timestamp));
+        }
+        free(bytes);
+        free(points);
+        fclose(in);
+        return 0;
+    }
+    printf("Error: Location \"%s\" not found.\n", geohash);
+    fclose(in);
+    return -1;
+}
+
+void add_history_record(uint32_t location, const struct record *rec) {
+    struct history_list *list;
+    struct history_record *stored;
+    if (location >= location_history_capacity) {
+        uint32_t capacity = location_history_capacity == 0 ? 1024 : location_history_capacity;
+        while (capacity <= location) {
+            capacity *= 2;
+        }
+        location_history = (struct history_list*) realloc(location_history, capacity * sizeof(struct history_list));
+        memset(location_history + location_history_capacity, 0,
+                (capacity - location_history_capacity) * sizeof(struct history_list));
+        location_history_capacity = capacity;
+    }
+    list = &location_history[location];
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->records = (struct history_record*) realloc(list->records,
+                list->capacity * sizeof(struct history_record));
+    }
+    stored = &list->records[list->count++];
+    memset(stored, 0, sizeof(*stored));
+    stored->timestamp = rec->timestamp;
+    memcpy(stored->code, rec->code, 2);
+    stored->snow = rec->snow != 0;
+    stored->lightning = rec->lightning != 0;
+    stored->humidity = (float) rec->humidity;
+    stored->cloudcover = (float) rec->cloudcover;
+    stored->pressure = (float) rec->pressure;
+    stored->temperature = (float) rec->temperature;
+}
+
+int compare_history_records(const void *a, const void *b) {
+    int64_t ta = ((const struct history_record*) a)->timestamp;
+    int64_t tb = ((const struct history_record*) b)->timestamp;
+    return (ta > tb) - (ta < tb);
+}
+
+int compare_geohash_ids(const void *a, const void *b) {
+    return strcmp(geohashes.names[*(const uint32_t*) a], geohashes.names[*(const uint32_t*) b]);
+}
+
+/* History store file: the 8-byte magic, version and number of locations as
+ * 32-bit integers, the directory (one history_entry per location, sorted
+ * by geohash), then each location's records sorted by timestamp, one
+ * location after another. Returns 0 on success. */
+int write_history_store(const char *path) {
+    FILE *out = fopen(path, "wb");
+    uint32_t header[2] = {HISTORY_VERSION, geohashes.count};
+    uint32_t *order = (uint32_t*) malloc((geohashes.count + 1) * sizeof(uint32_t));
+    uint64_t offset = 8 + sizeof(header) + (uint64_t) geohashes.count * sizeof(struct history_entry);
+    uint32_t i;
+    int ok;
+    if (out == NULL) {
+        free(order);
+        return -1;
+    }
+
+    for (i = 0; i < geohashes.count; i++) {
+        order[i] = i;
+    }
+    qsort(order, geohashes.count, sizeof(uint32_t), compare_geohash_ids);
+
+    ok = fwrite(HISTORY_MAGIC, 1, 8, out) == 8 && fwrite(header, sizeof(header), 1, out) == 1;
+    for (i = 0; ok && i < geohashes.count; i++) {
+        struct history_entry entry;
+        uint32_t id = order[i];
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.geohash, geohashes.names[id], strlen(geohashes.names[id]));
+        entry.count = id < location_history_capacity ? location_history[id].count : 0;
+        entry.offset = offset;
+        offset += (uint64_t) entry.count * sizeof(struct history_record);
+        ok = fwrite(&entry, sizeof(entry), 1, out) == 1;
+    }
+    for (i = 0; ok && i < geohashes.count; i++) {
+        struct history_list *list;
+        if (order[i] >= location_history_capacity) {
+            continue;
+        }
+        list = &location_history[order[i]];
+        qsort(list->records, list->count, sizeof(struct history_record), compare_history_records);
+        ok = fwrite(list->records, sizeof(struct history_record), list->count, out) == list->count;
+        free(list->records);
+        list->records = NULL;
+        list->count = list->capacity = 0;
+    }
+
+    free(order);
+    return fclose(out) == 0 && ok ? 0 : -1;
+}
+
+/* Prints one location's records from a history store. The directory is
+ * binary searched on disk and only the location's own records are read. */
+int print_history(const char *path, const char *geohash) {
+    FILE *in = fopen(path, "rb");
+    char magic[8], key[GEOHASH_LENGTH] = {0};
+    uint32_t header[2];
+    struct history_entry entry;
+    long lo, hi;
+    if (in == NULL) {
+        printf("Error: File \"%s\" does not exist.\n", path);
+        return -1;
+    }
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, HISTORY_MAGIC, 8) != 0
+            || fread(header, sizeof(header), 1, in) != 1 || header[0] != HISTORY_VERSION) {
+        printf("Error: \"%s\" is not a history store.\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    memcpy(key, geohash, strnlen(geohash, GEOHASH_LENGTH));
+    lo = 0;
+    hi = (long) header[1];
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        int cmp;
+        if (fseek(in, (long) (8 + sizeof(header) + mid * sizeof(struct history_entry)), SEEK_SET) != 0
+                || fread(&entry, sizeof(entry), 1, in) != 1) {
+            break;
+        }
+        cmp = memcmp(entry.geohash, key, GEOHASH_LENGTH);
+        if (cmp == 0) {
+            struct history_record *records = (struct history_record*) malloc(
+                    (entry.count + 1) * sizeof(struct history_record));
+            uint32_t i, n = 0;
+            if (fseek(in, (long) entry.offset, SEEK_SET) == 0) {
+                n = (uint32_t) fread(records, sizeof(struct history_record), entry.count, in);
+            }
+            printf("Location: %.*s (%u records)\n", GEOHASH_LENGTH, entry.geohash, n);
+            printf("State  Temperature  Humidity  Cloud Cover  Pressure  Snow  Lightning  Time\n");
+            for (i = 0; i < n; i++) {
+                char code[3] = {records[i].code[0], records[i].code[1], '\0'};
+                printf("%s  %13.1fF  %7.1f%%  %10.1f%%  %8.0f  %4d  %9d  %s", code,
+                        records[i].temperature, records[i].humidity, records[i].cloudcover,
+                        records[i].pressure, records[i].snow, records[i].lightning,
+                        local_ctime(code, (long) records[i].timestamp));
+            }
+            free(records);
+            fclose(in);
+            return 0;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    printf("Error: Location \"%s\" not found.\n", geohash);
+    fclose(in);
+    return -1;
+}
+
+// number of worker threads: --threads, or the number of online cores
+int num_threads(void) {
+    long cores;
+    if (options.threads > 0) {
+        return options.threads;
+    }
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int) cores : 1;
+}
+
+void add_raster_point(const struct record *rec) {
+    double latitude, longitude, value = 0;
+    if (geohash_decode(rec->geohash, (int) strlen(rec->geohash), &latitude, &longitude) != 0) {
+        return;
+    }
+    switch (options.heatmap_metric) {
+        case METRIC_TEMPERATURE: value = rec->temperature; break;
+        case METRIC_HUMIDITY: value = rec->humidity; break;
+        case METRIC_CLOUDCOVER: value = rec->cloudcover; break;
+        case METRIC_PRESSURE: value = rec->pressure; break;
+        case METRIC_SNOW: value = rec->snow; break;
+        case METRIC_LIGHTNING: value = rec->lightning; break;
+    }
+    if (num_raster_points == raster_points_capacity) {
+        raster_points_capacity = raster_points_capacity == 0 ? 4096 : raster_points_capacity * 2;
+        raster_points = (struct raster_point*) realloc(raster_points,
+                raster_points_capacity * sizeof(struct raster_point));
+    }
+    raster_points[num_raster_points].latitude = (float) latitude;
+    raster_points[num_raster_points].longitude = (float) longitude;
+    raster_points[num_raster_points].value = (float) value;
+    num_raster_points++;
+}
+
+// row of a latitude in the heatmap (row 0 is the north edge), -1 if outside
+int raster_row(double latitude) {
+    double south = options.bbox[0], north = options.bbox[2];
+    int row;
+    if (latitude < south || latitude > north) {
+        return -1;
+    }
+    row = (int) ((north - latitude) / (north - south) * options.grid_height);
+    return row < options.grid_height ? row : options.grid_height - 1;
+}
+
+// accumulates a band's points into the band's own rows
+void *rasterize_band(void *arg) {
+    struct raster_band *band = (struct raster_band*) arg;
+    double west = options.bbox[1], east = options.bbox[3];
+    size_t i;
+    for (i = 0; i < band->num_points; i++) {
+        const struct raster_point *point = &band->points[i];
+        int row = raster_row(point->latitude);
+        int column;
+        size_t cell;
+        if (point->longitude < west || point->longitude > east) {
+            continue;
+        }
+        column = (int) ((point->longitude - west) / (east - west) * options.grid_width);
+        if (column >= options.grid_width) {
+            column = options.grid_width - 1;
+        }
+        cell = (size_t) (row - band->first_row) * options.grid_width + column;
+        band->sum[cell] += point->value;
+        band->count[cell]++;
+    }
+    return NULL;
+}
+
+/* Rasterizes the mean value per cell. Points are partitioned by row band
+ * with a counting sort, then each thread fills its own band of the grid,
+ * so no atomics or merge step are needed. Writes an 8-bit PGM (empty cells
+ * black, values scaled to 1-255) if path ends in .pgm, otherwise a raw
+ * row-major float32 grid with NaN for empty cells. Returns 0 on success. */
+int write_heatmap(const char *path) {
+    int threads = num_threads(), t;
+    int width = options.grid_width, height = options.grid_height;
+    size_t cells = (size_t) width * height, i;
+    double *sum = (double*) calloc(cells, sizeof(double));
+    unsigned int *count = (unsigned int*) calloc(cells, sizeof(unsigned int));
+    struct raster_point *sorted;
+    struct raster_band *bands;
+    pthread_t *workers;
+    size_t *starts;
+    int *band_of_row;
+    FILE *out;
+    int ok = 1;
+
+    if (!options.has_bbox) {
+        // default bounds: the extent of the data
+        options.bbox[0] = options.bbox[1] = DBL_MAX;
+        options.bbox[2] = options.bbox[3] = -DBL_MAX;
+        for (i = 0; i < num_raster_points; i++) {
+            double latitude = raster_points[i].latitude, longitude = raster_points[i].longitude;
+            if (latitude < options.bbox[0]) options.bbox[0] = latitude;
+            if (latitude > options.bbox[2]) options.bbox[2] = latitude;
+            if (longitude < options.bbox[1]) options.bbox[1] = longitude;
+            if (longitude > options.bbox[3]) options.bbox[3] = longitude;
+        }
+        if (num_raster_points == 0 || options.bbox[2] <= options.bbox[0] || options.bbox[3] <= options.bbox[1]) {
+            options.bbox[0] -= 0.5;
+            options.bbox[1] -= 0.5;
+            options.bbox[2] += 0.5;
+            options.bbox[3] += 0.5;
+        }
+    }
+    if (threads > height) {
+        threads = height;
+    }
+
+    // counting sort of the points by band (points outside the bounds are dropped)
+    bands = (struct raster_band*) calloc(threads, sizeof(struct raster_band));
+    workers = (pthread_t*) malloc(threads * sizeof(pthread_t));
+    starts = (size_t*) calloc(threads + 1, sizeof(size_t));
+    band_of_row = (int*) malloc(height * sizeof(int));
+    sorted = (struct raster_point*) malloc((num_raster_points + 1) * sizeof(struct raster_point));
+    for (t = 0; t < threads; t++) {
+        int row;
+        bands[t].first_row = (int) ((long) height * t / threads);
+        bands[t].last_row = (int) ((long) height * (t + 1) / threads);
+        for (row = bands[t].first_row; row < bands[t].last_row; row++) {
+            band_of_row[row] = t;
+        }
+    }
+    for (i = 0; i < num_raster_points; i++) {
+        int row = raster_row(raster_points[i].latitude);
+        if (row >= 0) {
+            starts[band_of_row[row] + 1]++;
+        }
+    }
+    for (t = 0; t < threads; t++) {
+        starts[t + 1] += starts[t];
+        bands[t].points = sorted + starts[t];
+        bands[t].num_points = starts[t + 1] - starts[t];
+    }
+    for (i = 0; i < num_raster_points; i++) {
+        int row = raster_row(raster_points[i].latitude);
+        if (row >= 0) {
+            sorted[starts[band_of_row[row]]++] = raster_points[i];
+        }
+    }
+
+    for (t = 0; t < threads; t++) {
+        bands[t].sum = sum + (size_t) bands[t].first_row * width;
+        bands[t].count = count + (size_t) bands[t].first_row * width;
+        if (pthread_create(&workers[t], NULL, rasterize_band, &bands[t]) != 0) {
+            rasterize_band(&bands[t]);
+            workers[t] = pthread_self();
+        }
+    }
+    for (t = 0; t < threads; t++) {
+        if (!pthread_equal(workers[t], pthread_self())) {
+            pthread_join(workers[t], NULL);
+        }
+    }
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        ok = 0;
+    }
+    else if (strlen(path) >= 4 && strcmp(path + strlen(path) - 4, ".pgm") == 0) {
+        double min = DBL_MAX, max = -DBL_MAX;
+        unsigned char *pixels = (unsigned char*) calloc(cells, 1);
+        for (i = 0; i < cells; i++) {
+            if (count[i] > 0) {
+                double mean = sum[i] / count[i];
+                if (mean < min) min = mean;
+                if (mean > max) max = mean;
+            }
+        }
+        for (i = 0; i < cells; i++) {
+            if (count[i] > 0) {
+                double scaled = max > min ? (sum[i] / count[i] - min) / (max - min) : 1.0;
+                pixels[i] = (unsigned char) (1 + scaled * 254);
+            }
+        }
+        fprintf(out, "P5\n%d %d\n255\n", width, height);
+        ok = fwrite(pixels, 1, cells, out) == cells;
+        free(pixels);
+        printf("Heatmap: %s %dx%d, %.2f to %.2f\n", metric_names[options.heatmap_metric], width, height,
+                min <= max ? min : 0.0, min <= max ? max : 0.0);
+    }
+    else {
+        float *grid = (float*) malloc(cells * sizeof(float));
+        for (i = 0; i < cells; i++) {
+            grid[i] = count[i] > 0 ? (float) (sum[i] / count[i]) : NAN;
+        }
+        ok = fwrite(grid, sizeof(float), cells, out) == cells;
+        free(grid);
+        printf("Heatmap: %s %dx%d float32\n", metric_names[options.heatmap_metric], width, height);
+    }
+    if (out != NULL && fclose(out) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        printf("Heatmap Bounds: %.4f,%.4f,%.4f,%.4f\n", options.bbox[0], options.bbox[1],
+                options.bbox[2], options.bbox[3]);
+    }
+
+    free(sum);
+    free(count);
+    free(sorted);
+    free(bands);
+    free(workers);
+    free(starts);
+    free(band_of_row);
+    return ok ? 0 : -1;
+}
+
+/* Parses the rings of a WKT POLYGON or MULTIPOLYGON into the region. Every
+ * innermost parenthesized list of "x y" pairs is one ring. Returns 0 on
+ * success. */
+int parse_wkt(const char *wkt, struct region *region) {
+    const char *p = wkt;
+    int depth = 0;
+
+    while (*p == ' ') {
+        p++;
+    }
+    if (strncmp(p, "MULTIPOLYGON", 12) == 0) {
+        p += 12;
+    }
+    else if (strncmp(p, "POLYGON", 7) == 0) {
+        p += 7;
+    }
+    else {
+        return -1;
+    }
+
+    region->num_rings = 0;
+    region->rings = NULL;
+    region->ring_sizes = NULL;
+    region->bounds[0] = region->bounds[1] = DBL_MAX;
+    region->bounds[2] = region->bounds[3] = -DBL_MAX;
+    for (; *p != '\0'; p++) {
+        if (*p == ')') {
+            depth--;
+            continue;
+        }
+        if (*p != '(') {
+            continue;
+        }
+        depth++;
+        // an innermost list starts with a number, not another '('
+        const char *q = p + 1;
+        while (*q == ' ') {
+            q++;
+        }
+        if (*q == '(') {
+            continue;
+        }
+
+        int capacity = 16, n = 0;
+        double *xy = (double*) malloc(capacity * 2 * sizeof(double));
+        char *end;
+        q = p + 1;
+        for (;;) {
+            double x = strtod(q, &end), y;
+            if (end == q) {
+                break;
+            }
+            q = end;
+            y = strtod(q, &end);
+            if (end == q) {
+                break;
+            }
+            q = end;
+            if (n == capacity) {
+                capacity *= 2;
+                xy = (double*) realloc(xy, capacity * 2 * sizeof(double));
+            }
+            xy[2 * n] = x;
+            xy[2 * n + 1] = y;
+            n++;
+            // lon/lat bounds of the region: south, west, north, east
+            if (y < region->bounds[0]) region->bounds[0] = y;
+            if (x < region->bounds[1]) region->bounds[1] = x;
+            if (y > region->bounds[2]) region->bounds[2] = y;
+            if (x > region->bounds[3]) region->bounds[3] = x;
+            while (*q == ' ') {
+                q++;
+            }
+            if (*q != ',') {
+                break;
+            }
+            q++;
+        }
+        if (*q != ')' || n < 3) {
+            free(xy);
+            return -1;
+        }
+        region->rings = (double**) realloc(region->rings, (region->num_rings + 1) * sizeof(double*));
+        region->ring_sizes = (int*) realloc(region->ring_sizes, (region->num_rings + 1) * sizeof(int));
+        region->rings[region->num_rings] = xy;
+        region->ring_sizes[region->num_rings] = n;
+        region->num_rings++;
+        p = q - 1;
+    }
+    return depth == 0 && region->num_rings > 0 ? 0 : -1;
+}
+
+/* Grid cell range [first, last] covered by a coordinate range on one axis.
+ * When every region is degenerate on the axis (hi == lo) it has one cell. */
+void region_cell_range(double min, double max, double lo, double hi, int *first, int *last) {
+    int cell_min = 0, cell_max = 0;
+    if (hi > lo) {
+        cell_min = (int) fmin(fmax((min - lo) / (hi - lo) * REGION_GRID, 0), REGION_GRID - 1);
+        cell_max = (int) fmin(fmax((max - lo) / (hi - lo) * REGION_GRID, 0), REGION_GRID - 1);
+    }
+    *first = cell_min;
+    *last = cell_max;
+}
+
+/* Loads the NAME<tab>WKT regions of a file and builds the grid index.
+ * Returns NULL if the file can't be read or a line doesn't parse. */
+struct region_index *load_regions(const char *path) {
+    FILE *in = fopen(path, "r");
+    struct region_index *index;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int capacity = 0, r, i, j, line_number = 0;
+    if (in == NULL) {
+        return NULL;
+    }
+    index = (struct region_index*) calloc(1, sizeof(struct region_index));
+    index->bounds[0] = index->bounds[1] = DBL_MAX;
+    index->bounds[2] = index->bounds[3] = -DBL_MAX;
+
+    while (getline(&line, &line_capacity, in) != -1) {
+        char *tab = strchr(line, '\t');
+        struct region *region;
+        line_number++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if (tab == NULL) {
+            printf("Error: %s:%d: expected NAME<tab>WKT.\n", path, line_number);
+            fclose(in);
+            free(line);
+            return NULL;
+        }
+        if (index->num_regions == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            index->regions = (struct region*) realloc(index->regions, capacity * sizeof(struct region));
+        }
+        region = &index->regions[index->num_regions];
+        memset(region, 0, sizeof(*region));
+        *tab = '\0';
+        snprintf(region->name, sizeof(region->name), "%s", line);
+        if (parse_wkt(tab + 1, region) != 0) {
+            printf("Error: %s:%d: invalid POLYGON/MULTIPOLYGON.\n", path, line_number);
+            fclose(in);
+            free(line);
+            return NULL;
+        }
+        for (i = 0; i < 2; i++) {
+            if (region->bounds[i] < index->bounds[i]) index->bounds[i] = region->bounds[i];
+            if (region->bounds[i + 2] > index->bounds[i + 2]) index->bounds[i + 2] = region->bounds[i + 2];
+        }
+        index->num_regions++;
+    }
+    free(line);
+    fclose(in);
+
+    // register each region in the grid cells its bounds overlap
+    index->cell_counts = (int*) calloc(REGION_GRID * REGION_GRID, sizeof(int));
+    index->cell_regions = (int**) calloc(REGION_GRID * REGION_GRID, sizeof(int*));
+    for (r = 0; r < index->num_regions; r++) {
+        int row0, row1, col0, col1;
+        region_cell_range(index->regions[r].bounds[0], index->regions[r].bounds[2],
+                index->bounds[0], index->bounds[2], &row0, &row1);
+        region_cell_range(index->regions[r].bounds[1], index->regions[r].bounds[3],
+                index->bounds[1], index->bounds[3], &col0, &col1);
+        for (i = row0; i <= row1; i++) {
+            for (j = col0; j <= col1; j++) {
+                int cell = i * REGION_GRID + j;
+                index->cell_regions[cell] = (int*) realloc(index->cell_regions[cell],
+                        (index->cell_counts[cell] + 1) * sizeof(int));
+                index->cell_regions[cell][index->cell_counts[cell]++] = r;
+            }
+        }
+    }
+    return index;
+}
+
+// even-odd ray casting over all of the region's rings
+int point_in_region(const struct region *region, double x, double y) {
+    int inside = 0, r, i, j;
+    for (r = 0; r < region->num_rings; r++) {
+        const double *xy = region->rings[r];
+        int n = region->ring_sizes[r];
+        for (i = 0, j = n - 1; i < n; j = i++) {
+            double xi = xy[2 * i], yi = xy[2 * i + 1], xj = xy[2 * j], yj = xy[2 * j + 1];
+            if ((yi > y) != (yj > y) && x < (xj - xi) * (y - yi) / (yj - yi) + xi) {
+                inside = !inside;
+            }
+        }
+    }
+    return inside;
+}
+
+/* Returns the region containing a location (-1 for none). Each location is
+ * tested once: candidates come from the grid cell, are filtered by their
+ * bounds and then tested exactly, and the answer is cached by ID. */
+int find_region(struct region_index *index, uint32_t location) {
+    double latitude, longitude;
+    int row, col, cell, k, found = -1;
+
+    if (location >= index->locations_capacity) {
+        uint32_t capacity = index->locations_capacity == 0 ? 1024 : index->locations_capacity, id;
+        while (capacity <= location) {
+            capacity *= 2;
+        }
+        index->region_of_location = (int*) realloc(index->region_of_location, capacity * sizeof(int));
+        for (id = index->locations_capacity; id < capacity; id++) {
+            index->region_of_location[id] = -2;
+        }
+        index->locations_capacity = capacity;
+    }
+    if (index->region_of_location[location] != -2) {
+        return index->region_of_location[location];
+    }
+
+    const char *name = geohashes.names[location];
+    if (index->num_regions > 0
+            && geohash_decode(name, (int) strlen(name), &latitude, &longitude) == 0
+            && latitude >= index->bounds[0] && latitude <= index->bounds[2]
+            && longitude >= index->bounds[1] && longitude <= index->bounds[3]) {
+        region_cell_range(latitude, latitude, index->bounds[0], index->bounds[2], &row, &row);
+        region_cell_range(longitude, longitude, index->bounds[1], index->bounds[3], &col, &col);
+        cell = row * REGION_GRID + col;
+        for (k = 0; k < index->cell_counts[cell]; k++) {
+            const struct region *region = &index->regions[index->cell_regions[cell][k]];
+            if (latitude >= region->bounds[0] && latitude <= region->bounds[2]
+                    && longitude >= region->bounds[1] && longitude <= region->bounds[3]
+                    && point_in_region(region, longitude, latitude)) {
+                found = index->cell_regions[cell][k];
+                break;
+            }
+        }
+    }
+    index->region_of_location[location] = found;
+    return found;
+}
+
+void add_region_record(const struct record *rec) {
+    int r = find_region(regions, intern_geohash(rec->geohash));
+    struct region *region;
+    if (r < 0) {
+        regions->num_outside++;
+        return;
+    }
+    region = &regions->regions[r];
+    region->num_records++;
+    region->sum_temperature += rec->temperature;
+    region->sum_humidity += rec->humidity;
+    region->sum_cloudcover += rec->cloudcover;
+    region->num_lightning += rec->lightning != 0;
+    region->num_snowcover += rec->snow != 0;
+}
+
+void print_regions(struct region_index *index) {
+    int r;
+    for (r = 0; r < index->num_regions; r++) {
+        struct region *region = &index->regions[r];
+        printf(" -- Region: %s --\n", region->name);
+        printf("Number of Records: %lu\n", region->num_records);
+        if (region->num_records == 0) {
+            continue;
+        }
+        printf("Average Humidity: %.1f%%\n", region->sum_humidity / region->num_records);
+        printf("Average Temperature: %.1fF\n", region->sum_temperature / region->num_records);
+        printf("Lightning Strikes: %lu\n", region->num_lightning);
+        printf("Records with Snow Cover: %lu\n", region->num_snowcover);
+        printf("Average Cloud Cover: %.1f%%\n", region->sum_cloudcover / region->num_records);
+    }
+    printf("Records outside all regions: %lu\n", index->num_outside);
+}
+
+void add_location_stats(uint32_t location, const struct record *rec) {
+    struct location_stats *stats;
+    if (location >= location_stats_capacity) {
+        uint32_t capacity = location_stats_capacity == 0 ? 1024 : location_stats_capacity;
+        while (capacity <= location) {
+            capacity *= 2;
+        }
+        location_stats = (struct location_stats*) realloc(location_stats, capacity * sizeof(struct location_stats));
+        memset(location_stats + location_stats_capacity, 0,
+                (capacity - location_stats_capacity) * sizeof(struct location_stats));
+        location_stats_capacity = capacity;
+    }
+    stats = &location_stats[location];
+    if (stats->num_records == 0 || rec->timestamp >= stats->latest_timestamp) {
+        memcpy(stats->code, rec->code, sizeof(stats->code));
+        stats->latest_timestamp = rec->timestamp;
+        stats->latest_temperature = rec->temperature;
+        stats->latest_humidity = rec->humidity;
+    }
+    stats->num_records++;
+    stats->sum_temperature += rec->temperature;
+    stats->sum_humidity += rec->humidity;
+    stats->num_lightning += rec->lightning != 0;
+    stats->num_snowcover += rec->snow != 0;
+}
+
+void to_unit_sphere(double latitude, double longitude, double *xyz) {
+    double phi = latitude * PI / 180, lambda = longitude * PI / 180;
+    xyz[0] = cos(phi) * cos(lambda);
+    xyz[1] = cos(phi) * sin(lambda);
+    xyz[2] = sin(phi);
+}
+
+/* Builds the implicit KD-tree in place: the range is partitioned around
+ * its middle element on the axis of widest spread (quickselect), then both
+ * halves are built recursively. */
+void kd_build(struct kd_node *nodes, int count) {
+    int mid = count / 2, lo = 0, hi = count - 1, axis = 0, a, i;
+    double min[3] = {DBL_MAX, DBL_MAX, DBL_MAX}, max[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+    if (count <= 0) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        for (a = 0; a < 3; a++) {
+            if (nodes[i].xyz[a] < min[a]) min[a] = nodes[i].xyz[a];
+            if (nodes[i].xyz[a] > max[a]) max[a] = nodes[i].xyz[a];
+        }
+    }
+    for (a = 1; a < 3; a++) {
+        if (max[a] - min[a] > max[axis] - min[axis]) {
+            axis = a;
+        }
+    }
+
+    while (lo < hi) {
+        double pivot = nodes[(lo + hi) / 2].xyz[axis];
+        int l = lo, r = hi;
+        while (l <= r) {
+            while (nodes[l].xyz[axis] < pivot) l++;
+            while (nodes[r].xyz[axis] > pivot) r--;
+            if (l <= r) {
+                struct kd_node tmp = nodes[l];
+                nodes[l++] = nodes[r];
+                nodes[r--] = tmp;
+            }
+        }
+        if (mid <= r) {
+            hi = r;
+        }
+        else if (mid >= l) {
+            lo = l;
+        }
+        else {
+            break;
+        }
+    }
+    nodes[mid].axis = axis;
+    kd_build(nodes, mid);
+    kd_build(nodes + mid + 1, count - mid - 1);
+}
+
+/* Adds the k nearest nodes of the range to target into best (indices into
+ * the whole node array, kept sorted by distance), visiting the far side of
+ * a split only if it can still hold a closer node. */
+void kd_search_range(const struct kd_node *nodes, int first, int count, const double *target, int k,
+        int *best, double *best_distance, int *num_best) {
+    int mid, i;
+    double d = 0, diff;
+    if (count <= 0) {
+        return;
+    }
+    mid = first + count / 2;
+    for (i = 0; i < 3; i++) {
+        double delta = nodes[mid].xyz[i] - target[i];
+        d += delta * delta;
+    }
+    if (*num_best < k || d < best_distance[*num_best - 1]) {
+        // insertion into the sorted list of the best k so far
+        i = *num_best < k ? (*num_best)++ : k - 1;
+        while (i > 0 && best_distance[i - 1] > d) {
+            best[i] = best[i - 1];
+            best_distance[i] = best_distance[i - 1];
+            i--;
+        }
+        best[i] = mid;
+        best_distance[i] = d;
+    }
+
+    diff = target[nodes[mid].axis] - nodes[mid].xyz[nodes[mid].axis];
+    if (diff < 0) {
+        kd_search_range(nodes, first, count / 2, target, k, best, best_distance, num_best);
+        if (*num_best < k || diff * diff < best_distance[*num_best - 1]) {
+            kd_search_range(nodes, mid + 1, count - count / 2 - 1, target, k, best, best_distance, num_best);
+        }
+    }
+    else {
+        kd_search_range(nodes, mid + 1, count - count / 2 - 1, target, k, best, best_distance, num_best);
+        if (*num_best < k || diff * diff < best_distance[*num_best - 1]) {
+            kd_search_range(nodes, first, count / 2, target, k, best, best_distance, num_best);
+        }
+    }
+}
+
+void kd_search(const struct kd_node *nodes, int count, const double *target, int k,
+        int *best, double *best_distance, int *num_best) {
+    *num_best = 0;
+    kd_search_range(nodes, 0, count, target, k, best, best_distance, num_best);
+}
+
+double elapsed_microseconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/* Builds a KD-tree over the distinct decoded locations and prints the k
+ * nearest to (latitude, longitude) with their aggregates. */
+void print_nearest(double latitude, double longitude, int k) {
+    struct kd_node *nodes = (struct kd_node*) malloc((geohashes.count + 1) * sizeof(struct kd_node));
+    int *best = (int*) malloc(k * sizeof(int));
+    double *best_distance = (double*) malloc(k * sizeof(double));
+    double target[3];
+    struct timespec start, built, searched;
+    int count = 0, num_best, i;
+    uint32_t id;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (id = 0; id < geohashes.count && id < location_stats_capacity; id++) {
+        double lat, lon;
+        if (location_stats[id].num_records == 0
+                || geohash_decode(geohashes.names[id], (int) strlen(geohashes.names[id]), &lat, &lon) != 0) {
+            continue;
+        }
+        to_unit_sphere(lat, lon, nodes[count].xyz);
+        nodes[count].location = id;
+        count++;
+    }
+    kd_build(nodes, count);
+    clock_gettime(CLOCK_MONOTONIC, &built);
+
+    to_unit_sphere(latitude, longitude, target);
+    kd_search(nodes, count, target, k, best, best_distance, &num_best);
+    clock_gettime(CLOCK_MONOTONIC, &searched);
+
+    printf("Nearest locations to %.4f,%.4f (index of %d locations built in %.0f us, query %.1f us):\n",
+            latitude, longitude, count, elapsed_microseconds(&start, &built),
+            elapsed_microseconds(&built, &searched));
+    for (i = 0; i < num_best; i++) {
+        struct location_stats *stats = &location_stats[nodes[best[i]].location];
+        const char *name = geohashes.names[nodes[best[i]].location];
+        double lat, lon;
+        // chord length to great-circle distance
+        double km = 2 * asin(sqrt(best_distance[i]) / 2) * EARTH_RADIUS_KM;
+        geohash_decode(name, (int) strlen(name), &lat, &lon);
+        printf("%2d. %s (%.4f,%.4f) %s, %.1f km\n", i + 1, name, lat, lon, stats->code, km);
+        printf("    Records: %lu, Average Temperature: %.1fF, Average Humidity: %.1f%%, "
+                "Lightning: %lu, Snow Cover: %lu\n", stats->num_records,
+                stats->sum_temperature / stats->num_records, stats->sum_humidity / stats->num_records,
+                stats->num_lightning, stats->num_snowcover);
+        printf("    Latest: %.1fF, %.1f%% on %s", stats->latest_temperature, stats->latest_humidity,
+                local_ctime(stats->code, stats->latest_timestamp));
+    }
+
+    free(nodes);
+    free(best);
+    free(best_distance);
+}
+
+/* Creates the temporary caches that --benchmark fills with the input
+ * records, one per ordered layout. Returns 0 on success. */
+int open_benchmark_caches(void) {
+    int order;
+    for (order = CACHE_ORDER_MORTON; order < NUM_CACHE_ORDERS; order++) {
+        int fd;
+        strcpy(benchmark_paths[order], "/tmp/climate-XXXXXX");
+        fd = mkstemp(benchmark_paths[order]);
+        if (fd < 0) {
+            return -1;
+        }
+        close(fd);
+        benchmark_caches[order] = cache_open(benchmark_paths[order], order);
+        if (benchmark_caches[order] == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// runs the queries against one cache, adding up blocks and selected records
+int scan_benchmark_cache(FILE *file, const struct record_filter *queries, int num_queries,
+        struct cache_block *block, struct cache_stats *stats, unsigned long *num_selected) {
+    uint64_t masks[CACHE_BLOCK_WORDS];
+    int q, w, status;
+    for (q = 0; q < num_queries; q++) {
+        if (fseek(file, 8 + 2 * sizeof(uint32_t), SEEK_SET) != 0) {
+            return -1;
+        }
+        while ((status = read_cache_block(file, block, &queries[q], stats)) == 1) {
+            int words = (int) (block->header.num_records + 63) / 64;
+            if (select_records(&queries[q], block, masks) != 0) {
+                for (w = 0; w < words; w++) {
+                    *num_selected += __builtin_popcountll(masks[w]);
+                }
+            }
+        }
+        if (status < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Compares the Morton- and time-ordered layouts of the input records on
+ * random bounding-box queries (BENCHMARK_BOX_FRACTION of the data extent
+ * per side) and random BENCHMARK_RANGE_DAYS time ranges, reporting the
+ * blocks each layout reads and skips, then times the geohash kernels on the
+ * records' geohash column. Removes the temporary caches. Returns 0 on
+ * success. */
+int run_benchmark(void) {
+    static const char *order_names[NUM_CACHE_ORDERS] = {"arrival", "morton", "time"};
+    static const char *query_names[2] = {"bbox", "7-day"};
+    struct cache_block *block = (struct cache_block*) malloc(sizeof(struct cache_block));
+    struct record_filter *queries[2];
+    struct cache_stats stats = {0, 0};
+    char (*hashes)[GEOHASH_LENGTH] = NULL;
+    size_t num_hashes = 0;
+    double south = 90, west = 180, north = -90, east = -180;
+    long first = LONG_MAX, last = LONG_MIN;
+    int order, type, q, failed = 0;
+    FILE *file;
+
+    for (order = CACHE_ORDER_MORTON; order < NUM_CACHE_ORDERS; order++) {
+        failed |= cache_close(benchmark_caches[order]) != 0;
+        benchmark_caches[order] = NULL;
+    }
+
+    // the data extent, from the zone maps, and the geohash column
+    file = failed ? NULL : fopen(benchmark_paths[CACHE_ORDER_TIME], "rb");
+    if (file != NULL && fseek(file, 8 + 2 * sizeof(uint32_t), SEEK_SET) == 0) {
+        while (read_cache_block(file, block, NULL, &stats) == 1) {
+            hashes = realloc(hashes, (num_hashes + block->header.num_records) * GEOHASH_LENGTH);
+            memcpy(hashes[num_hashes], block->geohash, block->header.num_records * GEOHASH_LENGTH);
+            num_hashes += block->header.num_records;
+            south = fmin(south, block->header.min_latitude);
+            north = fmax(north, block->header.max_latitude);
+            west = fmin(west, block->header.min_longitude);
+            east = fmax(east, block->header.max_longitude);
+            first = block->header.min_timestamp < first ? block->header.min_timestamp : first;
+            last = block->header.max_timestamp > last ? block->header.max_timestamp : last;
+        }
+        fclose(file);
+    }
+    else {
+        failed = 1;
+    }
+
+    printf(" -- Benchmark: Cache Layout (%d queries per type, %lu blocks) --\n",
+            BENCHMARK_QUERIES, stats.blocks_read);
+    if (!failed && stats.blocks_read > 0) {
+        double height = (north - south) * BENCHMARK_BOX_FRACTION;
+        double width = (east - west) * BENCHMARK_BOX_FRACTION;
+        long range = BENCHMARK_RANGE_DAYS * 86400L;
+        long span = last - first > range ? last - first - range : 0;
+
+        // the same random queries for both layouts
+        srand(1);
+        for (type = 0; type < 2; type++) {
+            queries[type] = (struct record_filter*) calloc(BENCHMARK_QUERIES, sizeof(struct record_filter));
+            for (q = 0; q < BENCHMARK_QUERIES; q++) {
+                struct record_filter *query = &queries[type][q];
+                double u = (double) rand() / RAND_MAX, v = (double) rand() / RAND_MAX;
+                query->snow = -1;
+                query->lightning = -1;
+                if (type == 0) {
+                    query->has_within = 1;
+                    query->within[0] = south + u * (north - south - height);
+                    query->within[1] = west + v * (east - west - width);
+                    query->within[2] = query->within[0] + height;
+                    query->within[3] = query->within[1] + width;
+                }
+                else {
+                    query->has_between = 1;
+                    query->from = first + (long) (u * span);
+                    query->to = query->from + range;
+                }
+            }
+        }
+
+        printf("Query  Layout  Blocks Read  Blocks Skipped     Records   Time (ms)\n");
+        for (type = 0; type < 2 && !failed; type++) {
+            for (order = CACHE_ORDER_MORTON; order < NUM_CACHE_ORDERS && !failed; order++) {
+                struct cache_stats layout_stats = {0, 0};
+                unsigned long num_selected = 0;
+                struct timespec start, end;
+                file = fopen(benchmark_paths[order], "rb");
+                if (file == NULL) {
+                    failed = 1;
+                    break;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                failed = scan_benchmark_cache(file, queries[type], BENCHMARK_QUERIES, block,
+                        &layout_stats, &num_selected) != 0;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                fclose(file);
+                printf("%-6s %-7s %11lu %15lu %11lu %11.1f\n", query_names[type], order_names[order],
+                        layout_stats.blocks_read, layout_stats.blocks_skipped, num_selected,
+                        elapsed_microseconds(&start, &end) / 1000);
+            }
+        }
+        free(queries[0]);
+        free(queries[1]);
+        benchmark_geohash_kernels(hashes, (int) num_hashes);
+    }
+    check_gorilla_round_trip();
+
+    for (order = CACHE_ORDER_MORTON; order < NUM_CACHE_ORDERS; order++) {
+        remove(benchmark_paths[order]);
+    }
+    free(hashes);
+    free(block);
+    return failed ? -1 : 0;
+}
+
+/* Times decoding the geohash column per record (geohash_decode) and with
+ * the batch kernels, and encoding it back, over at least a million
+ * geohashes. Mismatches count geohashes whose batch decode differs from
+ * geohash_decode or whose encoding differs from the original. */
+void benchmark_geohash_kernels(const char (*hashes)[GEOHASH_LENGTH], int count) {
+#if defined(__BMI2__)
+    const char *kernel = "BMI2";
+#elif defined(__SSE2__)
+    const char *kernel = "SSE2";
+#else
+    const char *kernel = "scalar";
+#endif
+    static const char *names[3] = {"decode (per record)", "decode (batch)", "encode (batch)"};
+    double *latitudes = (double*) malloc(count * sizeof(double));
+    double *longitudes = (double*) malloc(count * sizeof(double));
+    char (*encoded)[GEOHASH_LENGTH] = malloc((size_t) count * GEOHASH_LENGTH);
+    int repeats = (1000000 + count - 1) / count;
+    unsigned long mismatches = 0;
+    double elapsed[3];
+    int kernel_index, r, i;
+
+    for (kernel_index = 0; kernel_index < 3; kernel_index++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (r = 0; r < repeats; r++) {
+            if (kernel_index == 0) {
+                for (i = 0; i < count; i++) {
+                    geohash_decode(hashes[i], GEOHASH_LENGTH, &latitudes[i], &longitudes[i]);
+                }
+            }
+            else if (kernel_index == 1) {
+                geohash_decode_batch(hashes, count, latitudes, longitudes);
+            }
+            else {
+                geohash_encode_batch(latitudes, longitudes, count, encoded);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed[kernel_index] = elapsed_microseconds(&start, &end);
+    }
+
+    for (i = 0; i < count; i++) {
+        double latitude, longitude;
+        if (geohash_decode(hashes[i], GEOHASH_LENGTH, &latitude, &longitude) != 0
+                || latitude != latitudes[i] || longitude != longitudes[i]
+                || memcmp(encoded[i], hashes[i], GEOHASH_LENGTH) != 0) {
+            mismatches++;
+        }
+    }
+
+    printf(" -- Benchmark: Geohash Kernels (%s, %d x %d geohashes) --\n", kernel, repeats, count);
+    printf("Kernel                Time (ms)  Mhash/s\n");
+    for (kernel_index = 0; kernel_index < 3; kernel_index++) {
+        printf("%-20s %10.1f %8.1f\n", names[kernel_index], elapsed[kernel_index] / 1000,
+                (double) repeats * count / elapsed[kernel_index]);
+    }
+    printf("Mismatches: %lu\n", mismatches);
+    free(latitudes);
+    free(longitudes);
+    free(encoded);
+}
+
+/* Encodes and decodes series whose timestamps hit the edges of each
+ * delta-of-delta bucket (0, +-64/65, +-256/257, +-2048/2049 seconds, and
+ * points at 0, 1h, 66h and 67h in hour units) and prints the number of
+ * points that do not come back unchanged. */
+void check_gorilla_round_trip(void) {
+    static const long dods[] = {0, 63, -63, 64, -64, -64, 64, 65, -65, -65, 65, 255, -255, 256, -256,
+        -256, 256, 257, -257, 2047, -2047, 2048, -2048, -2048, 2048, 2049, -2049, 100000, -100000, 0};
+    static const long hours[] = {0, 1, 66, 67};
+    int num_dods = (int) (sizeof(dods) / sizeof(dods[0]));
+    struct series_point points[2 + sizeof(dods) / sizeof(dods[0])], decoded[2 + sizeof(dods) / sizeof(dods[0])];
+    unsigned long mismatches = 0;
+    int series, count, i;
+
+    for (series = 0; series < 2; series++) {
+        struct gorilla_encoder encoder;
+        uint32_t unit = series == 0 ? 3600 : 1;
+        long delta = 3600;
+        count = series == 0 ? 4 : num_dods + 2;
+        for (i = 0; i < count; i++) {
+            if (series == 0) {
+                points[i].timestamp = hours[i] * 3600;
+            }
+            else {
+                delta += i >= 2 ? dods[i - 2] : 0;
+                points[i].timestamp = i == 0 ? -86400 : points[i - 1].timestamp + delta;
+            }
+            points[i].temperature = i % 3 == 0 ? 32.0 : 32.0 + i * 0.25;
+            points[i].pressure = 101325.0 - (i % 5) * 7.5;
+        }
+        gorilla_init(&encoder, unit);
+        for (i = 0; i < count; i++) {
+            gorilla_append(&encoder, points[i].timestamp, points[i].temperature, points[i].pressure);
+        }
+        if (gorilla_decode(encoder.bits.bytes, (encoder.bits.num_bits + 7) / 8, encoder.count,
+                    encoder.time_unit, decoded) != (uint32_t) count) {
+            mismatches += count;
+        }
+        else {
+            for (i = 0; i < count; i++) {
+                mismatches += memcmp(&decoded[i], &points[i], sizeof(struct series_point)) != 0;
+            }
+        }
+        free(encoder.bits.bytes);
+    }
+    printf(" -- Benchmark: Series Codec Round Trip --\n");
+    printf("Mismatches: %lu\n", mismatches);
+}
+
+/* Returns the mask of the values outside [min, max], NaN included, testing
+ * two values at a time with SSE2. */
+uint64_t range_violations(const double *values, int count, double min, double max) {
+    uint64_t mask = 0;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128d low = _mm_set1_pd(min), high = _mm_set1_pd(max);
+    for (; i + 2 <= count; i += 2) {
+        __m128d value = _mm_loadu_pd(values + i);
+        __m128d valid = _mm_and_pd(_mm_cmpge_pd(value, low), _mm_cmple_pd(value, high));
+        mask |= (uint64_t) (~_mm_movemask_pd(valid) & 3) << i;
+    }
+#endif
+    for (; i < count; i++) {
+        mask |= (uint64_t) !(values[i] >= min && values[i] <= max) << i;
+    }
+    return mask;
+}
+
+// returns the mask of the values that are neither 0 nor 1
+uint64_t flag_violations(const double *values, int count) {
+    uint64_t mask = 0;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+    for (; i + 2 <= count; i += 2) {
+        __m128d value = _mm_loadu_pd(values + i);
+        __m128d valid = _mm_or_pd(_mm_cmpeq_pd(value, zero), _mm_cmpeq_pd(value, one));
+        mask |= (uint64_t) (~_mm_movemask_pd(valid) & 3) << i;
+    }
+#endif
+    for (; i < count; i++) {
+        mask |= (uint64_t) (values[i] != 0.0 && values[i] != 1.0) << i;
+    }
+    return mask;
+}
+
+// counts a violation of a line, keeping its offset as a sample while the file has few
+void count_violation(struct quality_counts *file_counts, struct quality_counts *state_counts,
+        int check, long offset) {
+    if (file_counts->violations[check] < PROFILE_SAMPLES) {
+        file_counts->samples[check][file_counts->violations[check]] = offset;
+    }
+    file_counts->violations[check]++;
+    state_counts->violations[check]++;
+}
+
+/* Runs the range checks of a batch's numeric columns, 64 lines at a time,
+ * and counts every violation of the batch. */
+void flush_profile(struct profile_batch *batch, struct quality_counts *file_counts,
+        struct quality_counts *state_counts) {
+    int check, i;
+    for (check = CHECK_TIMESTAMP; check < NUM_CHECKS; check++) {
+        const double *values = batch->values[check - CHECK_TIMESTAMP];
+        if (check == CHECK_SNOW || check == CHECK_LIGHTNING) {
+            batch->violations[check] = flag_violations(values, batch->count);
+        }
+        else {
+            batch->violations[check] = range_violations(values, batch->count,
+                    profile_ranges[check - CHECK_TIMESTAMP][0], profile_ranges[check - CHECK_TIMESTAMP][1]);
+        }
+    }
+    for (check = 0; check < NUM_CHECKS; check++) {
+        uint64_t mask = batch->violations[check];
+        while (mask != 0) {
+            i = __builtin_ctzll(mask);
+            mask &= mask - 1;
+            count_violation(file_counts, &state_counts[batch->slot[i]], check, batch->offset[i]);
+        }
+        batch->violations[check] = 0;
+    }
+    batch->count = 0;
+}
+
+// parses a whole field as a number, NaN if it is empty or has anything else
+double parse_field(const char *field) {
+    char *end;
+    double value = strtod(field, &end);
+    return end != field && *end == '\0' ? value : NAN;
+}
+
+// fgets() over `prefix` (bytes already read from the file) and then the file
+char *prefixed_gets(char *line, int size, FILE *file, const char **prefix, size_t *prefix_length) {
+    int n = 0;
+    while (*prefix_length > 0 && n < size - 1) {
+        (*prefix_length)--;
+        if ((line[n++] = *(*prefix)++) == '\n') {
+            break;
+        }
+    }
+    if (n == 0) {
+        return fgets(line, size, file);
+    }
+    line[n] = '\0';
+    if (line[n - 1] != '\n' && n < size - 1 && fgets(line + n, size - n, file) == NULL) {
+        line[n] = '\0';
+    }
+    return line;
+}
+
+/* Profiles one TDV file, after `prefix` (bytes already read from it): format
+ * checks (field count, state code, geohash) while splitting each line, range
+ * checks on the columns per batch. Returns the number of bytes profiled. */
+long profile_file(FILE *file, const char *prefix, size_t prefix_length, struct quality_counts *file_counts,
+        struct quality_counts *state_counts) {
+    struct profile_batch *batch = (struct profile_batch*) calloc(1, sizeof(struct profile_batch));
+    char line[PROFILE_LINE_SIZE];
+    long offset = 0;
+
+    while (prefixed_gets(line, sizeof(line), file, &prefix, &prefix_length) != NULL) {
+        size_t length = strlen(line);
+        long line_offset = offset;
+        char *fields[PROFILE_FIELDS];
+        int num_fields = 1, slot, c;
+
+        offset += (long) length;
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        else if (!feof(file)) {
+            // too long for any valid line: skip the rest of it
+            int ch;
+            while ((ch = fgetc(file)) != EOF && ch != '\n') {
+                offset++;
+            }
+            offset += ch == '\n';
+            num_fields = 0;
+        }
+
+        fields[0] = line;
+        for (c = 0; num_fields > 0 && line[c] != '\0'; c++) {
+            if (line[c] == '\t') {
+                line[c] = '\0';
+                if (num_fields < PROFILE_FIELDS) {
+                    fields[num_fields] = line + c + 1;
+                }
+                num_fields++;
+            }
+        }
+        slot = num_fields > 0 ? state_slot(fields[0]) : -1;
+        slot = slot >= 0 ? slot : NUM_STATES;
+        file_counts->lines++;
+        state_counts[slot].lines++;
+
+        if (num_fields != PROFILE_FIELDS) {
+            count_violation(file_counts, &state_counts[slot], CHECK_FORMAT, line_offset);
+            continue;
+        }
+
+        int i = batch->count++;
+        uint32_t invalid = strlen(fields[2]) != GEOHASH_LENGTH;
+        for (c = 0; c < GEOHASH_LENGTH && !invalid; c++) {
+            invalid |= geohash_codes[(unsigned char) fields[2][c]] == 0;
+        }
+        batch->offset[i] = line_offset;
+        batch->slot[i] = slot;
+        batch->violations[CHECK_STATE] |= (uint64_t) (slot == NUM_STATES) << i;
+        batch->violations[CHECK_GEOHASH] |= (uint64_t) invalid << i;
+        batch->values[0][i] = parse_field(fields[1]) / 1000;
+        for (c = 1; c < NUM_CHECKS - CHECK_TIMESTAMP; c++) {
+            batch->values[c][i] = parse_field(fields[c + 2]);
+        }
+        if (batch->count == PROFILE_BATCH) {
+            flush_profile(batch, file_counts, state_counts);
+        }
+    }
+    flush_profile(batch, file_counts, state_counts);
+    free(batch);
+    return offset;
+}
+
+// prints the violation counts of a file or state, with sample offsets for files
+unsigned long print_quality_counts(const struct quality_counts *counts, int with_samples) {
+    unsigned long total = 0;
+    int check, s;
+    for (check = 0; check < NUM_CHECKS; check++) {
+        total += counts->violations[check];
+    }
+    printf("Lines: %lu\n", counts->lines);
+    printf("Violations: %lu\n", total);
+    for (check = 0; check < NUM_CHECKS; check++) {
+        if (counts->violations[check] == 0) {
+            continue;
+        }
+        printf("  %s: %lu", check_names[check], counts->violations[check]);
+        if (with_samples) {
+            printf(" (at byte");
+            for (s = 0; s < PROFILE_SAMPLES && (unsigned long) s < counts->violations[check]; s++) {
+                printf("%s %ld", s == 0 ? "" : ",", counts->samples[check][s]);
+            }
+            printf(")");
+        }
+        printf("\n");
+    }
+    return total;
+}
+
+/* Runs the data-quality checks on the input files ("-" is standard input)
+ * and reports violations per file (with sample line offsets) and per state.
+ * Returns the total number of violations plus the inputs that could not be
+ * read, so the mode can be used as an ingest gate. */
+unsigned long profile_files(char *paths[], int num_paths) {
+    struct quality_counts *state_counts = (struct quality_counts*) calloc(NUM_STATES + 1,
+            sizeof(struct quality_counts));
+    struct quality_counts file_counts;
+    unsigned long total = 0, lines = 0, unreadable = 0;
+    struct timespec start, end;
+    long bytes = 0;
+    int i;
+
+    profile_ranges[0][1] = (double) time(NULL) + 86400;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num_paths; i++) {
+        char magic[8];
+        size_t magic_length;
+        FILE *file = strcmp(paths[i], "-") == 0 ? stdin : fopen(paths[i], "r");
+        if (file == NULL) {
+            printf("Error: File \"%s\" does not exist.\n", paths[i]);
+            unreadable++;
+            continue;
+        }
+        magic_length = fread(magic, 1, 8, file);
+        if (magic_length == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0) {
+            printf("Skipping cache file \"%s\".\n", paths[i]);
+            if (file != stdin) {
+                fclose(file);
+            }
+            continue;
+        }
+        memset(&file_counts, 0, sizeof(file_counts));
+        // pipes cannot be rewound, so the magic bytes are profiled first
+        bytes += profile_file(file, magic, magic_length, &file_counts, state_counts);
+        if (ferror(file)) {
+            printf("Error: Could not read \"%s\".\n", paths[i]);
+            unreadable++;
+        }
+        if (file != stdin) {
+            fclose(file);
+        }
+
+        printf(" -- Data Profile: %s --\n", paths[i]);
+        total += print_quality_counts(&file_counts, 1);
+        lines += file_counts.lines;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i <= NUM_STATES; i++) {
+        if (state_counts[i].lines > 0) {
+            printf(" -- Data Profile: State %s --\n", i < NUM_STATES ? state_codes[i] : "??");
+            print_quality_counts(&state_counts[i], 0);
+        }
+    }
+    printf(" -- Data Profile: %lu lines, %lu violations, %.1f MB/s --\n", lines, total,
+            bytes / elapsed_microseconds(&start, &end));
+    free(state_counts);
+    return total + unreadable;
+}
+
+void fb_init(struct flatbuffer *b) {
+    memset(b, 0, sizeof(*b));
+    b->max_align = 1;
+}
+
+// makes room for n more bytes, keeping the content at the end of the buffer
+void fb_reserve(struct flatbuffer *b, size_t n) {
+    if (b->size + n > b->capacity) {
+        size_t capacity = b->capacity == 0 ? 1024 : b->capacity;
+        uint8_t *data;
+        while (b->size + n > capacity) {
+            capacity *= 2;
+        }
+        data = (uint8_t*) malloc(capacity);
+        if (b->size > 0) {
+            memcpy(data + capacity - b->size, b->data + b->capacity - b->size, b->size);
+        }
+        free(b->data);
+        b->data = data;
+        b->capacity = capacity;
+    }
+}
+
+// prepends n bytes (in memory order)
+void fb_push(struct flatbuffer *b, const void *bytes, size_t n) {
+    if (n > 0) {
+        fb_reserve(b, n);
+        b->size += n;
+        memcpy(b->data + b->capacity - b->size, bytes, n);
+    }
+}
+
+// pads so that the next `additional` bytes end aligned to `align`
+void fb_prep(struct flatbuffer *b, size_t align, size_t additional) {
+    static const uint8_t zeros[16] = {0};
+    if (align > b->max_align) {
+        b->max_align = align;
+    }
+    fb_push(b, zeros, (align - (b->size + additional) % align) % align);
+}
+
+// prepends an aligned scalar, returns its position
+size_t fb_scalar(struct flatbuffer *b, const void *value, size_t n) {
+    fb_prep(b, n, 0);
+    fb_push(b, value, n);
+    return b->size;
+}
+
+void fb_start_table(struct flatbuffer *b) {
+    memset(b->fields, 0, sizeof(b->fields));
+    b->num_fields = 0;
+    b->table_start = b->size;
+}
+
+// adds a scalar field of the open table
+void fb_field(struct flatbuffer *b, int slot, const void *value, size_t n) {
+    b->fields[slot] = fb_scalar(b, value, n);
+    b->num_fields = slot + 1 > b->num_fields ? slot + 1 : b->num_fields;
+}
+
+// adds a field referring to an object prepended earlier
+void fb_field_offset(struct flatbuffer *b, int slot, size_t target) {
+    uint32_t offset;
+    fb_prep(b, 4, 0);
+    offset = (uint32_t) (b->size + 4 - target);
+    fb_push(b, &offset, 4);
+    b->fields[slot] = b->size;
+    b->num_fields = slot + 1 > b->num_fields ? slot + 1 : b->num_fields;
+}
+
+/* Closes the open table: prepends its offset to the vtable, then the vtable
+ * (the byte offsets of the fields within the table, 0 for absent fields).
+ * Returns the table's position. */
+size_t fb_end_table(struct flatbuffer *b) {
+    uint16_t vtable[2 + FB_MAX_FIELDS];
+    int32_t vtable_offset = 0;
+    size_t table;
+    int i;
+    table = fb_scalar(b, &vtable_offset, 4);
+    vtable[0] = (uint16_t) ((2 + b->num_fields) * 2);
+    vtable[1] = (uint16_t) (table - b->table_start);
+    for (i = 0; i < b->num_fields; i++) {
+        vtable[2 + i] = (uint16_t) (b->fields[i] != 0 ? table - b->fields[i] : 0);
+    }
+    fb_push(b, vtable, vtable[0]);
+    vtable_offset = (int32_t) (b->size - table);
+    memcpy(b->data + b->capacity - table, &vtable_offset, 4);
+    return table;
+}
+
+// prepends a vector of n scalars or structs of `size` bytes, returns its position
+size_t fb_vector(struct flatbuffer *b, const void *elements, size_t n, size_t size, size_t align) {
+    uint32_t length = (uint32_t) n;
+    fb_prep(b, 4, n * size);
+    fb_prep(b, align, n * size);
+    fb_push(b, elements, n * size);
+    fb_push(b, &length, 4);
+    return b->size;
+}
+
+// prepends a vector of offsets to objects prepended earlier
+size_t fb_offset_vector(struct flatbuffer *b, const size_t *targets, size_t n) {
+    uint32_t length = (uint32_t) n, offset;
+    size_t i;
+    fb_prep(b, 4, n * 4);
+    for (i = n; i > 0; i--) {
+        offset = (uint32_t) (b->size + 4 - targets[i - 1]);
+        fb_push(b, &offset, 4);
+    }
+    fb_push(b, &length, 4);
+    return b->size;
+}
+
+size_t fb_string(struct flatbuffer *b, const char *text) {
+    uint32_t length = (uint32_t) strlen(text);
+    uint8_t terminator = 0;
+    fb_prep(b, 4, length + 1);
+    fb_push(b, &terminator, 1);
+    fb_push(b, text, length);
+    fb_push(b, &length, 4);
+    return b->size;
+}
+
+// prepends the root offset; the finished buffer is the last b->size bytes of b->data
+void fb_finish(struct flatbuffer *b, size_t root) {
+    uint32_t offset;
+    fb_prep(b, b->max_align, 4);
+    offset = (uint32_t) (b->size + 4 - root);
+    fb_push(b, &offset, 4);
+}
+
+// prepends an Arrow Int type table
+size_t arrow_int_type(struct flatbuffer *b, int32_t bit_width, uint8_t is_signed) {
+    fb_start_table(b);
+    fb_field(b, 0, &bit_width, 4);
+    fb_field(b, 1, &is_signed, 1);
+    return fb_end_table(b);
+}
+
+/* Prepends the Schema table of the exported columns (see enum column). The
+ * state and geohash columns are dictionary-encoded strings. */
+size_t arrow_schema(struct flatbuffer *b) {
+    size_t fields[NUM_COLUMNS], table;
+    int16_t endianness = 0;
+    int f;
+
+    for (f = 0; f < NUM_COLUMNS; f++) {
+        size_t name = fb_string(b, column_names[f]);
+        size_t children = fb_offset_vector(b, NULL, 0);
+        size_t type, dictionary = 0;
+        uint8_t type_type;
+
+        if (f == COLUMN_STATE || f == COLUMN_GEOHASH) {
+            // Utf8 values, int8/int32 indices into the dictionary with the field's number as ID
+            int64_t id = f;
+            size_t index_type = arrow_int_type(b, f == COLUMN_STATE ? 8 : 32, 1);
+            fb_start_table(b);
+            fb_field(b, 0, &id, 8);
+            fb_field_offset(b, 1, index_type);
+            dictionary = fb_end_table(b);
+            fb_start_table(b);
+            type = fb_end_table(b);
+            type_type = ARROW_TYPE_UTF8;
+        }
+        else if (f == COLUMN_TIMESTAMP) {
+            int16_t unit = 0;
+            size_t timezone = fb_string(b, "UTC");
+            fb_start_table(b);
+            fb_field(b, 0, &unit, 2);
+            fb_field_offset(b, 1, timezone);
+            type = fb_end_table(b);
+            type_type = ARROW_TYPE_TIMESTAMP;
+        }
+        else if (f == COLUMN_SNOW || f == COLUMN_LIGHTNING) {
+            fb_start_table(b);
+            type = fb_end_table(b);
+            type_type = ARROW_TYPE_BOOL;
+        }
+        else {
+            int16_t precision = 2;
+            fb_start_table(b);
+            fb_field(b, 0, &precision, 2);
+            type = fb_end_table(b);
+            type_type = ARROW_TYPE_FLOATING_POINT;
+        }
+
+        fb_start_table(b);
+        fb_field_offset(b, 0, name);
+        fb_field(b, 2, &type_type, 1);
+        fb_field_offset(b, 3, type);
+        if (dictionary != 0) {
+            fb_field_offset(b, 4, dictionary);
+        }
+        fb_field_offset(b, 5, children);
+        fields[f] = fb_end_table(b);
+    }
+
+    table = fb_offset_vector(b, fields, NUM_COLUMNS);
+    fb_start_table(b);
+    fb_field(b, 0, &endianness, 2);
+    fb_field_offset(b, 1, table);
+    return fb_end_table(b);
+}
+
+/* Finishes a Message flatbuffer around a prepended header table and writes
+ * it as an encapsulated message (continuation marker, metadata length,
+ * metadata padded to 8 bytes), followed by the body buffers, each padded to
+ * ARROW_ALIGNMENT. Records the message's block for the footer. */
+void arrow_write_message(struct arrow_writer *writer, struct flatbuffer *b, uint8_t header_type,
+        size_t header, const void **buffers, const int64_t *lengths, int num_buffers,
+        struct arrow_block *block) {
+    static const uint8_t zeros[ARROW_ALIGNMENT] = {0};
+    int16_t version = ARROW_METADATA_V5;
+    int64_t body_length = 0;
+    uint32_t prefix[2];
+    size_t padding;
+    int i;
+
+    for (i = 0; i < num_buffers; i++) {
+        body_length += (lengths[i] + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+    }
+    fb_start_table(b);
+    fb_field(b, 0, &version, 2);
+    fb_field(b, 1, &header_type, 1);
+    fb_field_offset(b, 2, header);
+    fb_field(b, 3, &body_length, 8);
+    fb_finish(b, fb_end_table(b));
+
+    padding = (8 - b->size % 8) % 8;
+    prefix[0] = 0xFFFFFFFF;
+    prefix[1] = (uint32_t) (b->size + padding);
+    block->offset = writer->position;
+    block->metadata_length = (int32_t) (8 + b->size + padding);
+    block->padding = 0;
+    block->body_length = body_length;
+
+    if (fwrite(prefix, sizeof(prefix), 1, writer->out) != 1
+            || fwrite(b->data + b->capacity - b->size, 1, b->size, writer->out) != b->size
+            || fwrite(zeros, 1, padding, writer->out) != padding) {
+        writer->failed = 1;
+    }
+    for (i = 0; i < num_buffers; i++) {
+        size_t length = (size_t) lengths[i];
+        size_t pad = (ARROW_ALIGNMENT - length % ARROW_ALIGNMENT) % ARROW_ALIGNMENT;
+        if ((length > 0 && fwrite(buffers[i], 1, length, writer->out) != length)
+                || fwrite(zeros, 1, pad, writer->out) != pad) {
+            writer->failed = 1;
+        }
+    }
+    writer->position += block->metadata_length + body_length;
+    free(b->data);
+}
+
+/* Prepends a RecordBatch table of `length` rows with the given field nodes
+ * and buffers; buffer offsets are assigned back to back in the body. */
+size_t arrow_record_batch(struct flatbuffer *b, int64_t length, int num_nodes, const int64_t *lengths,
+        int num_buffers) {
+    int64_t nodes[2 * NUM_COLUMNS], buffers[4 * NUM_COLUMNS], offset = 0;
+    size_t node_vector, buffer_vector;
+    int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        nodes[2 * i] = length;
+        nodes[2 * i + 1] = 0;
+    }
+    for (i = 0; i < num_buffers; i++) {
+        buffers[2 * i] = offset;
+        buffers[2 * i + 1] = lengths[i];
+        offset += (lengths[i] + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+    }
+    buffer_vector = fb_vector(b, buffers, num_buffers, 16, 8);
+    node_vector = fb_vector(b, nodes, num_nodes, 16, 8);
+    fb_start_table(b);
+    fb_field(b, 0, &length, 8);
+    fb_field_offset(b, 1, node_vector);
+    fb_field_offset(b, 2, buffer_vector);
+    return fb_end_table(b);
+}
+
+/* Opens an Arrow IPC file (Feather V2): the magic and the schema message.
+ * Record batches follow as rows arrive; the dictionaries and the footer
+ * are written on close. */
+struct arrow_writer *arrow_open(const char *path) {
+    struct arrow_writer *writer;
+    struct flatbuffer b;
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return NULL;
+    }
+    writer = (struct arrow_writer*) calloc(1, sizeof(struct arrow_writer));
+    writer->out = out;
+    writer->failed = fwrite(ARROW_MAGIC "\0\0", 1, 8, out) != 8;
+    writer->position = 8;
+    writer->state = (int8_t*) malloc(ARROW_BATCH_ROWS * sizeof(int8_t));
+    writer->timestamp = (int64_t*) malloc(ARROW_BATCH_ROWS * sizeof(int64_t));
+    writer->geohash = (int32_t*) malloc(ARROW_BATCH_ROWS * sizeof(int32_t));
+    writer->values = (double*) malloc(ARROW_BATCH_ROWS * NUM_VALUE_COLUMNS * sizeof(double));
+
+    fb_init(&b);
+    arrow_write_message(writer, &b, ARROW_HEADER_SCHEMA, arrow_schema(&b), NULL, NULL, 0, &writer->schema_block);
+    return writer;
+}
+
+// writes the buffered rows as a record batch
+void arrow_write_batch(struct arrow_writer *writer) {
+    const void *buffers[2 * NUM_COLUMNS];
+    int64_t lengths[2 * NUM_COLUMNS];
+    int64_t n = writer->count;
+    struct flatbuffer b;
+    size_t batch;
+    int f, v = 0;
+
+    // no validity bitmaps (nothing is null), then the values of each field
+    for (f = 0; f < NUM_COLUMNS; f++) {
+        buffers[2 * f] = NULL;
+        lengths[2 * f] = 0;
+        if (f == COLUMN_STATE) {
+            buffers[2 * f + 1] = writer->state;
+            lengths[2 * f + 1] = n;
+        }
+        else if (f == COLUMN_TIMESTAMP) {
+            buffers[2 * f + 1] = writer->timestamp;
+            lengths[2 * f + 1] = n * 8;
+        }
+        else if (f == COLUMN_GEOHASH) {
+            buffers[2 * f + 1] = writer->geohash;
+            lengths[2 * f + 1] = n * 4;
+        }
+        else if (f == COLUMN_SNOW || f == COLUMN_LIGHTNING) {
+            buffers[2 * f + 1] = f == COLUMN_SNOW ? writer->snow : writer->lightning;
+            lengths[2 * f + 1] = (n + 7) / 8;
+        }
+        else {
+            buffers[2 * f + 1] = writer->values + (size_t) v++ * ARROW_BATCH_ROWS;
+            lengths[2 * f + 1] = n * 8;
+        }
+    }
+
+    if (writer->num_batches == writer->batches_capacity) {
+        writer->batches_capacity = writer->batches_capacity == 0 ? 16 : 2 * writer->batches_capacity;
+        writer->batches = realloc(writer->batches, writer->batches_capacity * sizeof(struct arrow_block));
+    }
+    fb_init(&b);
+    batch = arrow_record_batch(&b, n, NUM_COLUMNS, lengths, 2 * NUM_COLUMNS);
+    arrow_write_message(writer, &b, ARROW_HEADER_RECORD_BATCH, batch, buffers, lengths, 2 * NUM_COLUMNS,
+            &writer->batches[writer->num_batches++]);
+    writer->count = 0;
+    memset(writer->snow, 0, sizeof(writer->snow));
+    memset(writer->lightning, 0, sizeof(writer->lightning));
+}
+
+// adds a record's columns to the pending batch, writing the batch once full
+void arrow_append(struct arrow_writer *writer, int state_index, const struct record *rec) {
+    int i = writer->count++;
+    double *values = writer->values;
+    writer->state[i] = (int8_t) state_index;
+    writer->timestamp[i] = rec->timestamp;
+    writer->geohash[i] = (int32_t) intern_geohash(rec->geohash);
+    writer->snow[i / 8] |= (uint8_t) ((rec->snow != 0) << (i % 8));
+    writer->lightning[i / 8] |= (uint8_t) ((rec->lightning != 0) << (i % 8));
+    values[i] = rec->humidity;
+    values[ARROW_BATCH_ROWS + i] = rec->cloudcover;
+    values[2 * ARROW_BATCH_ROWS + i] = rec->pressure;
+    values[3 * ARROW_BATCH_ROWS + i] = rec->temperature;
+    if (writer->count == ARROW_BATCH_ROWS) {
+        arrow_write_batch(writer);
+    }
+}
+
+// writes a dictionary batch of strings (Utf8: int32 offsets, then the characters)
+void arrow_write_dictionary(struct arrow_writer *writer, int64_t id, const char *const *strings,
+        int count, struct arrow_block *block) {
+    int32_t *offsets = (int32_t*) malloc((count + 1) * sizeof(int32_t));
+    char *characters;
+    const void *buffers[3];
+    int64_t lengths[3];
+    struct flatbuffer b;
+    size_t batch;
+    int i;
+
+    offsets[0] = 0;
+    for (i = 0; i < count; i++) {
+        offsets[i + 1] = offsets[i] + (int32_t) strlen(strings[i]);
+    }
+    characters = (char*) malloc(offsets[count] + 1);
+    for (i = 0; i < count; i++) {
+        memcpy(characters + offsets[i], strings[i], offsets[i + 1] - offsets[i]);
+    }
+    buffers[0] = NULL;
+    lengths[0] = 0;
+    buffers[1] = offsets;
+    lengths[1] = (count + 1) * 4;
+    buffers[2] = characters;
+    lengths[2] = offsets[count];
+
+    fb_init(&b);
+    batch = arrow_record_batch(&b, count, 1, lengths, 3);
+    fb_start_table(&b);
+    fb_field(&b, 0, &id, 8);
+    fb_field_offset(&b, 1, batch);
+    arrow_write_message(writer, &b, ARROW_HEADER_DICTIONARY_BATCH, fb_end_table(&b), buffers, lengths, 3, block);
+    free(offsets);
+    free(characters);
+}
+
+/* Writes the last batch, the state and geohash dictionaries (the states'
+ * codes in `states` order and the interned geohashes), the end-of-stream
+ * marker and the footer, and closes the file. Returns 0 on success. */
+int arrow_close(struct arrow_writer *writer, struct climate_info *states[]) {
+    const char *codes[NUM_STATES];
+    const char **names = (const char**) malloc((geohashes.count + 1) * sizeof(char*));
+    struct arrow_block dictionaries[2];
+    uint32_t end_of_stream[2] = {0xFFFFFFFF, 0};
+    struct flatbuffer b;
+    size_t schema, dictionary_vector, batch_vector;
+    int16_t version = ARROW_METADATA_V5;
+    int32_t footer_length;
+    int num_states, i, failed;
+
+    if (writer->count > 0) {
+        arrow_write_batch(writer);
+    }
+    for (num_states = 0; num_states < NUM_STATES && states[num_states] != NULL; num_states++) {
+        codes[num_states] = states[num_states]->code;
+    }
+    for (i = 0; i < (int) geohashes.count; i++) {
+        names[i] = geohashes.names[i];
+    }
+    arrow_write_dictionary(writer, COLUMN_STATE, codes, num_states, &dictionaries[0]);
+    arrow_write_dictionary(writer, COLUMN_GEOHASH, names, (int) geohashes.count, &dictionaries[1]);
+
+    fb_init(&b);
+    schema = arrow_schema(&b);
+    batch_vector = fb_vector(&b, writer->batches, writer->num_batches, sizeof(struct arrow_block), 8);
+    dictionary_vector = fb_vector(&b, dictionaries, 2, sizeof(struct arrow_block), 8);
+    fb_start_table(&b);
+    fb_field(&b, 0, &version, 2);
+    fb_field_offset(&b, 1, schema);
+    fb_field_offset(&b, 2, dictionary_vector);
+    fb_field_offset(&b, 3, batch_vector);
+    fb_finish(&b, fb_end_table(&b));
+    footer_length = (int32_t) b.size;
+
+    failed = writer->failed
+        || fwrite(end_of_stream, sizeof(end_of_stream), 1, writer->out) != 1
+        || fwrite(b.data + b.capacity - b.size, 1, b.size, writer->out) != b.size
+        || fwrite(&footer_length, 4, 1, writer->out) != 1
+        || fwrite(ARROW_MAGIC, 1, 6, writer->out) != 6;
+    failed |= fclose(writer->out) != 0;
+    free(b.data);
+    free(names);
+    free(writer->state);
+    free(writer->timestamp);
+    free(writer->geohash);
+    free(writer->values);
+    free(writer->batches);
+    free(writer);
+    return failed ? -1 : 0;
+}
+
+// appends raw bytes to a Thrift buffer
+void thrift_bytes(struct thrift_buffer *t, const void *bytes, size_t n) {
+    if (t->size + n > t->capacity) {
+        t->capacity = t->capacity == 0 ? 1024 : t->capacity;
+        while (t->size + n > t->capacity) {
+            t->capacity *= 2;
+        }
+        t->data = (uint8_t*) realloc(t->data, t->capacity);
+    }
+    if (n > 0) {
+        memcpy(t->data + t->size, bytes, n);
+    }
+    t->size += n;
+}
+
+void thrift_varint(struct thrift_buffer *t, uint64_t value) {
+    uint8_t bytes[10];
+    int n = 0;
+    while (value >= 0x80) {
+        bytes[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (uint8_t) value;
+    thrift_bytes(t, bytes, n);
+}
+
+// zigzag varint of the compact protocol's integers
+void thrift_int(struct thrift_buffer *t, int64_t value) {
+    thrift_varint(t, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+// field header: the id as a delta from the previous field of the struct when it fits in 4 bits
+void thrift_field(struct thrift_buffer *t, int id, int type) {
+    int delta = id - t->last_id[t->depth];
+    uint8_t header = (uint8_t) type;
+    if (delta > 0 && delta <= 15) {
+        header |= (uint8_t) (delta << 4);
+        thrift_bytes(t, &header, 1);
+    }
+    else {
+        thrift_bytes(t, &header, 1);
+        thrift_int(t, id);
+    }
+    t->last_id[t->depth] = (int16_t) id;
+}
+
+void thrift_i32(struct thrift_buffer *t, int id, int32_t value) {
+    thrift_field(t, id, THRIFT_I32);
+    thrift_int(t, value);
+}
+
+void thrift_i64(struct thrift_buffer *t, int id, int64_t value) {
+    thrift_field(t, id, THRIFT_I64);
+    thrift_int(t, value);
+}
+
+void thrift_bool(struct thrift_buffer *t, int id, int value) {
+    thrift_field(t, id, value ? THRIFT_TRUE : THRIFT_FALSE);
+}
+
+void thrift_binary(struct thrift_buffer *t, int id, const void *bytes, size_t n) {
+    thrift_field(t, id, THRIFT_BINARY);
+    thrift_varint(t, n);
+    thrift_bytes(t, bytes, n);
+}
+
+// opens a nested struct, as field `id` or, with id 0, as a list element
+void thrift_struct(struct thrift_buffer *t, int id) {
+    if (id != 0) {
+        thrift_field(t, id, THRIFT_STRUCT);
+    }
+    t->last_id[++t->depth] = 0;
+}
+
+// closes a struct with its stop byte (the outermost struct has no enclosing one)
+void thrift_end(struct thrift_buffer *t) {
+    uint8_t stop = 0;
+    thrift_bytes(t, &stop, 1);
+    if (t->depth > 0) {
+        t->depth--;
+    }
+}
+
+void thrift_list(struct thrift_buffer *t, int id, int element_type, int size) {
+    uint8_t header;
+    thrift_field(t, id, THRIFT_LIST);
+    if (size < 15) {
+        header = (uint8_t) (size << 4 | element_type);
+        thrift_bytes(t, &header, 1);
+    }
+    else {
+        header = (uint8_t) (0xF0 | element_type);
+        thrift_bytes(t, &header, 1);
+        thrift_varint(t, size);
+    }
+}
+
+// Snappy literal element (tag 00), with the length-1 in the tag or in 1-4 extra bytes
+uint8_t *snappy_literal(uint8_t *out, const uint8_t *bytes, size_t length) {
+    size_t n = length - 1;
+    if (n < 60) {
+        *out++ = (uint8_t) (n << 2);
+    }
+    else {
+        int extra = n < (1 << 8) ? 1 : n < (1 << 16) ? 2 : n < (1 << 24) ? 3 : 4, i;
+        *out++ = (uint8_t) ((59 + extra) << 2);
+        for (i = 0; i < extra; i++) {
+            *out++ = (uint8_t) (n >> (8 * i));
+        }
+    }
+    memcpy(out, bytes, length);
+    return out + length;
+}
+
+// Snappy copy elements: 4-11 bytes within 2 KB (tag 01), else up to 64 bytes (tag 10)
+uint8_t *snappy_copy(uint8_t *out, size_t offset, size_t length) {
+    while (length >= 68) {
+        *out++ = (uint8_t) (2 | (63 << 2));
+        *out++ = (uint8_t) offset;
+        *out++ = (uint8_t) (offset >> 8);
+        length -= 64;
+    }
+    if (length > 64) {
+        *out++ = (uint8_t) (2 | (59 << 2));
+        *out++ = (uint8_t) offset;
+        *out++ = (uint8_t) (offset >> 8);
+        length -= 60;
+    }
+    if (length >= 4 && length < 12 && offset < 2048) {
+        *out++ = (uint8_t) (1 | ((length - 4) << 2) | ((offset >> 8) << 5));
+        *out++ = (uint8_t) offset;
+    }
+    else {
+        *out++ = (uint8_t) (2 | ((length - 1) << 2));
+        *out++ = (uint8_t) offset;
+        *out++ = (uint8_t) (offset >> 8);
+    }
+    return out;
+}
+
+// worst-case size of snappy_compress output
+size_t snappy_bound(size_t n) {
+    return 32 + n + n / 6;
+}
+
+/* Compresses in the Snappy format (Parquet's SNAPPY codec): the length as
+ * a varint, then literals and back-references found through a hash table
+ * of 4-byte sequences, within independent 64 KB fragments so every offset
+ * fits in 16 bits. Skips ahead faster the longer no match is found.
+ * Returns the compressed size. */
+size_t snappy_compress(const uint8_t *in, size_t n, uint8_t *out) {
+    int32_t *table = (int32_t*) malloc(sizeof(int32_t) << SNAPPY_HASH_BITS);
+    uint8_t *op = out;
+    size_t start, length = n;
+
+    while (length >= 0x80) {
+        *op++ = (uint8_t) (length | 0x80);
+        length >>= 7;
+    }
+    *op++ = (uint8_t) length;
+
+    for (start = 0; start < n; start += SNAPPY_FRAGMENT) {
+        size_t end = start + SNAPPY_FRAGMENT < n ? start + SNAPPY_FRAGMENT : n;
+        size_t ip = start, literal = start;
+        memset(table, 0xff, sizeof(int32_t) << SNAPPY_HASH_BITS);
+        while (ip + 4 <= end) {
+            uint32_t sequence, candidate_sequence;
+            memcpy(&sequence, in + ip, 4);
+            uint32_t hash = (sequence * 0x1e35a7bdU) >> (32 - SNAPPY_HASH_BITS);
+            int32_t candidate = table[hash];
+            table[hash] = (int32_t) (ip - start);
+            if (candidate >= 0) {
+                memcpy(&candidate_sequence, in + start + candidate, 4);
+            }
+            if (candidate < 0 || candidate_sequence != sequence) {
+                ip += 1 + ((ip - literal) >> 5);
+                continue;
+            }
+            size_t match = start + candidate, matched = 4;
+            while (ip + matched < end && in[match + matched] == in[ip + matched]) {
+                matched++;
+            }
+            if (ip > literal) {
+                op = snappy_literal(op, in + literal, ip - literal);
+            }
+            op = snappy_copy(op, ip - match, matched);
+            ip += matched;
+            literal = ip;
+        }
+        if (end > literal) {
+            op = snappy_literal(op, in + literal, end - literal);
+        }
+    }
+    free(table);
+    return (size_t) (op - out);
+}
+
+/* Encodes values of bit_width bits with Parquet's RLE/bit-packed hybrid:
+ * runs of 8 or more equal values as RLE runs, everything else bit-packed in
+ * groups of 8 (the last group zero-padded). out needs n * 5 + 16 bytes.
+ * Returns the encoded size. */
+size_t encode_hybrid(const uint32_t *values, int n, int bit_width, uint8_t *out) {
+    struct thrift_buffer t = {out, 0, (size_t) n * 5 + 16, {0}, 0};
+    int i = 0, literal = 0, value_bytes = (bit_width + 7) / 8;
+
+    while (i <= n) {
+        int run = 1;
+        while (i < n && i + run < n && values[i + run] == values[i]) {
+            run++;
+        }
+        if (i < n && run >= 8 && (i - literal) % 8 != 0) {
+            // extend the literals up to a whole group, the run may still be long enough
+            i += 8 - (i - literal) % 8;
+            continue;
+        }
+        if (i == n || run >= 8) {
+            // bit-pack the pending literals, then the run
+            int groups = (i - literal + 7) / 8, v, b;
+            if (groups > 0) {
+                uint64_t buffer = 0;
+                int bits = 0;
+                thrift_varint(&t, (uint64_t) groups << 1 | 1);
+                for (v = literal; v < literal + groups * 8; v++) {
+                    buffer |= (uint64_t) (v < i ? values[v] : 0) << bits;
+                    bits += bit_width;
+                    while (bits >= 8) {
+                        out[t.size++] = (uint8_t) buffer;
+                        buffer >>= 8;
+                        bits -= 8;
+                    }
+                }
+            }
+            if (i == n) {
+                break;
+            }
+            thrift_varint(&t, (uint64_t) run << 1);
+            for (b = 0; b < value_bytes; b++) {
+                out[t.size++] = (uint8_t) (values[i] >> (8 * b));
+            }
+            i += run;
+            literal = i;
+        }
+        else {
+            i += run;
+        }
+    }
+    return t.size;
+}
+
+/* Builds the dictionary of a column of 64-bit keys: the distinct keys in
+ * order of appearance, and each row's index into them. Returns the number
+ * of distinct keys. */
+int build_dictionary(const uint64_t *keys, int n, uint64_t *dictionary, uint32_t *indices) {
+    size_t capacity = 16, i;
+    int32_t *slots;
+    int count = 0, r;
+    while (capacity < 2 * (size_t) n) {
+        capacity *= 2;
+    }
+    slots = (int32_t*) malloc(capacity * sizeof(int32_t));
+    memset(slots, 0xff, capacity * sizeof(int32_t));
+    for (r = 0; r < n; r++) {
+        uint64_t h = keys[r] * 0x9E3779B97F4A7C15ULL;
+        for (i = (h >> 32) & (capacity - 1); slots[i] >= 0 && dictionary[slots[i]] != keys[r];
+                i = (i + 1) & (capacity - 1)) {
+        }
+        if (slots[i] < 0) {
+            slots[i] = count;
+            dictionary[count++] = keys[r];
+        }
+        indices[r] = (uint32_t) slots[i];
+    }
+    free(slots);
+    return count;
+}
+
+// appends a column's value for a key in PLAIN encoding (strings with their length)
+void parquet_plain_value(struct thrift_buffer *page, int column, uint64_t key) {
+    if (column == COLUMN_STATE) {
+        uint32_t length = 2;
+        char code[2] = {(char) (key >> 8), (char) key};
+        thrift_bytes(page, &length, 4);
+        thrift_bytes(page, code, 2);
+    }
+    else if (column == COLUMN_GEOHASH) {
+        uint32_t length = (uint32_t) strlen(geohashes.names[key]);
+        thrift_bytes(page, &length, 4);
+        thrift_bytes(page, geohashes.names[key], length);
+    }
+    else {
+        thrift_bytes(page, &key, 8);
+    }
+}
+
+// sets a column chunk's min/max statistic of a key (little-endian bytes, strings as is)
+void parquet_statistic(struct parquet_chunk *chunk, int which, int column, uint64_t key) {
+    uint8_t *value = which == 0 ? chunk->min : chunk->max;
+    int *length = which == 0 ? &chunk->min_length : &chunk->max_length;
+    if (column == COLUMN_STATE) {
+        value[0] = (uint8_t) (key >> 8);
+        value[1] = (uint8_t) key;
+        *length = 2;
+    }
+    else if (column == COLUMN_GEOHASH) {
+        *length = (int) strlen(geohashes.names[key]);
+        memcpy(value, geohashes.names[key], *length);
+    }
+    else {
+        memcpy(value, &key, 8);
+        *length = 8;
+    }
+}
+
+// compares two keys of a column in the column's sort order
+int parquet_compare(int column, uint64_t a, uint64_t b) {
+    if (column == COLUMN_GEOHASH) {
+        return strcmp(geohashes.names[a], geohashes.names[b]);
+    }
+    if (column == COLUMN_TIMESTAMP) {
+        return ((int64_t) a > (int64_t) b) - ((int64_t) a < (int64_t) b);
+    }
+    if (column != COLUMN_STATE) {
+        double x, y;
+        memcpy(&x, &a, 8);
+        memcpy(&y, &b, 8);
+        return (x > y) - (x < y);
+    }
+    return (a > b) - (a < b);
+}
+
+/* Writes a page (compressed with the writer's codec) after its header and
+ * adds its sizes to the column chunk. */
+void parquet_write_page(struct parquet_writer *writer, struct parquet_chunk *chunk, int dictionary,
+        const uint8_t *data, size_t size, int num_values, int encoding) {
+    struct thrift_buffer header = {0};
+    uint8_t *compressed = NULL;
+    const uint8_t *body = data;
+    size_t body_size = size;
+
+    if (writer->codec == PARQUET_CODEC_SNAPPY) {
+        compressed = (uint8_t*) malloc(snappy_bound(size));
+        body_size = snappy_compress(data, size, compressed);
+        body = compressed;
+    }
+    thrift_i32(&header, 1, dictionary ? PARQUET_DICTIONARY_PAGE : PARQUET_DATA_PAGE);
+    thrift_i32(&header, 2, (int32_t) size);
+    thrift_i32(&header, 3, (int32_t) body_size);
+    thrift_struct(&header, dictionary ? 7 : 5);
+    thrift_i32(&header, 1, num_values);
+    thrift_i32(&header, 2, encoding);
+    if (!dictionary) {
+        thrift_i32(&header, 3, PARQUET_RLE);
+        thrift_i32(&header, 4, PARQUET_RLE);
+    }
+    thrift_end(&header);
+    thrift_end(&header);
+
+    if (fwrite(header.data, 1, header.size, writer->out) != header.size
+            || fwrite(body, 1, body_size, writer->out) != body_size) {
+        writer->failed = 1;
+    }
+    writer->position += (int64_t) (header.size + body_size);
+    chunk->uncompressed_size += (int64_t) (header.size + size);
+    chunk->compressed_size += (int64_t) (header.size + body_size);
+    free(header.data);
+    free(compressed);
+}
+
+/* Writes one column chunk of the pending row group. Snow and lightning are
+ * RLE-encoded booleans; every other column is dictionary-encoded when that
+ * is smaller than PLAIN (always for state and geohash). */
+void parquet_write_chunk(struct parquet_writer *writer, int column, struct parquet_chunk *chunk) {
+    int n = writer->count, r, distinct, bit_width = 1;
+    uint64_t *keys = (uint64_t*) malloc(n * sizeof(uint64_t));
+    uint64_t *dictionary = (uint64_t*) malloc(n * sizeof(uint64_t));
+    uint32_t *indices = (uint32_t*) malloc(n * sizeof(uint32_t));
+    uint8_t *encoded = (uint8_t*) malloc((size_t) n * 5 + 16);
+    struct thrift_buffer page = {0};
+    int min = 0, max = 0;
+
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->num_values = n;
+    chunk->dictionary_page_offset = -1;
+
+    if (column == COLUMN_SNOW || column == COLUMN_LIGHTNING) {
+        const uint8_t *flags = column == COLUMN_SNOW ? writer->snow : writer->lightning;
+        uint32_t length, any = 0, all = 1;
+        for (r = 0; r < n; r++) {
+            indices[r] = flags[r];
+            any |= flags[r];
+            all &= flags[r];
+        }
+        // RLE booleans carry their length first
+        length = (uint32_t) encode_hybrid(indices, n, 1, encoded);
+        thrift_bytes(&page, &length, 4);
+        thrift_bytes(&page, encoded, length);
+        chunk->min[0] = (uint8_t) all;
+        chunk->max[0] = (uint8_t) any;
+        chunk->min_length = chunk->max_length = 1;
+        chunk->encodings[chunk->num_encodings++] = PARQUET_RLE;
+        chunk->data_page_offset = writer->position;
+        parquet_write_page(writer, chunk, 0, page.data, page.size, n, PARQUET_RLE);
+    }
+    else {
+        size_t value_size = column == COLUMN_STATE ? 6 : column == COLUMN_GEOHASH ? 16 : 8;
+        for (r = 0; r < n; r++) {
+            if (column == COLUMN_STATE || column == COLUMN_GEOHASH) {
+                keys[r] = column == COLUMN_STATE ? writer->state[r] : writer->geohash[r];
+            }
+            else if (column == COLUMN_TIMESTAMP) {
+                keys[r] = (uint64_t) writer->timestamp[r] * 1000;
+            }
+            else {
+                int v = column == COLUMN_HUMIDITY ? 0 : column == COLUMN_CLOUDCOVER ? 1
+                    : column == COLUMN_PRESSURE ? 2 : 3;
+                memcpy(&keys[r], &writer->values[(size_t) v * PARQUET_ROW_GROUP_ROWS + r], 8);
+            }
+        }
+        distinct = build_dictionary(keys, n, dictionary, indices);
+        while ((1 << bit_width) < distinct) {
+            bit_width++;
+        }
+        for (r = 1; r < distinct; r++) {
+            min = parquet_compare(column, dictionary[r], dictionary[min]) < 0 ? r : min;
+            max = parquet_compare(column, dictionary[r], dictionary[max]) > 0 ? r : max;
+        }
+        parquet_statistic(chunk, 0, column, dictionary[min]);
+        parquet_statistic(chunk, 1, column, dictionary[max]);
+
+        if (column == COLUMN_STATE || column == COLUMN_GEOHASH
+                || distinct * value_size + (size_t) n * bit_width / 8 < (size_t) n * value_size) {
+            // dictionary page of the distinct values, then their indices
+            for (r = 0; r < distinct; r++) {
+                parquet_plain_value(&page, column, dictionary[r]);
+            }
+            chunk->dictionary_page_offset = writer->position;
+            parquet_write_page(writer, chunk, 1, page.data, page.size, distinct, PARQUET_PLAIN);
+            page.size = 0;
+            page.data[page.size++] = (uint8_t) bit_width;
+            thrift_bytes(&page, encoded, encode_hybrid(indices, n, bit_width, encoded));
+            chunk->encodings[chunk->num_encodings++] = PARQUET_PLAIN;
+            chunk->encodings[chunk->num_encodings++] = PARQUET_RLE_DICTIONARY;
+            chunk->data_page_offset = writer->position;
+            parquet_write_page(writer, chunk, 0, page.data, page.size, n, PARQUET_RLE_DICTIONARY);
+        }
+        else {
+            for (r = 0; r < n; r++) {
+                parquet_plain_value(&page, column, keys[r]);
+            }
+            chunk->encodings[chunk->num_encodings++] = PARQUET_PLAIN;
+            chunk->data_page_offset = writer->position;
+            parquet_write_page(writer, chunk, 0, page.data, page.size, n, PARQUET_PLAIN);
+        }
+        chunk->encodings[chunk->num_encodings++] = PARQUET_RLE;
+    }
+    free(page.data);
+    free(keys);
+    free(dictionary);
+    free(indices);
+    free(encoded);
+}
+
+// writes the buffered rows as a row group, one column chunk (and page) per column
+void parquet_write_row_group(struct parquet_writer *writer) {
+    struct parquet_row_group *group;
+    int c;
+    if (writer->num_row_groups == writer->row_groups_capacity) {
+        writer->row_groups_capacity = writer->row_groups_capacity == 0 ? 8 : 2 * writer->row_groups_capacity;
+        writer->row_groups = realloc(writer->row_groups,
+                writer->row_groups_capacity * sizeof(struct parquet_row_group));
+    }
+    group = &writer->row_groups[writer->num_row_groups++];
+    group->num_rows = writer->count;
+    group->file_offset = writer->position;
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        parquet_write_chunk(writer, c, &group->chunks[c]);
+    }
+    writer->num_rows += writer->count;
+    writer->count = 0;
+}
+
+/* Opens a Parquet file for the parsed columns. Rows are written in row
+ * groups of PARQUET_ROW_GROUP_ROWS as they arrive; the metadata footer is
+ * written on close. */
+struct parquet_writer *parquet_open(const char *path, int codec) {
+    struct parquet_writer *writer;
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return NULL;
+    }
+    writer = (struct parquet_writer*) calloc(1, sizeof(struct parquet_writer));
+    writer->out = out;
+    writer->codec = codec;
+    writer->failed = fwrite(PARQUET_MAGIC, 1, 4, out) != 4;
+    writer->position = 4;
+    writer->state = (uint16_t*) malloc(PARQUET_ROW_GROUP_ROWS * sizeof(uint16_t));
+    writer->timestamp = (int64_t*) malloc(PARQUET_ROW_GROUP_ROWS * sizeof(int64_t));
+    writer->geohash = (uint32_t*) malloc(PARQUET_ROW_GROUP_ROWS * sizeof(uint32_t));
+    writer->snow = (uint8_t*) malloc(PARQUET_ROW_GROUP_ROWS);
+    writer->lightning = (uint8_t*) malloc(PARQUET_ROW_GROUP_ROWS);
+    writer->values = (double*) malloc(PARQUET_ROW_GROUP_ROWS * NUM_VALUE_COLUMNS * sizeof(double));
+    return writer;
+}
+
+// adds a record's columns to the pending row group, writing it once full
+void parquet_append(struct parquet_writer *writer, const struct record *rec) {
+    int i = writer->count++;
+    writer->state[i] = (uint16_t) ((unsigned char) rec->code[0] << 8 | (unsigned char) rec->code[1]);
+    writer->timestamp[i] = rec->timestamp;
+    writer->geohash[i] = intern_geohash(rec->geohash);
+    writer->snow[i] = rec->snow != 0;
+    writer->lightning[i] = rec->lightning != 0;
+    writer->values[i] = rec->humidity;
+    writer->values[PARQUET_ROW_GROUP_ROWS + i] = rec->cloudcover;
+    writer->values[2 * PARQUET_ROW_GROUP_ROWS + i] = rec->pressure;
+    writer->values[3 * PARQUET_ROW_GROUP_ROWS + i] = rec->temperature;
+    if (writer->count == PARQUET_ROW_GROUP_ROWS) {
+        parquet_write_row_group(writer);
+    }
+}
+
+// writes the FileMetaData struct: schema, row groups with their column chunks, column orders
+void parquet_metadata(struct parquet_writer *writer, struct thrift_buffer *t) {
+    static const int types[NUM_COLUMNS] = {PARQUET_BYTE_ARRAY, PARQUET_INT64, PARQUET_BYTE_ARRAY,
+        PARQUET_DOUBLE, PARQUET_BOOLEAN, PARQUET_DOUBLE, PARQUET_BOOLEAN, PARQUET_DOUBLE, PARQUET_DOUBLE};
+    int c, g, e;
+
+    thrift_i32(t, 1, 2);
+    thrift_list(t, 2, THRIFT_STRUCT, NUM_COLUMNS + 1);
+    thrift_struct(t, 0);
+    thrift_binary(t, 4, "schema", 6);
+    thrift_i32(t, 5, NUM_COLUMNS);
+    thrift_end(t);
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        thrift_struct(t, 0);
+        thrift_i32(t, 1, types[c]);
+        thrift_i32(t, 3, PARQUET_REQUIRED);
+        thrift_binary(t, 4, column_names[c], strlen(column_names[c]));
+        if (types[c] == PARQUET_BYTE_ARRAY) {
+            thrift_i32(t, 6, PARQUET_CONVERTED_UTF8);
+            thrift_struct(t, 10);
+            thrift_struct(t, 1);
+            thrift_end(t);
+            thrift_end(t);
+        }
+        else if (c == COLUMN_TIMESTAMP) {
+            // TIMESTAMP(isAdjustedToUTC = true, MILLIS)
+            thrift_i32(t, 6, PARQUET_CONVERTED_TIMESTAMP_MILLIS);
+            thrift_struct(t, 10);
+            thrift_struct(t, 8);
+            thrift_bool(t, 1, 1);
+            thrift_struct(t, 2);
+            thrift_struct(t, 1);
+            thrift_end(t);
+            thrift_end(t);
+            thrift_end(t);
+            thrift_end(t);
+        }
+        thrift_end(t);
+    }
+    thrift_i64(t, 3, writer->num_rows);
+
+    thrift_list(t, 4, THRIFT_STRUCT, writer->num_row_groups);
+    for (g = 0; g < writer->num_row_groups; g++) {
+        struct parquet_row_group *group = &writer->row_groups[g];
+        int64_t total_uncompressed = 0, total_compressed = 0;
+        thrift_struct(t, 0);
+        thrift_list(t, 1, THRIFT_STRUCT, NUM_COLUMNS);
+        for (c = 0; c < NUM_COLUMNS; c++) {
+            struct parquet_chunk *chunk = &group->chunks[c];
+            int64_t first_page = chunk->dictionary_page_offset >= 0 ? chunk->dictionary_page_offset
+                : chunk->data_page_offset;
+            total_uncompressed += chunk->uncompressed_size;
+            total_compressed += chunk->compressed_size;
+            thrift_struct(t, 0);
+            thrift_i64(t, 2, first_page);
+            thrift_struct(t, 3);
+            thrift_i32(t, 1, types[c]);
+            thrift_list(t, 2, THRIFT_I32, chunk->num_encodings);
+            for (e = 0; e < chunk->num_encodings; e++) {
+                thrift_int(t, chunk->encodings[e]);
+            }
+            thrift_list(t, 3, THRIFT_BINARY, 1);
+            thrift_varint(t, strlen(column_names[c]));
+            thrift_bytes(t, column_names[c], strlen(column_names[c]));
+            thrift_i32(t, 4, writer->codec);
+            thrift_i64(t, 5, chunk->num_values);
+            thrift_i64(t, 6, chunk->uncompressed_size);
+            thrift_i64(t, 7, chunk->compressed_size);
+            thrift_i64(t, 9, chunk->data_page_offset);
+            if (chunk->dictionary_page_offset >= 0) {
+                thrift_i64(t, 11, chunk->dictionary_page_offset);
+            }
+            thrift_struct(t, 12);
+            thrift_i64(t, 3, 0);
+            thrift_binary(t, 5, chunk->max, chunk->max_length);
+            thrift_binary(t, 6, chunk->min, chunk->min_length);
+            thrift_end(t);
+            thrift_end(t);
+            thrift_end(t);
+        }
+        thrift_i64(t, 2, total_uncompressed);
+        thrift_i64(t, 3, group->num_rows);
+        thrift_i64(t, 5, group->file_offset);
+        thrift_i64(t, 6, total_compressed);
+        thrift_end(t);
+    }
+
+    thrift_binary(t, 6, "climate", 7);
+    // TYPE_ORDER for every column, so readers can use the min/max statistics
+    thrift_list(t, 7, THRIFT_STRUCT, NUM_COLUMNS);
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        thrift_struct(t, 0);
+        thrift_struct(t, 1);
+        thrift_end(t);
+        thrift_end(t);
+    }
+    thrift_end(t);
+}
+
+/* Writes the last row group and the footer (FileMetaData in the Thrift
+ * compact protocol, its length and the magic) and closes the file.
+ * Returns 0 on success. */
+int parquet_close(struct parquet_writer *writer) {
+    struct thrift_buffer footer = {0};
+    uint32_t footer_length;
+    int failed;
+
+    if (writer->count > 0) {
+        parquet_write_row_group(writer);
+    }
+    parquet_metadata(writer, &footer);
+    footer_length = (uint32_t) footer.size;
+    failed = writer->failed
+        || fwrite(footer.data, 1, footer.size, writer->out) != footer.size
+        || fwrite(&footer_length, 4, 1, writer->out) != 1
+        || fwrite(PARQUET_MAGIC, 1, 4, writer->out) != 4;
+    failed |= fclose(writer->out) != 0;
+    free(footer.data);
+    free(writer->state);
+    free(writer->timestamp);
+    free(writer->geohash);
+    free(writer->snow);
+    free(writer->lightning);
+    free(writer->values);
+    free(writer->row_groups);
+    free(writer);
+    return failed ? -1 : 0;
+}
+
+// fills in a store entry from a parsed record
+void lsm_entry_from_record(struct lsm_entry *entry, const struct record *rec, uint64_t sequence) {
+    memset(entry, 0, sizeof(*entry));
+    entry->timestamp = rec->timestamp;
+    entry->sequence = sequence;
+    memcpy(entry->code, rec->code, 2);
+    memcpy(entry->geohash, rec->geohash, GEOHASH_LENGTH);
+    entry->snow = rec->snow != 0;
+    entry->lightning = rec->lightning != 0;
+    entry->humidity = rec->humidity;
+    entry->cloudcover = rec->cloudcover;
+    entry->pressure = rec->pressure;
+    entry->temperature = rec->temperature;
+}
+
+void record_from_lsm_entry(struct record *rec, const struct lsm_entry *entry) {
+    rec->code[0] = entry->code[0];
+    rec->code[1] = entry->code[1];
+    rec->code[2] = '\0';
+    rec->timestamp = (long) entry->timestamp;
+    memcpy(rec->geohash, entry->geohash, GEOHASH_LENGTH);
+    rec->geohash[GEOHASH_LENGTH] = '\0';
+    rec->snow = entry->snow;
+    rec->lightning = entry->lightning;
+    rec->humidity = entry->humidity;
+    rec->cloudcover = entry->cloudcover;
+    rec->pressure = entry->pressure;
+    rec->temperature = entry->temperature;
+}
+
+// orders entries by timestamp, state, geohash and then arrival
+int compare_lsm_entries(const void *a, const void *b) {
+    const struct lsm_entry *x = (const struct lsm_entry*) a;
+    const struct lsm_entry *y = (const struct lsm_entry*) b;
+    int c;
+    if (x->timestamp != y->timestamp) {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    if ((c = memcmp(x->code, y->code, 2)) != 0 || (c = memcmp(x->geohash, y->geohash, GEOHASH_LENGTH)) != 0) {
+        return c;
+    }
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+// bit of a state in a segment's state mask (the last bit for unknown codes)
+uint64_t lsm_state_bit(const char code[2]) {
+    char name[3] = {code[0], code[1], '\0'};
+    int slot = state_slot(name);
+    return 1ULL << (slot < 0 ? 63 : slot);
+}
+
+void lsm_path(const struct lsm_store *store, const char *name, uint32_t id, char *path) {
+    if (id == 0) {
+        snprintf(path, PATH_MAX, "%s/%s", store->dir, name);
+    }
+    else {
+        snprintf(path, PATH_MAX, "%s/segment-%06u.%s", store->dir, id, name);
+    }
+}
+
+/* Rewrites the manifest (a "rollups ID" line naming the live rollup files,
+ * if any, then the live segments, one "ID LEVEL" line each) through a
+ * temporary file, so a crash leaves either the old or the new list. Called
+ * with the store locked. Returns 0 on success. */
+int lsm_write_manifest(struct lsm_store *store) {
+    char path[PATH_MAX], temporary[PATH_MAX];
+    FILE *file;
+    int i, failed;
+    lsm_path(store, "MANIFEST", 0, path);
+    lsm_path(store, "MANIFEST.tmp", 0, temporary);
+    file = fopen(temporary, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    if (store->rollups != 0) {
+        fprintf(file, "rollups %u\n", store->rollups);
+    }
+    for (i = 0; i < store->num_segments; i++) {
+        fprintf(file, "%u %u\n", store->segments[i].id, store->segments[i].header.level);
+    }
+    failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    return failed || rename(temporary, path) != 0 ? -1 : 0;
+}
+
+// adds a segment to the store's list (kept in ID order, oldest first)
+void lsm_add_segment(struct lsm_store *store, uint32_t id, const struct lsm_segment_header *header) {
+    int i;
+    if (store->num_segments == store->segments_capacity) {
+        store->segments_capacity = store->segments_capacity == 0 ? 16 : 2 * store->segments_capacity;
+        store->segments = realloc(store->segments, store->segments_capacity * sizeof(struct lsm_segment));
+    }
+    for (i = store->num_segments; i > 0 && store->segments[i - 1].id > id; i--) {
+        store->segments[i] = store->segments[i - 1];
+    }
+    store->segments[i].id = id;
+    store->segments[i].header = *header;
+    store->segments[i].merging = 0;
+    store->num_segments++;
+}
+
+/* Positions a cursor on the first entry of a segment at or after `from`,
+ * found by binary search on the sorted timestamps. Returns 0 on success. */
+int lsm_cursor_open(struct lsm_cursor *cursor, const char *path, long from) {
+    struct lsm_segment_header header;
+    uint64_t low = 0, high;
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->file = fopen(path, "rb");
+    if (cursor->file == NULL || fread(&header, sizeof(header), 1, cursor->file) != 1
+            || memcmp(header.magic, LSM_MAGIC, 8) != 0 || header.version != LSM_VERSION) {
+        return -1;
+    }
+    high = header.num_entries;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        int64_t timestamp;
+        if (fseek(cursor->file, (long) (sizeof(header) + middle * sizeof(struct lsm_entry)), SEEK_SET) != 0
+                || fread(&timestamp, sizeof(timestamp), 1, cursor->file) != 1) {
+            return -1;
+        }
+        if (timestamp < from) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    cursor->remaining = header.num_entries - low;
+    cursor->entries = (struct lsm_entry*) malloc(LSM_READ_ENTRIES * sizeof(struct lsm_entry));
+    return fseek(cursor->file, (long) (sizeof(header) + low * sizeof(struct lsm_entry)), SEEK_SET);
+}
+
+// the cursor's current entry, reading the next chunk of its segment when needed; NULL at the end
+const struct lsm_entry *lsm_cursor_peek(struct lsm_cursor *cursor) {
+    if (cursor->next == cursor->count && cursor->file != NULL && cursor->remaining > 0) {
+        size_t n = cursor->remaining < LSM_READ_ENTRIES ? (size_t) cursor->remaining : LSM_READ_ENTRIES;
+        cursor->count = (int) fread(cursor->entries, sizeof(struct lsm_entry), n, cursor->file);
+        cursor->failed |= cursor->count != (int) n;
+        cursor->remaining = cursor->count == (int) n ? cursor->remaining - n : 0;
+        cursor->next = 0;
+    }
+    return cursor->next < cursor->count ? &cursor->entries[cursor->next] : NULL;
+}
+
+void lsm_cursor_close(struct lsm_cursor *cursor) {
+    if (cursor->file != NULL) {
+        fclose(cursor->file);
+        free(cursor->entries);
+    }
+}
+
+/* Index of the cursor holding the smallest entry, or -1 when all are
+ * exhausted. A linear scan: there are only a few segments per level. */
+int lsm_merge_next(struct lsm_cursor *cursors, int num_cursors) {
+    const struct lsm_entry *smallest = NULL;
+    int c, next = -1;
+    for (c = 0; c < num_cursors; c++) {
+        const struct lsm_entry *entry = lsm_cursor_peek(&cursors[c]);
+        if (entry != NULL && (smallest == NULL || compare_lsm_entries(entry, smallest) < 0)) {
+            smallest = entry;
+            next = c;
+        }
+    }
+    return next;
+}
+
+// folds an entry into a segment header's key range, state mask and sequence
+void lsm_header_add(struct lsm_segment_header *header, const struct lsm_entry *entry) {
+    if (header->num_entries == 0 || entry->timestamp < header->min_timestamp) {
+        header->min_timestamp = entry->timestamp;
+    }
+    if (header->num_entries == 0 || entry->timestamp > header->max_timestamp) {
+        header->max_timestamp = entry->timestamp;
+    }
+    if (timestamp_in_range(entry->timestamp)
+            && (header->num_in_range++ == 0 || entry->timestamp > header->max_in_range)) {
+        header->max_in_range = entry->timestamp;
+    }
+    if (entry->sequence > header->max_sequence) {
+        header->max_sequence = entry->sequence;
+    }
+    header->states |= lsm_state_bit(entry->code);
+    header->num_entries++;
+}
+
+/* Writes the sorted entries of a segment: written under a temporary name
+ * and renamed once complete, so segment files are never seen half written.
+ * Returns 0 on success. */
+int lsm_write_segment(struct lsm_store *store, uint32_t id, struct lsm_segment_header *header,
+        const struct lsm_entry *entries, size_t count, struct lsm_cursor *cursors, int num_cursors) {
+    char path[PATH_MAX], temporary[PATH_MAX];
+    FILE *file;
+    size_t i;
+    int c, failed;
+
+    lsm_path(store, "tmp", id, temporary);
+    lsm_path(store, "seg", id, path);
+    file = fopen(temporary, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    memcpy(header->magic, LSM_MAGIC, 8);
+    header->version = LSM_VERSION;
+    failed = fwrite(header, sizeof(*header), 1, file) != 1;
+    for (i = 0; i < count; i++) {
+        lsm_header_add(header, &entries[i]);
+    }
+    failed |= count > 0 && fwrite(entries, sizeof(struct lsm_entry), count, file) != count;
+    // or the merge of the cursors' entries
+    while ((c = lsm_merge_next(cursors, num_cursors)) >= 0 && !failed) {
+        const struct lsm_entry *entry = &cursors[c].entries[cursors[c].next++];
+        lsm_header_add(header, entry);
+        failed = fwrite(entry, sizeof(*entry), 1, file) != 1;
+    }
+    for (c = 0; c < num_cursors; c++) {
+        failed |= cursors[c].failed;
+    }
+    failed |= fseek(file, 0, SEEK_SET) != 0 || fwrite(header, sizeof(*header), 1, file) != 1;
+    failed |= fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    if (failed || rename(temporary, path) != 0) {
+        remove(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+int compare_lsm_segments(const void *a, const void *b) {
+    uint32_t x = ((const struct lsm_segment*) a)->id, y = ((const struct lsm_segment*) b)->id;
+    return (x > y) - (x < y);
+}
+
+/* Background compaction: whenever a level holds LSM_MERGE_WIDTH segments,
+ * merges its oldest ones into a single segment of the next level, then
+ * swaps them in the manifest and deletes them. Queries and flushes go on
+ * meanwhile; only the segment list is locked. */
+void *lsm_compact(void *arg) {
+    struct lsm_store *store = (struct lsm_store*) arg;
+    pthread_mutex_lock(&store->lock);
+    while (!store->failed) {
+        struct lsm_cursor cursors[LSM_MERGE_WIDTH];
+        uint32_t inputs[LSM_MERGE_WIDTH], id, level = 0;
+        struct lsm_segment_header header;
+        char path[PATH_MAX];
+        int i, c, n = 0, failed = 0;
+
+        for (level = 0; level < LSM_MAX_LEVELS; level++) {
+            n = 0;
+            for (i = 0; i < store->num_segments && n < LSM_MERGE_WIDTH; i++) {
+                if (store->segments[i].header.level == level && !store->segments[i].merging) {
+                    inputs[n++] = store->segments[i].id;
+                }
+            }
+            if (n == LSM_MERGE_WIDTH) {
+                break;
+            }
+        }
+        if (n < LSM_MERGE_WIDTH) {
+            // roll up what aged out of the raw tier once merging is done
+            if (store->retain_raw > 0 && store->expire_due) {
+                store->expire_due = 0;
+                store->failed |= lsm_expire(store) != 0;
+                continue;
+            }
+            if (store->stop) {
+                break;
+            }
+            pthread_cond_wait(&store->wake, &store->lock);
+            continue;
+        }
+        for (i = 0; i < store->num_segments; i++) {
+            for (c = 0; c < n; c++) {
+                store->segments[i].merging |= store->segments[i].id == inputs[c];
+            }
+        }
+        id = store->next_id++;
+        pthread_mutex_unlock(&store->lock);
+
+        memset(&header, 0, sizeof(header));
+        header.level = level + 1;
+        for (c = 0; c < n; c++) {
+            lsm_path(store, "seg", inputs[c], path);
+            failed |= lsm_cursor_open(&cursors[c], path, LONG_MIN) != 0;
+        }
+        failed = failed || lsm_write_segment(store, id, &header, NULL, 0, cursors, n) != 0;
+        for (c = 0; c < n; c++) {
+            lsm_cursor_close(&cursors[c]);
+        }
+
+        pthread_mutex_lock(&store->lock);
+        if (failed) {
+            store->failed = 1;
+            break;
+        }
+        for (i = 0; i < store->num_segments;) {
+            if (store->segments[i].merging) {
+                store->segments[i] = store->segments[--store->num_segments];
+            }
+            else {
+                i++;
+            }
+        }
+        lsm_add_segment(store, id, &header);
+        // keep the ID order after the swap-removal above
+        qsort(store->segments, store->num_segments, sizeof(struct lsm_segment), compare_lsm_segments);
+        if (lsm_write_manifest(store) != 0) {
+            store->failed = 1;
+            break;
+        }
+        for (c = 0; c < n; c++) {
+            lsm_path(store, "seg", inputs[c], path);
+            remove(path);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+/* Loads a store's segment list from its manifest and segment headers, and
+ * replays the write-ahead log entries that no segment holds yet into the
+ * write buffer, growing it if a crash left more than a buffer's worth (the
+ * caller flushes it then). A missing manifest is an empty store. Returns 0
+ * on success. */
+int lsm_load(struct lsm_store *store) {
+    char path[PATH_MAX];
+    struct lsm_entry entry;
+    uint64_t max_sequence = 0;
+    unsigned int id, level;
+    FILE *file;
+    int i;
+
+    lsm_path(store, "MANIFEST", 0, path);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        if (fscanf(file, " rollups %u", &id) == 1) {
+            store->rollups = id;
+        }
+        while (fscanf(file, "%u %u", &id, &level) == 2) {
+            struct lsm_segment_header header;
+            FILE *segment;
+            lsm_path(store, "seg", id, path);
+            segment = fopen(path, "rb");
+            if (segment == NULL || fread(&header, sizeof(header), 1, segment) != 1
+                    || memcmp(header.magic, LSM_MAGIC, 8) != 0 || header.version != LSM_VERSION) {
+                if (segment != NULL) {
+                    fclose(segment);
+                }
+                fclose(file);
+                return -1;
+            }
+            fclose(segment);
+            lsm_add_segment(store, id, &header);
+        }
+        fclose(file);
+    }
+    store->next_id = store->rollups + 1;
+    for (i = 0; i < store->num_segments; i++) {
+        if (store->segments[i].id >= store->next_id) {
+            store->next_id = store->segments[i].id + 1;
+        }
+        if (store->segments[i].header.max_sequence > max_sequence) {
+            max_sequence = store->segments[i].header.max_sequence;
+        }
+    }
+    store->next_sequence = max_sequence + 1;
+
+    // entries logged before a crash, minus those flushed before the log was truncated
+    lsm_path(store, "wal", 0, path);
+    file = fopen(path, "rb");
+    if (file != NULL) {
+        while (fread(&entry, sizeof(entry), 1, file) == 1) {
+            if (entry.sequence > max_sequence) {
+                if (store->count == store->buffer_capacity) {
+                    store->buffer_capacity *= 2;
+                    store->buffer = realloc(store->buffer, store->buffer_capacity * sizeof(struct lsm_entry));
+                }
+                store->buffer[store->count++] = entry;
+                if (entry.sequence >= store->next_sequence) {
+                    store->next_sequence = entry.sequence + 1;
+                }
+            }
+        }
+        fclose(file);
+    }
+    return 0;
+}
+
+struct lsm_store *lsm_new(const char *dir) {
+    struct lsm_store *store = (struct lsm_store*) calloc(1, sizeof(struct lsm_store));
+    store->dir = dir;
+    store->next_id = 1;
+    store->buffer = (struct lsm_entry*) malloc(LSM_BUFFER_ENTRIES * sizeof(struct lsm_entry));
+    store->buffer_capacity = LSM_BUFFER_ENTRIES;
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->wake, NULL);
+    return store;
+}
+
+void lsm_free(struct lsm_store *store) {
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->wake);
+    free(store->buffer);
+    free(store->segments);
+    free(store);
+}
+
+/* Opens (creating if needed) the log-structured store in a directory for
+ * ingest, recovering records logged but not yet flushed, and starts the
+ * compaction thread, which also applies the retention (in seconds, none if
+ * retain_raw is 0). Returns NULL if it cannot be opened. */
+struct lsm_store *lsm_open(const char *dir, long retain_raw, long retain_hourly) {
+    struct lsm_store *store;
+    char path[PATH_MAX];
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    store = lsm_new(dir);
+    store->retain_raw = retain_raw;
+    store->retain_hourly = retain_hourly;
+    store->expire_due = 1;
+    lsm_path(store, "wal", 0, path);
+    if (lsm_load(store) != 0 || (store->wal = fopen(path, "ab")) == NULL) {
+        lsm_free(store);
+        return NULL;
+    }
+    // a full buffer replayed from the log goes to a segment before any append
+    if (store->count >= LSM_BUFFER_ENTRIES && lsm_flush(store) != 0) {
+        if (store->wal != NULL) {
+            fclose(store->wal);
+        }
+        lsm_free(store);
+        return NULL;
+    }
+    if (pthread_create(&store->compactor, NULL, lsm_compact, store) != 0) {
+        fclose(store->wal);
+        lsm_free(store);
+        return NULL;
+    }
+    return store;
+}
+
+/* Sorts the write buffer into a new level-0 segment, adds it to the
+ * manifest, wakes the compaction thread and truncates the log. Returns 0 on
+ * success. */
+int lsm_flush(struct lsm_store *store) {
+    struct lsm_segment_header header;
+    char path[PATH_MAX];
+    uint32_t id;
+    int failed;
+
+    if (store->count == 0 || store->wal == NULL) {
+        return store->wal == NULL ? -1 : 0;
+    }
+    qsort(store->buffer, store->count, sizeof(struct lsm_entry), compare_lsm_entries);
+    pthread_mutex_lock(&store->lock);
+    id = store->next_id++;
+    pthread_mutex_unlock(&store->lock);
+
+    memset(&header, 0, sizeof(header));
+    failed = lsm_write_segment(store, id, &header, store->buffer, store->count, NULL, 0) != 0;
+
+    pthread_mutex_lock(&store->lock);
+    if (!failed) {
+        lsm_add_segment(store, id, &header);
+        failed = lsm_write_manifest(store) != 0;
+        store->expire_due = 1;
+        pthread_cond_signal(&store->wake);
+    }
+    store->failed |= failed;
+    pthread_mutex_unlock(&store->lock);
+    if (failed) {
+        return -1;
+    }
+
+    // the flushed entries are in the segment now
+    lsm_path(store, "wal", 0, path);
+    fclose(store->wal);
+    store->wal = fopen(path, "wb");
+    store->count = 0;
+    return store->wal == NULL ? -1 : 0;
+}
+
+/* Logs a record and adds it to the write buffer, flushing the buffer to a
+ * segment once full. The log is flushed to disk every LSM_SYNC_ENTRIES
+ * records. A buffer left full by a failed flush is flushed again first; if
+ * that fails too, the record is not stored and the store is marked failed. */
+void lsm_append(struct lsm_store *store, const struct record *rec) {
+    struct lsm_entry *entry;
+    if (store->count >= LSM_BUFFER_ENTRIES && lsm_flush(store) != 0) {
+        store->log_failed = 1;
+        return;
+    }
+    entry = &store->buffer[store->count++];
+    lsm_entry_from_record(entry, rec, store->next_sequence++);
+    if (fwrite(entry, sizeof(*entry), 1, store->wal) != 1) {
+        store->log_failed = 1;
+    }
+    if (entry->sequence % LSM_SYNC_ENTRIES == 0 && (fflush(store->wal) != 0 || fsync(fileno(store->wal)) != 0)) {
+        store->log_failed = 1;
+    }
+    if (store->count == LSM_BUFFER_ENTRIES && lsm_flush(store) != 0) {
+        store->log_failed = 1;
+    }
+}
+
+/* Flushes the write buffer, lets the compaction thread finish the merges
+ * that are due and closes the store. Returns 0 on success. */
+int lsm_close(struct lsm_store *store) {
+    int failed = store->log_failed || lsm_flush(store) != 0;
+    pthread_mutex_lock(&store->lock);
+    store->stop = 1;
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->compactor, NULL);
+    failed |= store->failed;
+    if (store->wal != NULL) {
+        failed |= fclose(store->wal) != 0;
+    }
+    lsm_free(store);
+    return failed ? -1 : 0;
+}
+
+/* Queries a store: merges, in timestamp order, the entries of the segments
+ * whose time range and state mask can match and the log entries not yet
+ * flushed, each segment entered by binary search on --between's start.
+ * Matching records (of `state` when given, and --between, --within and
+ * --where) are analyzed like input records. The part of the range that
+ * only the retention tiers still hold is answered from the rollups, if the
+ * query needs no more than the state summaries. Prints its errors; returns
+ * 0 on success. */
+int analyze_lsm(const char *dir, const char *state, struct climate_info *states[]) {
+    struct lsm_store *store = lsm_new(dir);
+    struct lsm_rollup_header rollups;
+    struct lsm_cursor *cursors;
+    struct parse_batch batch;
+    struct record rec;
+    long from = options.filter.has_between ? options.filter.from : LONG_MIN;
+    long to = options.filter.has_between ? options.filter.to : LONG_MAX;
+    uint64_t state_mask = state != NULL ? lsm_state_bit(state) : ~0ULL;
+    unsigned long num_records = 0, num_hourly = 0, num_daily = 0;
+    int i, c, num_cursors = 0, failed = 0;
+    struct stat status;
+
+    if (stat(dir, &status) != 0 || !S_ISDIR(status.st_mode) || lsm_load(store) != 0) {
+        printf("Error: Could not read store \"%s\".\n", dir);
+        lsm_free(store);
+        return -1;
+    }
+
+    // the records before the daily tier's cutoff are only in the rollups
+    if (read_rollups(store, LSM_TIER_DAILY, NULL, &rollups) != 0) {
+        printf("Error: Could not read store \"%s\".\n", dir);
+        lsm_free(store);
+        return -1;
+    }
+    if (from < rollups.cutoff) {
+        int year, month, day;
+        long cutoff_day = day_index(rollups.cutoff);
+        civil_from_days(cutoff_day, &year, &month, &day);
+        if (query_needs_records()) {
+            printf("Error: Records before %04d-%02d-%02dT%02ld are only kept as rollups; "
+                    "query them without record-level options.\n",
+                    year, month, day, (rollups.cutoff - cutoff_day * 86400) / 3600);
+            lsm_free(store);
+            return -1;
+        }
+        switch (query_rollups(store, state, from, to, states, &num_hourly, &num_daily)) {
+        case 0:
+            break;
+        case -2:
+            printf("Error: Hours that old are only kept as daily rollups; query whole days.\n");
+            lsm_free(store);
+            return -1;
+        default:
+            printf("Error: Could not read store \"%s\".\n", dir);
+            lsm_free(store);
+            return -1;
+        }
+    }
+
+    cursors = (struct lsm_cursor*) calloc(store->num_segments + 1, sizeof(struct lsm_cursor));
+    for (i = 0; i < store->num_segments && !failed; i++) {
+        struct lsm_segment_header *header = &store->segments[i].header;
+        char path[PATH_MAX];
+        if (header->num_entries == 0 || header->max_timestamp < from || header->min_timestamp >= to
+                || (header->states & state_mask) == 0) {
+            continue;
+        }
+        lsm_path(store, "seg", store->segments[i].id, path);
+        failed = lsm_cursor_open(&cursors[num_cursors++], path, from) != 0;
+    }
+    // the unflushed log entries, as one more sorted run
+    qsort(store->buffer, store->count, sizeof(struct lsm_entry), compare_lsm_entries);
+    cursors[num_cursors].entries = store->buffer;
+    cursors[num_cursors++].count = store->count;
+
+    batch.count = 0;
+    while (!failed && (c = lsm_merge_next(cursors, num_cursors)) >= 0) {
+        const struct lsm_entry *entry = &cursors[c].entries[cursors[c].next++];
+        if (entry->timestamp >= to) {
+            // past the range in this run, and so in every other
+            break;
+        }
+        if (entry->timestamp < from || (state != NULL && memcmp(entry->code, state, 2) != 0)) {
+            continue;
+        }
+        record_from_lsm_entry(&rec, entry);
+        if ((options.filter.snow >= 0 && (rec.snow != 0) != options.filter.snow)
+                || (options.filter.lightning >= 0 && (rec.lightning != 0) != options.filter.lightning)
+                || !filter_match(&options.filter, rec.timestamp, rec.geohash)) {
+            continue;
+        }
+        int state_index = get_state_index(states, rec.code);
+        states[state_index]->num_snowcover += rec.snow;
+        states[state_index]->num_lightning += rec.lightning;
+        add_record(states, state_index, &rec, &batch);
+        num_records++;
+    }
+    flush_batch(&batch, states);
+
+    printf(" -- LSM Query: %lu records from %d of %d segments and %d logged records, "
+            "%lu hourly and %lu daily rollups --\n",
+            num_records, num_cursors - 1, store->num_segments, store->count, num_hourly, num_daily);
+    for (c = 0; c < num_cursors - 1; c++) {
+        failed |= cursors[c].failed;
+        lsm_cursor_close(&cursors[c]);
+    }
+    free(cursors);
+    lsm_free(store);
+    if (failed) {
+        printf("Error: Could not read store \"%s\".\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+// slot of a key in the upsert table, or of the empty slot where it belongs
+size_t upsert_slot(long timestamp, uint32_t location) {
+    uint64_t h = ((uint64_t) timestamp * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t) location * 0xC2B2AE3D27D4EB4FULL);
+    size_t i;
+    for (i = (h >> 32) & (upserts.capacity - 1); upserts.slots[i] != UINT32_MAX;
+            i = (i + 1) & (upserts.capacity - 1)) {
+        const struct upsert_entry *entry = &upserts.entries[upserts.slots[i]];
+        if (entry->timestamp == timestamp && entry->location == location) {
+            break;
+        }
+    }
+    return i;
+}
+
+// doubles the key slots once they are half full
+void upsert_grow(void) {
+    uint32_t e;
+    size_t i;
+    if (2 * (size_t) (upserts.num_entries + 1) <= upserts.capacity) {
+        return;
+    }
+    upserts.capacity = upserts.capacity == 0 ? 1024 : 2 * upserts.capacity;
+    free(upserts.slots);
+    upserts.slots = (uint32_t*) malloc(upserts.capacity * sizeof(uint32_t));
+    memset(upserts.slots, 0xff, upserts.capacity * sizeof(uint32_t));
+    for (e = 0; e < upserts.num_entries; e++) {
+        i = upsert_slot(upserts.entries[e].timestamp, upserts.entries[e].location);
+        upserts.slots[i] = e;
+    }
+}
+
+/* Returns the (state, hour) bucket of the upsert table, creating it empty.
+ * Buckets are found through a small open-addressing table of their own. */
+uint32_t upsert_bucket(int state_index, long hour) {
+    uint64_t h = ((uint64_t) hour << 8 | (uint64_t) state_index) * 0x9E3779B97F4A7C15ULL;
+    struct upsert_bucket *bucket;
+    size_t i;
+
+    if (2 * (size_t) (upserts.num_buckets + 1) > upserts.bucket_capacity) {
+        uint32_t b;
+        upserts.bucket_capacity = upserts.bucket_capacity == 0 ? 256 : 2 * upserts.bucket_capacity;
+        free(upserts.bucket_slots);
+        upserts.bucket_slots = (uint32_t*) malloc(upserts.bucket_capacity * sizeof(uint32_t));
+        memset(upserts.bucket_slots, 0xff, upserts.bucket_capacity * sizeof(uint32_t));
+        for (b = 0; b < upserts.num_buckets; b++) {
+            uint64_t g = ((uint64_t) upserts.buckets[b].hour << 8 | (uint64_t) upserts.buckets[b].state_index)
+                * 0x9E3779B97F4A7C15ULL;
+            for (i = (g >> 32) & (upserts.bucket_capacity - 1); upserts.bucket_slots[i] != UINT32_MAX;
+                    i = (i + 1) & (upserts.bucket_capacity - 1)) {
+            }
+            upserts.bucket_slots[i] = b;
+        }
+    }
+    for (i = (h >> 32) & (upserts.bucket_capacity - 1); upserts.bucket_slots[i] != UINT32_MAX;
+            i = (i + 1) & (upserts.bucket_capacity - 1)) {
+        bucket = &upserts.buckets[upserts.bucket_slots[i]];
+        if (bucket->hour == hour && bucket->state_index == state_index) {
+            return upserts.bucket_slots[i];
+        }
+    }
+
+    if (upserts.num_buckets == upserts.buckets_capacity) {
+        upserts.buckets_capacity = upserts.buckets_capacity == 0 ? 256 : 2 * upserts.buckets_capacity;
+        upserts.buckets = realloc(upserts.buckets, upserts.buckets_capacity * sizeof(struct upsert_bucket));
+    }
+    bucket = &upserts.buckets[upserts.num_buckets];
+    memset(bucket, 0, sizeof(*bucket));
+    bucket->state_index = state_index;
+    bucket->hour = hour;
+    bucket->first = bucket->last = UINT32_MAX;
+    upserts.bucket_slots[i] = upserts.num_buckets;
+    return upserts.num_buckets++;
+}
+
+// folds an entry's temperature into its bucket's extremes (ties keep the earlier entry)
+void upsert_bucket_extremes(struct upsert_bucket *bucket, const struct upsert_entry *entry) {
+    if (bucket->count == 1 || entry->temperature > bucket->max_temperature) {
+        bucket->max_temperature = entry->temperature;
+        bucket->max_temp_date = entry->timestamp;
+    }
+    if (bucket->count == 1 || entry->temperature < bucket->min_temperature) {
+        bucket->min_temperature = entry->temperature;
+        bucket->min_temp_date = entry->timestamp;
+    }
+}
+
+// appends an entry to its bucket's list
+void upsert_link(uint32_t e, uint32_t b) {
+    struct upsert_entry *entry = &upserts.entries[e];
+    struct upsert_bucket *bucket = &upserts.buckets[b];
+    entry->next = UINT32_MAX;
+    if (bucket->last == UINT32_MAX) {
+        bucket->first = e;
+    }
+    else {
+        upserts.entries[bucket->last].next = e;
+    }
+    bucket->last = e;
+    bucket->count++;
+}
+
+void upsert_unlink(uint32_t e, uint32_t b) {
+    struct upsert_entry *entry = &upserts.entries[e];
+    struct upsert_bucket *bucket = &upserts.buckets[b];
+    uint32_t *link = &bucket->first, previous = UINT32_MAX;
+    while (*link != e) {
+        previous = *link;
+        link = &upserts.entries[*link].next;
+    }
+    *link = entry->next;
+    if (bucket->last == e) {
+        bucket->last = previous;
+    }
+    bucket->count--;
+}
+
+/* Takes a record's earlier version (entry e, same timestamp and geohash)
+ * back out of every aggregate it was added to: its state's sums, counts and
+ * histogram bins by delta, the hourly bucket's sums when the hourly series
+ * is kept, its climatology cells, its region and its location's stats.
+ * When the old value was an extreme of its state or bucket, those are
+ * marked to be recomputed by settle_upserts instead of being rescanned now.
+ * main rejects --upsert with the analyses that keep every record. */
+void retract_record(struct climate_info *states[], uint32_t e, uint32_t b) {
+    const struct upsert_entry *old = &upserts.entries[e];
+    int state_index = upserts.flags[e] >> UPSERT_STATE_SHIFT;
+    int snow = (upserts.flags[e] & UPSERT_SNOW) != 0;
+    int lightning = (upserts.flags[e] & UPSERT_LIGHTNING) != 0;
+    struct climate_info *info = states[state_index];
+    struct upsert_bucket *bucket = &upserts.buckets[b];
+    float value;
+    int bin;
+
+    info->num_records--;
+    info->sum_humidity -= old->humidity;
+    info->sum_cloudcover -= old->cloudcover;
+    info->sum_temperature -= old->temperature;
+    info->num_snowcover -= snow;
+    info->num_lightning -= lightning;
+    value = (float) old->temperature;
+    compute_bins(&value, 1, TEMP_HIST_MIN, 1.0f, TEMP_HIST_BINS, &bin);
+    info->temp_hist[bin]--;
+    value = (float) old->humidity;
+    compute_bins(&value, 1, 0.0f, PERCENT_HIST_WIDTH, PERCENT_HIST_BINS, &bin);
+    info->humidity_hist[bin]--;
+    value = (float) old->cloudcover;
+    compute_bins(&value, 1, 0.0f, PERCENT_HIST_WIDTH, PERCENT_HIST_BINS, &bin);
+    info->cloudcover_hist[bin]--;
+
+    if ((options.correlate_metric >= 0 || options.rolling) && !timestamp_in_range(old->timestamp)) {
+        num_series_skipped--;
+    }
+    else if (options.correlate_metric >= 0 || options.rolling) {
+        struct hour_bucket *hour = hourly_bucket(info, hour_index(old->timestamp));
+        hour->count--;
+        hour->sum[METRIC_TEMPERATURE] -= old->temperature;
+        hour->sum[METRIC_HUMIDITY] -= old->humidity;
+        hour->sum[METRIC_CLOUDCOVER] -= old->cloudcover;
+        hour->sum[METRIC_PRESSURE] -= upserts.pressures[e];
+        hour->sum[METRIC_SNOW] -= snow;
+        hour->sum[METRIC_LIGHTNING] -= lightning;
+    }
+    if (normals_build != NULL || period_observed != NULL) {
+        add_climatology(info->code, old->timestamp, old->temperature, old->humidity, snow, -1);
+    }
+    if (regions != NULL) {
+        int r = find_region(regions, old->location);
+        if (r < 0) {
+            regions->num_outside--;
+        }
+        else {
+            struct region *region = &regions->regions[r];
+            region->num_records--;
+            region->sum_temperature -= old->temperature;
+            region->sum_humidity -= old->humidity;
+            region->sum_cloudcover -= old->cloudcover;
+            region->num_lightning -= lightning;
+            region->num_snowcover -= snow;
+        }
+    }
+    // the latest values are overwritten by the correction, which has the same timestamp
+    if (options.nearest) {
+        struct location_stats *stats = &location_stats[old->location];
+        stats->num_records--;
+        stats->sum_temperature -= old->temperature;
+        stats->sum_humidity -= old->humidity;
+        stats->num_lightning -= lightning;
+        stats->num_snowcover -= snow;
+    }
+
+    if ((old->temperature == info->max_temperature && old->timestamp == info->max_temp_date)
+            || (old->temperature == info->min_temperature && old->timestamp == info->min_temp_date)) {
+        upserts.dirty_states[state_index] = 1;
+    }
+    if (old->temperature == bucket->max_temperature || old->temperature == bucket->min_temperature) {
+        bucket->dirty = 1;
+    }
+}
+
+/* Keeps a record as the last value of its (timestamp, geohash) key for
+ * --upsert, first retracting the key's previous value from the state
+ * summaries if it was seen before. Called by add_record before it adds the
+ * record itself. Returns whether the record replaced an earlier one. */
+int upsert_record(struct climate_info *states[], int state_index, const struct record *rec) {
+    uint32_t location = intern_geohash(rec->geohash), e;
+    int keep_pressure = options.correlate_metric >= 0 || options.rolling;
+    struct upsert_entry *entry;
+    struct upsert_bucket *bucket;
+    uint32_t b;
+    int replaced;
+    size_t i;
+
+    upsert_grow();
+    i = upsert_slot(rec->timestamp, location);
+    replaced = upserts.slots[i] != UINT32_MAX;
+    if (replaced) {
+        e = upserts.slots[i];
+        // the key's timestamp, and so its hour, is unchanged, but its state may not be
+        b = upsert_bucket(upserts.flags[e] >> UPSERT_STATE_SHIFT, hour_index(rec->timestamp));
+        retract_record(states, e, b);
+        upsert_unlink(e, b);
+        upserts.num_corrections++;
+    }
+    else {
+        if (upserts.num_entries == upserts.entries_capacity) {
+            upserts.entries_capacity = upserts.entries_capacity == 0 ? 1024 : 2 * upserts.entries_capacity;
+            upserts.entries = realloc(upserts.entries, upserts.entries_capacity * sizeof(struct upsert_entry));
+            upserts.flags = realloc(upserts.flags, upserts.entries_capacity);
+            if (keep_pressure) {
+                upserts.pressures = realloc(upserts.pressures, upserts.entries_capacity * sizeof(double));
+            }
+        }
+        e = upserts.num_entries++;
+        upserts.slots[i] = e;
+    }
+
+    entry = &upserts.entries[e];
+    entry->timestamp = rec->timestamp;
+    entry->location = location;
+    entry->humidity = rec->humidity;
+    entry->cloudcover = rec->cloudcover;
+    entry->temperature = rec->temperature;
+    upserts.flags[e] = (uint8_t) (state_index << UPSERT_STATE_SHIFT | (rec->snow != 0 ? UPSERT_SNOW : 0)
+            | (rec->lightning != 0 ? UPSERT_LIGHTNING : 0));
+    if (keep_pressure) {
+        upserts.pressures[e] = rec->pressure;
+    }
+    b = upsert_bucket(state_index, hour_index(rec->timestamp));
+    upsert_link(e, b);
+    bucket = &upserts.buckets[b];
+    if (!bucket->dirty) {
+        upsert_bucket_extremes(bucket, entry);
+    }
+    return replaced;
+}
+
+/* Brings the extremes up to date after corrections: rescans only the
+ * buckets whose extreme was retracted (also fixing the hourly series'
+ * min/max), then rebuilds only the affected states' max/min from their
+ * buckets' extremes. Call before reading the summaries. */
+void settle_upserts(struct climate_info *states[]) {
+    uint32_t b, e;
+    int s;
+
+    for (b = 0; b < upserts.num_buckets; b++) {
+        struct upsert_bucket *bucket = &upserts.buckets[b];
+        if (!bucket->dirty) {
+            continue;
+        }
+        bucket->dirty = 0;
+        bucket->count = 0;
+        for (e = bucket->first; e != UINT32_MAX; e = upserts.entries[e].next) {
+            bucket->count++;
+            upsert_bucket_extremes(bucket, &upserts.entries[e]);
+        }
+        if (bucket->count > 0 && (options.correlate_metric >= 0 || options.rolling)
+                && timestamp_in_range(bucket->hour * 3600)) {
+            struct hour_bucket *hour = hourly_bucket(states[bucket->state_index], bucket->hour);
+            hour->max_temperature = bucket->max_temperature;
+            hour->min_temperature = bucket->min_temperature;
+        }
+        upserts.num_recomputed++;
+    }
+
+    for (s = 0; s < NUM_STATES; s++) {
+        struct climate_info *info = states[s];
+        if (!upserts.dirty_states[s] || info == NULL) {
+            continue;
+        }
+        upserts.dirty_states[s] = 0;
+        info->max_temperature = -1000;
+        info->min_temperature = 1000;
+        for (b = 0; b < upserts.num_buckets; b++) {
+            struct upsert_bucket *bucket = &upserts.buckets[b];
+            if (bucket->state_index != s || bucket->count == 0) {
+                continue;
+            }
+            if (bucket->max_temperature > info->max_temperature) {
+                info->max_temperature = bucket->max_temperature;
+                info->max_temp_date = bucket->max_temp_date;
+            }
+            if (bucket->min_temperature < info->min_temperature) {
+                info->min_temperature = bucket->min_temperature;
+                info->min_temp_date = bucket->min_temp_date;
+            }
+        }
+    }
+}
+
+// slot of a (start, state) rollup in a set, or of the empty slot where it belongs
+size_t rollup_slot(const struct rollup_set *set, int64_t start, const char code[2]) {
+    uint64_t h = ((uint64_t) start << 16 | (uint8_t) code[0] << 8 | (uint8_t) code[1]) * 0x9E3779B97F4A7C15ULL;
+    size_t i;
+    for (i = (h >> 32) & (set->capacity - 1); set->slots[i] != UINT32_MAX; i = (i + 1) & (set->capacity - 1)) {
+        const struct lsm_rollup *rollup = &set->rollups[set->slots[i]];
+        if (rollup->start == start && memcmp(rollup->code, code, 2) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Returns the rollup of a state's hour or day in a set, adding an empty
+ * one if there is none. */
+struct lsm_rollup *find_rollup(struct rollup_set *set, int64_t start, const char code[2]) {
+    struct lsm_rollup *rollup;
+    size_t i;
+    if (2 * (size_t) (set->count + 1) > set->capacity) {
+        uint32_t r;
+        set->capacity = set->capacity == 0 ? 1024 : 2 * set->capacity;
+        free(set->slots);
+        set->slots = (uint32_t*) malloc(set->capacity * sizeof(uint32_t));
+        memset(set->slots, 0xff, set->capacity * sizeof(uint32_t));
+        for (r = 0; r < set->count; r++) {
+            set->slots[rollup_slot(set, set->rollups[r].start, set->rollups[r].code)] = r;
+        }
+    }
+    i = rollup_slot(set, start, code);
+    if (set->slots[i] != UINT32_MAX) {
+        return &set->rollups[set->slots[i]];
+    }
+    if (set->count == set->rollups_capacity) {
+        set->rollups_capacity = set->rollups_capacity == 0 ? 1024 : 2 * set->rollups_capacity;
+        set->rollups = realloc(set->rollups, set->rollups_capacity * sizeof(struct lsm_rollup));
+    }
+    rollup = &set->rollups[set->count];
+    memset(rollup, 0, sizeof(*rollup));
+    rollup->start = start;
+    memcpy(rollup->code, code, 2);
+    set->slots[i] = set->count++;
+    return rollup;
+}
+
+void free_rollups(struct rollup_set *set) {
+    free(set->rollups);
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// adds a store entry to a rollup, with the same extremes (earliest wins) and bins as add_record
+void rollup_add(struct lsm_rollup *rollup, const struct lsm_entry *entry) {
+    float value;
+    int bin;
+    if (rollup->num_records == 0 || entry->temperature > rollup->max_temperature) {
+        rollup->max_temperature = entry->temperature;
+        rollup->max_temp_date = entry->timestamp;
+    }
+    if (rollup->num_records == 0 || entry->temperature < rollup->min_temperature) {
+        rollup->min_temperature = entry->temperature;
+        rollup->min_temp_date = entry->timestamp;
+    }
+    rollup->num_records++;
+    rollup->num_snowcover += entry->snow;
+    rollup->num_lightning += entry->lightning;
+    rollup->sum_temperature += entry->temperature;
+    rollup->sum_humidity += entry->humidity;
+    rollup->sum_cloudcover += entry->cloudcover;
+    value = (float) entry->temperature;
+    compute_bins(&value, 1, TEMP_HIST_MIN, 1.0f, TEMP_HIST_BINS, &bin);
+    rollup->temp_hist[bin]++;
+    value = (float) entry->humidity;
+    compute_bins(&value, 1, 0.0f, PERCENT_HIST_WIDTH, PERCENT_HIST_BINS, &bin);
+    rollup->humidity_hist[bin]++;
+    value = (float) entry->cloudcover;
+    compute_bins(&value, 1, 0.0f, PERCENT_HIST_WIDTH, PERCENT_HIST_BINS, &bin);
+    rollup->cloudcover_hist[bin]++;
+}
+
+// adds a rollup to its state's summary, like merging the summary of its records
+void merge_rollup(struct climate_info *states[], const struct lsm_rollup *rollup) {
+    char code[3] = {rollup->code[0], rollup->code[1], '\0'};
+    struct climate_info part;
+    int i;
+
+    memset(&part, 0, sizeof(part));
+    part.num_records = rollup->num_records;
+    part.sum_temperature = rollup->sum_temperature;
+    part.sum_humidity = rollup->sum_humidity;
+    part.sum_cloudcover = rollup->sum_cloudcover;
+    part.max_temperature = rollup->max_temperature;
+    part.max_temp_date = rollup->max_temp_date;
+    part.min_temperature = rollup->min_temperature;
+    part.min_temp_date = rollup->min_temp_date;
+    part.num_lightning = rollup->num_lightning;
+    part.num_snowcover = rollup->num_snowcover;
+    for (i = 0; i < TEMP_HIST_BINS; i++) {
+        part.temp_hist[i] = rollup->temp_hist[i];
+    }
+    for (i = 0; i < PERCENT_HIST_BINS; i++) {
+        part.humidity_hist[i] = rollup->humidity_hist[i];
+        part.cloudcover_hist[i] = rollup->cloudcover_hist[i];
+    }
+    merge_climate_info(states[get_state_index(states, code)], &part);
+}
+
+int compare_rollups(const void *a, const void *b) {
+    const struct lsm_rollup *x = (const struct lsm_rollup*) a;
+    const struct lsm_rollup *y = (const struct lsm_rollup*) b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return memcmp(x->code, y->code, 2);
+}
+
+/* Reads a tier's live rollup file into a set (just the header if the set
+ * is NULL): the raw cutoff it was written for and the start of the time the
+ * tier covers. A store without rollups has empty tiers. Returns 0 on
+ * success. */
+int read_rollups(const struct lsm_store *store, int tier, struct rollup_set *set,
+        struct lsm_rollup_header *header) {
+    struct lsm_rollup rollup;
+    char path[PATH_MAX];
+    uint64_t r;
+    FILE *file;
+
+    if (store->rollups == 0) {
+        memset(header, 0, sizeof(*header));
+        header->cutoff = LONG_MIN;
+        header->first = LONG_MAX;
+        return 0;
+    }
+    lsm_path(store, tier == LSM_TIER_HOURLY ? "hourly" : "daily", store->rollups, path);
+    file = fopen(path, "rb");
+    if (file == NULL || fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, LSM_ROLLUP_MAGIC, 8) != 0
+            || header->version != LSM_VERSION || header->tier != (uint32_t) tier) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
+    for (r = 0; set != NULL && r < header->count; r++) {
+        if (fread(&rollup, sizeof(rollup), 1, file) != 1) {
+            fclose(file);
+            return -1;
+        }
+        *find_rollup(set, rollup.start, rollup.code) = rollup;
+    }
+    fclose(file);
+    return 0;
+}
+
+/* Writes a tier's rollups, sorted by time and state, as the rollup file
+ * with the given ID; it is live once the manifest names it. Returns 0 on
+ * success. */
+int write_rollups(const struct lsm_store *store, int tier, uint32_t id, struct rollup_set *set,
+        int64_t cutoff, int64_t first) {
+    struct lsm_rollup_header header;
+    char path[PATH_MAX];
+    FILE *file;
+    int failed;
+
+    lsm_path(store, tier == LSM_TIER_HOURLY ? "hourly" : "daily", id, path);
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    // sorting moves the rollups, so the set's slots are rebuilt on the next lookup
+    qsort(set->rollups, set->count, sizeof(struct lsm_rollup), compare_rollups);
+    free(set->slots);
+    set->slots = NULL;
+    set->capacity = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LSM_ROLLUP_MAGIC, 8);
+    header.version = LSM_VERSION;
+    header.tier = (uint32_t) tier;
+    header.cutoff = cutoff;
+    header.first = first;
+    header.count = set->count;
+    failed = fwrite(&header, sizeof(header), 1, file) != 1
+        || (set->count > 0 && fwrite(set->rollups, sizeof(struct lsm_rollup), set->count, file) != set->count);
+    failed |= fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    if (failed) {
+        remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Applies the retention tiers: rolls the raw records older than
+ * --retain-raw (before the newest record with an in-range timestamp) into hourly and daily rollups,
+ * rewriting the segments that held them without them, and drops hourly
+ * rollups older than --retain-hourly, which the daily ones also cover. The
+ * new rollup files and segment replace the old ones in one manifest swap,
+ * so a crash leaves either. Called by the compaction thread with the store
+ * locked. Returns 0 on success. */
+int lsm_expire(struct lsm_store *store) {
+    struct rollup_set hourly = {0}, daily = {0};
+    struct lsm_cursor *cursors;
+    struct lsm_segment_header header;
+    struct lsm_rollup_header previous;
+    int64_t newest = LONG_MIN, cutoff, hourly_cutoff;
+    uint32_t *inputs, id, rollups, previous_id, level = 0, r, kept;
+    char path[PATH_MAX];
+    int i, c, n = 0, failed = 0;
+
+    for (i = 0; i < store->num_segments; i++) {
+        if (store->segments[i].header.num_in_range > 0 && store->segments[i].header.max_in_range > newest) {
+            newest = store->segments[i].header.max_in_range;
+        }
+    }
+    if (newest == LONG_MIN) {
+        return 0;
+    }
+    // cutoffs on whole hours, and whole days for the hourly tier
+    cutoff = hour_index(newest - store->retain_raw) * 3600;
+    hourly_cutoff = day_index(cutoff - store->retain_hourly) * 86400;
+    inputs = (uint32_t*) malloc(store->num_segments * sizeof(uint32_t));
+    for (i = 0; i < store->num_segments; i++) {
+        struct lsm_segment *segment = &store->segments[i];
+        if (!segment->merging && segment->header.num_entries > 0 && segment->header.min_timestamp < cutoff) {
+            segment->merging = 1;
+            inputs[n++] = segment->id;
+            level = segment->header.level > level ? segment->header.level : level;
+        }
+    }
+    if (n == 0) {
+        free(inputs);
+        return 0;
+    }
+    id = store->next_id++;
+    rollups = store->next_id++;
+    pthread_mutex_unlock(&store->lock);
+
+    // only this thread replaces the live rollups
+    failed = read_rollups(store, LSM_TIER_HOURLY, &hourly, &previous) != 0
+        || read_rollups(store, LSM_TIER_DAILY, &daily, &previous) != 0;
+
+    // split the expired records off into the rollups while merging the rest
+    cursors = (struct lsm_cursor*) calloc(n, sizeof(struct lsm_cursor));
+    for (c = 0; c < n; c++) {
+        lsm_path(store, "seg", inputs[c], path);
+        failed |= lsm_cursor_open(&cursors[c], path, LONG_MIN) != 0;
+    }
+    while (!failed) {
+        const struct lsm_entry *entry;
+        int64_t start = LONG_MIN;
+        c = lsm_merge_next(cursors, n);
+        if (c < 0 || (entry = lsm_cursor_peek(&cursors[c]))->timestamp >= cutoff) {
+            break;
+        }
+        cursors[c].next++;
+        start = day_index(entry->timestamp) * 86400;
+        rollup_add(find_rollup(&daily, start, entry->code), entry);
+        start = hour_index(entry->timestamp) * 3600;
+        if (start >= hourly_cutoff) {
+            rollup_add(find_rollup(&hourly, start, entry->code), entry);
+        }
+    }
+    for (r = 0, kept = 0; r < hourly.count; r++) {
+        if (hourly.rollups[r].start >= hourly_cutoff) {
+            hourly.rollups[kept++] = hourly.rollups[r];
+        }
+    }
+    hourly.count = kept;
+    failed = failed || write_rollups(store, LSM_TIER_HOURLY, rollups, &hourly, cutoff, hourly_cutoff) != 0
+        || write_rollups(store, LSM_TIER_DAILY, rollups, &daily, cutoff, LONG_MIN) != 0;
+
+    // the remaining (newer) records of the inputs
+    memset(&header, 0, sizeof(header));
+    header.level = level;
+    failed = failed || lsm_write_segment(store, id, &header, NULL, 0, cursors, n) != 0;
+    for (c = 0; c < n; c++) {
+        lsm_cursor_close(&cursors[c]);
+    }
+    free(cursors);
+    free_rollups(&hourly);
+    free_rollups(&daily);
+
+    pthread_mutex_lock(&store->lock);
+    if (failed) {
+        free(inputs);
+        return -1;
+    }
+    previous_id = store->rollups;
+    store->rollups = rollups;
+    for (i = 0; i < store->num_segments;) {
+        if (store->segments[i].merging) {
+            store->segments[i] = store->segments[--store->num_segments];
+        }
+        else {
+            i++;
+        }
+    }
+    if (header.num_entries > 0) {
+        lsm_add_segment(store, id, &header);
+    }
+    else {
+        lsm_path(store, "seg", id, path);
+        remove(path);
+    }
+    qsort(store->segments, store->num_segments, sizeof(struct lsm_segment), compare_lsm_segments);
+    if (lsm_write_manifest(store) != 0) {
+        free(inputs);
+        return -1;
+    }
+    for (c = 0; c < n; c++) {
+        lsm_path(store, "seg", inputs[c], path);
+        remove(path);
+    }
+    if (previous_id != 0) {
+        lsm_path(store, "hourly", previous_id, path);
+        remove(path);
+        lsm_path(store, "daily", previous_id, path);
+        remove(path);
+    }
+    free(inputs);
+    return 0;
+}
+
+/* Parses --between's FROM:TO, dates with an optional hour (YYYY-MM-DD or
+ * YYYY-MM-DDTHH, UTC), into [from, to) timestamps covering the last day or
+ * hour. Returns 0 on success. */
+int parse_between(const char *text, long *from, long *to) {
+    long instants[2];
+    int i, n;
+    for (i = 0; i < 2; i++) {
+        int year, month, day, hour = -1;
+        if (sscanf(text, "%d-%d-%d%n", &year, &month, &day, &n) != 3
+                || month < 1 || month > 12 || day < 1 || day > 31) {
+            return -1;
+        }
+        text += n;
+        if (*text == 'T') {
+            if (sscanf(text, "T%d%n", &hour, &n) != 1 || hour < 0 || hour > 23) {
+                return -1;
+            }
+            text += n;
+        }
+        instants[i] = days_from_civil(year, month, day) * 86400;
+        if (hour >= 0) {
+            instants[i] += hour * 3600L;
+        }
+        // the end covers its whole day, or hour
+        if (i == 1) {
+            instants[i] += hour >= 0 ? 3600 : 86400;
+        }
+        if (i == 0 && *text++ != ':') {
+            return -1;
+        }
+    }
+    *from = instants[0];
+    *to = instants[1];
+    return *text != '\0' || *to <= *from ? -1 : 0;
+}
+
+// whether a store query needs the records themselves rather than state summaries
+int query_needs_records(void) {
+    return options.filter.snow >= 0 || options.filter.lightning >= 0 || options.filter.has_within
+        || options.correlate_metric >= 0 || options.climatology_file != NULL
+        || options.climatology_save_file != NULL || options.rolling || options.storm_cells
+        || options.snow_extent || options.cache_file != NULL || options.series_file != NULL
+        || options.history_file != NULL || options.heatmap_file != NULL || options.regions_file != NULL
+        || options.nearest || options.benchmark || options.profile_data || options.arrow_file != NULL
+        || options.parquet_file != NULL || options.lsm_dir != NULL || options.upsert
+        || options.stream_file != NULL || num_queries > 0;
+}
+
+// whether day `day` of [from, end) is answered exactly by its daily rollup (partial only at the cutoff)
+int whole_day(long day, long from, long end, long cutoff) {
+    return day >= from && day < end && (day + 86400 <= end || end == cutoff);
+}
+
+/* Answers the part of a store query before the raw cutoff from the
+ * rollups, with the coarsest tier that is exact for each piece: the daily
+ * rollups of the days wholly inside [from, to), and the hourly rollups of
+ * the hours of partial days at either end. Returns -1 on read errors, and
+ * -2 if a partial day is older than the hourly tier. */
+int query_rollups(struct lsm_store *store, const char *state, long from, long to,
+        struct climate_info *states[], unsigned long *num_hourly, unsigned long *num_daily) {
+    struct rollup_set hourly = {0}, daily = {0};
+    struct lsm_rollup_header hourly_header, daily_header;
+    long end, last_day;
+    uint32_t r;
+    int failed;
+
+    failed = read_rollups(store, LSM_TIER_HOURLY, &hourly, &hourly_header) != 0
+        || read_rollups(store, LSM_TIER_DAILY, &daily, &daily_header) != 0;
+    end = to < daily_header.cutoff ? to : daily_header.cutoff;
+    last_day = day_index(end) * 86400;
+    if (!failed && from < end) {
+        // partial days at either end need the hourly tier
+        if ((from != LONG_MIN && from % 86400 != 0 && from < hourly_header.first)
+                || (!whole_day(last_day, from, end, daily_header.cutoff) && last_day < end
+                    && (last_day > from ? last_day : from) < hourly_header.first)) {
+            failed = -2;
+        }
+        for (r = 0; r < daily.count && !failed; r++) {
+            const struct lsm_rollup *rollup = &daily.rollups[r];
+            if (whole_day(rollup->start, from, end, daily_header.cutoff)
+                    && (state == NULL || memcmp(rollup->code, state, 2) == 0)) {
+                merge_rollup(states, rollup);
+                (*num_daily)++;
+            }
+        }
+        for (r = 0; r < hourly.count && !failed; r++) {
+            const struct lsm_rollup *rollup = &hourly.rollups[r];
+            long day = day_index(rollup->start) * 86400;
+            if (rollup->start >= from && rollup->start < end
+                    && !whole_day(day, from, end, daily_header.cutoff)
+                    && (state == NULL || memcmp(rollup->code, state, 2) == 0)) {
+                merge_rollup(states, rollup);
+                (*num_hourly)++;
+            }
+        }
+    }
+    free_rollups(&hourly);
+    free_rollups(&daily);
+    return failed == -2 ? -2 : failed ? -1 : 0;
+}
+
+/* Opens --stream's CSV of finalized windows, with the watermark trailing the
+ * newest timestamp by `lateness` seconds. Returns NULL on failure. */
+struct event_stream *stream_open(const char *path, long lateness) {
+    struct event_stream *stream;
+    int w;
+
+    stream = (struct event_stream*) calloc(1, sizeof(struct event_stream));
+    stream->csv = fopen(path, "w");
+    if (stream->csv == NULL) {
+        free(stream);
+        return NULL;
+    }
+    fprintf(stream->csv, "state,window_start,window_end,records,mean_temperature,max_temperature,"
+            "min_temperature,mean_humidity,mean_cloudcover,mean_pressure,snow,lightning\n");
+    stream->lateness = lateness;
+    stream->max_timestamp = LONG_MIN;
+    stream->num_windows = (int) (lateness / 3600) + 2;
+    stream->windows = (struct stream_window*) calloc(stream->num_windows, sizeof(struct stream_window));
+    for (w = 0; w < stream->num_windows; w++) {
+        stream->windows[w].hour = LONG_MIN;
+    }
+    return stream;
+}
+
+// writes a window's state buckets as CSV rows and frees it for a later hour
+void stream_emit(struct event_stream *stream, struct climate_info *states[], struct stream_window *window) {
+    int i;
+    for (i = 0; i < NUM_STATES; i++) {
+        struct hour_bucket *bucket = &window->states[i];
+        if (bucket->count == 0) {
+            continue;
+        }
+        stream->failed |= fprintf(stream->csv, "%s,%ld,%ld,%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f,%.0f,%.0f\n",
+                states[i]->code, window->hour * 3600, (window->hour + 1) * 3600, bucket->count,
+                bucket->sum[METRIC_TEMPERATURE] / bucket->count, bucket->max_temperature,
+                bucket->min_temperature, bucket->sum[METRIC_HUMIDITY] / bucket->count,
+                bucket->sum[METRIC_CLOUDCOVER] / bucket->count, bucket->sum[METRIC_PRESSURE] / bucket->count,
+                bucket->sum[METRIC_SNOW], bucket->sum[METRIC_LIGHTNING]) < 0;
+        stream->num_emitted++;
+        stream->num_open--;
+    }
+    memset(window->states, 0, sizeof(window->states));
+    window->hour = LONG_MIN;
+}
+
+/* Moves the watermark up to `watermark`, finalizing in hour order the
+ * windows that end at or before it. */
+void stream_advance(struct event_stream *stream, struct climate_info *states[], long watermark) {
+    long close_hour = hour_index(watermark), h;
+    // the open hours are at most one ring apart
+    for (h = stream->next_hour; h < close_hour && h < stream->next_hour + stream->num_windows; h++) {
+        struct stream_window *window = &stream->windows[(h % stream->num_windows + stream->num_windows)
+                % stream->num_windows];
+        if (window->hour == h) {
+            stream_emit(stream, states, window);
+        }
+    }
+    if (close_hour > stream->next_hour) {
+        stream->next_hour = close_hour;
+    }
+}
+
+/* Adds a record to its state's bucket in the window of its event hour, first
+ * advancing the watermark if it is the newest record so far. Records of
+ * windows already finalized are late and only counted. */
+void stream_add(struct event_stream *stream, struct climate_info *states[], int state_index,
+        const struct record *rec) {
+    long hour = hour_index(rec->timestamp);
+    struct stream_window *window;
+    struct hour_bucket *bucket;
+
+    if (stream->max_timestamp == LONG_MIN) {
+        stream->next_hour = hour_index(rec->timestamp - stream->lateness);
+    }
+    if (rec->timestamp > stream->max_timestamp) {
+        stream->max_timestamp = rec->timestamp;
+        stream_advance(stream, states, rec->timestamp - stream->lateness);
+    }
+    if (hour < stream->next_hour) {
+        stream->num_late++;
+        return;
+    }
+
+    window = &stream->windows[(hour % stream->num_windows + stream->num_windows) % stream->num_windows];
+    window->hour = hour;
+    bucket = &window->states[state_index];
+    if (bucket->count == 0 || rec->temperature > bucket->max_temperature) {
+        bucket->max_temperature = rec->temperature;
+    }
+    if (bucket->count == 0 || rec->temperature < bucket->min_temperature) {
+        bucket->min_temperature = rec->temperature;
+    }
+    if (bucket->count++ == 0 && ++stream->num_open > stream->max_open) {
+        stream->max_open = stream->num_open;
+    }
+    bucket->sum[METRIC_TEMPERATURE] += rec->temperature;
+    bucket->sum[METRIC_HUMIDITY] += rec->humidity;
+    bucket->sum[METRIC_CLOUDCOVER] += rec->cloudcover;
+    bucket->sum[METRIC_PRESSURE] += rec->pressure;
+    bucket->sum[METRIC_SNOW] += rec->snow;
+    bucket->sum[METRIC_LIGHTNING] += rec->lightning;
+}
+
+/* Finalizes the windows still open at the end of the input and closes the
+ * CSV, keeping the counts for the report. Returns 0 on success. */
+int stream_close(struct event_stream *stream, struct climate_info *states[]) {
+    if (stream->max_timestamp != LONG_MIN) {
+        stream_advance(stream, states, LONG_MAX);
+    }
+    free(stream->windows);
+    stream->windows = NULL;
+    stream->failed |= fclose(stream->csv) != 0;
+    return stream->failed ? -1 : 0;
+}
+
+/* Parses one line of a --queries file: whitespace-separated --where,
+ * --within, --between, --group-by=KEY[,KEY] (state, geohash[N], hour, day
+ * or month; default state) and --output=FILE options. Keeps pointers into
+ * the line. Returns 0 on success. */
+int parse_query(char *line, struct query *query) {
+    char *option, *rest = line;
+
+    memset(query, 0, sizeof(*query));
+    query->filter.snow = -1;
+    query->filter.lightning = -1;
+    query->group_state = 1;
+    while ((option = strtok_r(rest, " \t\r\n", &rest)) != NULL) {
+        if (strncmp(option, "--where=", 8) == 0) {
+            if (parse_where(option + 8, &query->filter) != 0) {
+                return -1;
+            }
+        }
+        else if (strncmp(option, "--within=", 9) == 0) {
+            double *box = query->filter.within;
+            if (sscanf(option + 9, "%lf,%lf,%lf,%lf", &box[0], &box[1], &box[2], &box[3]) != 4
+                    || box[2] < box[0] || box[3] < box[1]) {
+                return -1;
+            }
+            query->filter.has_within = 1;
+        }
+        else if (strncmp(option, "--between=", 10) == 0) {
+            if (parse_between(option + 10, &query->filter.from, &query->filter.to) != 0) {
+                return -1;
+            }
+            query->filter.has_between = 1;
+        }
+        else if (strncmp(option, "--group-by=", 11) == 0) {
+            char *key, *keys = option + 11;
+            query->group_state = 0;
+            while ((key = strtok_r(keys, ",", &keys)) != NULL) {
+                int precision;
+                if (strcmp(key, "state") == 0) {
+                    query->group_state = 1;
+                }
+                else if (strcmp(key, "geohash") == 0) {
+                    query->geohash_precision = QUERY_GEOHASH_PRECISION;
+                }
+                else if (sscanf(key, "geohash%d", &precision) == 1 && precision >= 1
+                        && precision <= QUERY_MAX_GEOHASH_PRECISION) {
+                    query->geohash_precision = precision;
+                }
+                else if (strcmp(key, "hour") == 0 && query->time_unit == QUERY_TIME_NONE) {
+                    query->time_unit = QUERY_TIME_HOUR;
+                }
+                else if (strcmp(key, "day") == 0 && query->time_unit == QUERY_TIME_NONE) {
+                    query->time_unit = QUERY_TIME_DAY;
+                }
+                else if (strcmp(key, "month") == 0 && query->time_unit == QUERY_TIME_NONE) {
+                    query->time_unit = QUERY_TIME_MONTH;
+                }
+                else {
+                    return -1;
+                }
+            }
+        }
+        else if (strncmp(option, "--output=", 9) == 0) {
+            query->output = option + 9;
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads the queries of --queries, one per line (blank lines and lines
+ * starting with # are skipped). On failure returns -1 with *line_number
+ * set to the invalid line, or 0 if the file could not be read. */
+int load_queries(const char *path, int *line_number) {
+    char line[QUERY_LINE_LENGTH];
+    FILE *file = fopen(path, "r");
+
+    *line_number = 0;
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        size_t length = strspn(line, " \t\r\n");
+        (*line_number)++;
+        if (line[length] == '\0' || line[length] == '#') {
+            continue;
+        }
+        if (num_queries == queries_capacity) {
+            queries_capacity = queries_capacity == 0 ? 16 : 2 * queries_capacity;
+            queries = (struct query*) realloc(queries, queries_capacity * sizeof(struct query));
+        }
+        // the query keeps pointers into its text
+        char *text = strdup(line + length);
+        text[strcspn(text, "\r\n")] = '\0';
+        char *copy = strdup(text);
+        if (parse_query(copy, &queries[num_queries]) != 0) {
+            free(text);
+            free(copy);
+            fclose(file);
+            return -1;
+        }
+        queries[num_queries++].text = text;
+    }
+    fclose(file);
+    *line_number = 0;
+    return 0;
+}
+
+// mixes a group key into the hash that picks its slot (low half) and partition (top bits)
+uint64_t group_hash(uint64_t space, int64_t time) {
+    uint64_t h = (space * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t) time * 0xC2B2AE3D27D4EB4FULL);
+    return h ^ (h >> 29);
+}
+
+// slot of a group in a hashed table, or of the empty slot where it belongs
+size_t group_slot(const struct group_table *table, uint64_t hash, uint64_t space, int64_t time) {
+    size_t i;
+    for (i = hash & (table->capacity - 1); table->slots[i] != UINT32_MAX; i = (i + 1) & (table->capacity - 1)) {
+        const struct group_aggregate *group = &table->groups[table->slots[i]];
+        if (group->space == space && group->time == time) {
+            break;
+        }
+    }
+    return i;
+}
+
+// rebuilds a hashed table's slots at (at least) twice its group count
+void rehash_groups(struct group_table *table) {
+    uint32_t g;
+    while (2 * (size_t) (table->count + 1) > table->capacity) {
+        table->capacity = table->capacity == 0 ? 64 : 2 * table->capacity;
+    }
+    free(table->slots);
+    table->slots = (uint32_t*) malloc(table->capacity * sizeof(uint32_t));
+    memset(table->slots, 0xff, table->capacity * sizeof(uint32_t));
+    for (g = 0; g < table->count; g++) {
+        const struct group_aggregate *group = &table->groups[g];
+        table->slots[group_slot(table, group_hash(group->space, group->time), group->space, group->time)] = g;
+    }
+}
+
+// appends an empty group to a table's groups
+struct group_aggregate *new_group(struct group_table *table, uint64_t space, int64_t time) {
+    struct group_aggregate *group;
+    if (table->count == table->groups_capacity) {
+        table->groups_capacity = table->groups_capacity == 0 ? GROUP_ARRAY_MAX : 2 * table->groups_capacity;
+        table->groups = realloc(table->groups, table->groups_capacity * sizeof(struct group_aggregate));
+    }
+    group = &table->groups[table->count++];
+    memset(group, 0, sizeof(*group));
+    group->space = space;
+    group->time = time;
+    return group;
+}
+
+/* Returns the aggregate of a group key in an array or hashed table, adding
+ * an empty one if the group is new. The array is searched in order; its
+ * groups are hashed once there are more than GROUP_ARRAY_MAX. */
+struct group_aggregate *find_group(struct group_table *table, uint64_t space, int64_t time, uint64_t hash) {
+    uint32_t g;
+    size_t i;
+
+    if (table->mode == GROUPS_ARRAY) {
+        for (g = 0; g < table->count; g++) {
+            if (table->groups[g].space == space && table->groups[g].time == time) {
+                return &table->groups[g];
+            }
+        }
+        if (table->count < GROUP_ARRAY_MAX) {
+            return new_group(table, space, time);
+        }
+        table->mode = GROUPS_HASHED;
+    }
+    if (2 * (size_t) (table->count + 1) > table->capacity) {
+        rehash_groups(table);
+    }
+    i = group_slot(table, hash, space, time);
+    if (table->slots[i] == UINT32_MAX) {
+        table->slots[i] = table->count;
+        return new_group(table, space, time);
+    }
+    return &table->groups[table->slots[i]];
+}
+
+/* Moves a hashed table's groups into GROUP_PARTITIONS hashed tables by the
+ * top bits of their hash, each small enough to stay in cache. */
+void partition_groups(struct group_table *table) {
+    uint32_t g;
+    table->partitions = (struct group_table*) calloc(GROUP_PARTITIONS, sizeof(struct group_table));
+    for (g = 0; g < table->count; g++) {
+        const struct group_aggregate *group = &table->groups[g];
+        uint64_t hash = group_hash(group->space, group->time);
+        struct group_table *partition = &table->partitions[hash >> (64 - GROUP_PARTITION_BITS)];
+        partition->mode = GROUPS_HASHED;
+        *find_group(partition, group->space, group->time, hash) = *group;
+    }
+    free(table->groups);
+    free(table->slots);
+    table->groups = NULL;
+    table->slots = NULL;
+    table->groups_capacity = 0;
+    table->capacity = 0;
+    table->mode = GROUPS_PARTITIONED;
+}
+
+// adds a record to a group's aggregate
+void add_to_group(struct group_aggregate *group, const struct record *rec) {
+    if (group->count == 0 || rec->temperature > group->max_temperature) {
+        group->max_temperature = rec->temperature;
+    }
+    if (group->count == 0 || rec->temperature < group->min_temperature) {
+        group->min_temperature = rec->temperature;
+    }
+    group->count++;
+    group->sum_temperature += rec->temperature;
+    group->sum_humidity += rec->humidity;
+    group->sum_cloudcover += rec->cloudcover;
+    group->num_snowcover += rec->snow != 0;
+    group->num_lightning += rec->lightning != 0;
+}
+
+/* Adds the selected records of a batch, with their group keys, to a
+ * query's groups, adapting the table to the groups seen so far: a small
+ * array, then a hashed table, then radix partitions. Partitioned, the
+ * batch is first scattered by partition (a counting sort on the top hash
+ * bits), then aggregated one partition at a time. */
+void aggregate_groups(struct group_table *table, const struct record *records, const int *selected,
+        const uint64_t *spaces, const int64_t *times, int count) {
+    int offsets[GROUP_PARTITIONS + 1], order[BATCH_SIZE], partition_of[BATCH_SIZE];
+    uint64_t hashes[BATCH_SIZE];
+    int i, p;
+
+    for (i = 0; i < count && table->mode != GROUPS_PARTITIONED; i++) {
+        hashes[i] = group_hash(spaces[i], times[i]);
+        add_to_group(find_group(table, spaces[i], times[i], hashes[i]), &records[selected[i]]);
+        if (table->count > GROUP_HASH_MAX) {
+            partition_groups(table);
+        }
+    }
+    if (i == count) {
+        return;
+    }
+
+    memset(offsets, 0, sizeof(offsets));
+    for (; i < count; i++) {
+        hashes[i] = group_hash(spaces[i], times[i]);
+        partition_of[i] = (int) (hashes[i] >> (64 - GROUP_PARTITION_BITS));
+        offsets[partition_of[i] + 1]++;
+    }
+    for (p = 0; p < GROUP_PARTITIONS; p++) {
+        offsets[p + 1] += offsets[p];
+    }
+    for (i = count - offsets[GROUP_PARTITIONS]; i < count; i++) {
+        order[offsets[partition_of[i]]++] = i;
+    }
+    // offsets[p] is now the end of partition p
+    for (p = 0, i = 0; p < GROUP_PARTITIONS; p++) {
+        struct group_table *partition = &table->partitions[p];
+        uint32_t before = partition->count;
+        partition->mode = GROUPS_HASHED;
+        for (; i < offsets[p]; i++) {
+            int r = order[i];
+            add_to_group(find_group(partition, spaces[r], times[r], hashes[r]), &records[selected[r]]);
+        }
+        table->count += partition->count - before;
+    }
+}
+
+/* Fans a batch of parsed records out to every query of --queries. The
+ * columns the group keys are made of (geohash bits, hour, day, month) are
+ * computed once per record, then each query filters the batch, builds the
+ * keys of the records it keeps and adds them to its groups. */
+void run_queries(const struct record *records, int count) {
+    uint64_t state_bits[BATCH_SIZE], location_bits[BATCH_SIZE], spaces[BATCH_SIZE];
+    int64_t buckets[NUM_QUERY_TIMES][BATCH_SIZE], times[BATCH_SIZE];
+    int selected[BATCH_SIZE];
+    int i, q, n;
+
+    for (i = 0; i < count; i++) {
+        const struct record *rec = &records[i];
+        long day = day_index(rec->timestamp);
+        int year, month, day_of_month;
+        civil_from_days(day, &year, &month, &day_of_month);
+        state_bits[i] = (uint64_t) (uint8_t) rec->code[0] << 8 | (uint8_t) rec->code[1];
+        location_bits[i] = geohash_bits(rec->geohash);
+        buckets[QUERY_TIME_NONE][i] = 0;
+        buckets[QUERY_TIME_HOUR][i] = hour_index(rec->timestamp) * 3600;
+        buckets[QUERY_TIME_DAY][i] = day * 86400;
+        buckets[QUERY_TIME_MONTH][i] = days_from_civil(year, month, 1) * 86400;
+    }
+
+    for (q = 0; q < num_queries; q++) {
+        struct query *query = &queries[q];
+        int shift = GEOHASH_BITS - 5 * query->geohash_precision;
+        for (i = 0, n = 0; i < count; i++) {
+            const struct record *rec = &records[i];
+            if ((query->filter.snow >= 0 && (rec->snow != 0) != query->filter.snow)
+                    || (query->filter.lightning >= 0 && (rec->lightning != 0) != query->filter.lightning)
+                    || !filter_match(&query->filter, rec->timestamp, rec->geohash)) {
+                continue;
+            }
+            // state code above the geohash prefix
+            spaces[n] = 0;
+            if (query->group_state) {
+                spaces[n] = state_bits[i] << (5 * QUERY_MAX_GEOHASH_PRECISION);
+            }
+            if (query->geohash_precision > 0) {
+                spaces[n] |= location_bits[i] >> shift;
+            }
+            times[n] = buckets[query->time_unit][i];
+            selected[n++] = i;
+        }
+        aggregate_groups(&query->groups, records, selected, spaces, times, n);
+        query->num_records += n;
+    }
+}
+
+// gathers the groups of a partitioned table back into one array
+void flatten_groups(struct group_table *table) {
+    int p;
+    if (table->mode != GROUPS_PARTITIONED) {
+        return;
+    }
+    table->groups = (struct group_aggregate*) malloc((table->count + 1) * sizeof(struct group_aggregate));
+    table->groups_capacity = table->count + 1;
+    table->count = 0;
+    for (p = 0; p < GROUP_PARTITIONS; p++) {
+        struct group_table *partition = &table->partitions[p];
+        if (partition->count > 0) {
+            memcpy(&table->groups[table->count], partition->groups,
+                    partition->count * sizeof(struct group_aggregate));
+        }
+        table->count += partition->count;
+        free(partition->groups);
+        free(partition->slots);
+    }
+    free(table->partitions);
+    table->partitions = NULL;
+    table->mode = GROUPS_HASHED;
+    rehash_groups(table);
+}
+
+int compare_groups(const void *a, const void *b) {
+    const struct group_aggregate *x = (const struct group_aggregate*) a;
+    const struct group_aggregate *y = (const struct group_aggregate*) b;
+    if (x->space != y->space) {
+        return x->space < y->space ? -1 : 1;
+    }
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+/* Writes a query's groups, sorted by key, as CSV to its --output file or
+ * after a header line on stdout. Returns 0 on success. */
+int write_query(struct query *query, int index) {
+    static const char alphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    FILE *out = stdout;
+    uint32_t g;
+    int c;
+
+    printf(" -- Query %d: %s: %lu records in %u %s groups --\n", index + 1, query->text,
+            query->num_records, query->groups.count, group_modes[query->groups.mode]);
+    if (query->output != NULL && (out = fopen(query->output, "w")) == NULL) {
+        return -1;
+    }
+    flatten_groups(&query->groups);
+    if (query->groups.count > 0) {
+        qsort(query->groups.groups, query->groups.count, sizeof(struct group_aggregate), compare_groups);
+    }
+    if (query->group_state) {
+        fprintf(out, "state,");
+    }
+    if (query->geohash_precision > 0) {
+        fprintf(out, "geohash,");
+    }
+    if (query->time_unit != QUERY_TIME_NONE) {
+        fprintf(out, "time,");
+    }
+    fprintf(out, "records,mean_temperature,max_temperature,min_temperature,mean_humidity,mean_cloudcover,"
+            "snow,lightning\n");
+    for (g = 0; g < query->groups.count; g++) {
+        const struct group_aggregate *group = &query->groups.groups[g];
+        if (query->group_state) {
+            uint64_t code = group->space >> (5 * QUERY_MAX_GEOHASH_PRECISION);
+            fprintf(out, "%c%c,", (char) (code >> 8), (char) (code & 0xff));
+        }
+        if (query->geohash_precision > 0) {
+            for (c = query->geohash_precision - 1; c >= 0; c--) {
+                fputc(alphabet[(group->space >> (5 * c)) & 31], out);
+            }
+            fputc(',', out);
+        }
+        if (query->time_unit != QUERY_TIME_NONE) {
+            fprintf(out, "%ld,", (long) group->time);
+        }
+        fprintf(out, "%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%lu,%lu\n", group->count,
+                group->sum_temperature / group->count, group->max_temperature, group->min_temperature,
+                group->sum_humidity / group->count, group->sum_cloudcover / group->count,
+                group->num_snowcover, group->num_lightning);
+    }
+    if (out != stdout) {
+        return fclose(out) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/* Parses a TDV line (modified in place) into a record. Returns -1 if a
+ * field is missing. */
+int parse_line(char *line, struct record *rec) {
+    char *fields[9], *rest = line;
+    int i;
+    for (i = 0; i < 9; i++) {
+        fields[i] = strtok_r(i == 0 ? line : NULL, "\t", &rest);
+        if (fields[i] == NULL) {
+            return -1;
+        }
+    }
+    snprintf(rec->code, sizeof(rec->code), "%s", fields[0]);
+    rec->timestamp = atol(fields[1]) / 1000;
+    snprintf(rec->geohash, sizeof(rec->geohash), "%s", fields[2]);
+    rec->humidity = atof(fields[3]);
+    rec->snow = atof(fields[4]);
+    rec->cloudcover = atof(fields[5]);
+    rec->lightning = atof(fields[6]);
+    rec->pressure = atof(fields[7]);
+    // convert the temp in 'K' to 'F'
+    rec->temperature = (atof(fields[8]) * 1.8) - 459.67;
+    return 0;
+}
+
+// whether a record passes --where, --within and --between
+int record_selected(const struct record_filter *filter, const struct record *rec) {
+    return (filter->snow < 0 || (rec->snow != 0) == filter->snow)
+        && (filter->lightning < 0 || (rec->lightning != 0) == filter->lightning)
+        && filter_match(filter, rec->timestamp, rec->geohash);
+}
+
+/* Reader thread of the block pipeline: reads the input in blocks of
+ * PIPE_BLOCK_SIZE, cuts each after its last newline (the partial line is
+ * carried into the next block) and queues the blocks for the parsers,
+ * waiting while PIPE_BLOCKS_PER_THREAD blocks per parser are in flight. */
+void *read_blocks(void *arg) {
+    struct parse_pipeline *pipeline = (struct parse_pipeline*) arg;
+    size_t carry_length = pipeline->prefix_length;
+    char *carry = (char*) malloc(carry_length + 1);
+    int eof = 0;
+
+    memcpy(carry, pipeline->prefix, carry_length);
+    while (!eof) {
+        struct parse_block *block;
+        char *text = (char*) malloc(carry_length + PIPE_BLOCK_SIZE + 1);
+        size_t length, end;
+
+        memcpy(text, carry, carry_length);
+        length = carry_length + fread(text + carry_length, 1, PIPE_BLOCK_SIZE, pipeline->file);
+        eof = length < carry_length + PIPE_BLOCK_SIZE;
+        for (end = length; end > 0 && !eof && text[end - 1] != '\n'; end--) {
+        }
+        // the partial last line, or the whole block if it holds no newline yet
+        carry_length = length - end;
+        carry = (char*) realloc(carry, carry_length + 1);
+        memcpy(carry, text + end, carry_length);
+        if (end == 0) {
+            free(text);
+            continue;
+        }
+        text[end] = '\0';
+
+        block = (struct parse_block*) calloc(1, sizeof(struct parse_block));
+        block->text = text;
+        block->length = end;
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->in_flight >= pipeline->max_in_flight) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        block->sequence = pipeline->num_blocks++;
+        if (pipeline->pending_tail != NULL) {
+            pipeline->pending_tail->next = block;
+        }
+        else {
+            pipeline->pending = block;
+        }
+        pipeline->pending_tail = block;
+        pipeline->in_flight++;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    free(carry);
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->failed |= ferror(pipeline->file) != 0;
+    pipeline->reading = 0;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/* Parses the lines of a block: into the block's own state summaries, or
+ * into records that the main thread adds in input order when record-level
+ * options need every record. */
+void parse_block(struct parse_pipeline *pipeline, struct parse_block *block) {
+    struct parse_batch batch;
+    struct record rec;
+    char *line = block->text, *end;
+    int capacity = 0;
+
+    batch.count = 0;
+    for (; line < block->text + block->length; line = end + 1) {
+        end = strchr(line, '\n');
+        if (end == NULL) {
+            end = block->text + block->length;
+        }
+        *end = '\0';
+        if (parse_line(line, &rec) != 0 || !record_selected(&options.filter, &rec)) {
+            continue;
+        }
+        if (pipeline->summaries) {
+            int state_index = get_state_index(block->states, rec.code);
+            block->states[state_index]->num_snowcover += rec.snow;
+            block->states[state_index]->num_lightning += rec.lightning;
+            add_record(block->states, state_index, &rec, &batch);
+            continue;
+        }
+        if (block->num_records == capacity) {
+            capacity = capacity == 0 ? 1024 : 2 * capacity;
+            block->records = (struct record*) realloc(block->records, capacity * sizeof(struct record));
+        }
+        block->records[block->num_records++] = rec;
+    }
+    flush_batch(&batch, block->states);
+    free(block->text);
+    block->text = NULL;
+}
+
+// parser thread of the block pipeline: parses queued blocks until the input ends
+void *parse_blocks(void *arg) {
+    struct parse_pipeline *pipeline = (struct parse_pipeline*) arg;
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->pending != NULL || pipeline->reading) {
+        struct parse_block *block = pipeline->pending;
+        if (block == NULL) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            continue;
+        }
+        pipeline->pending = block->next;
+        if (pipeline->pending == NULL) {
+            pipeline->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        parse_block(pipeline, block);
+
+        pthread_mutex_lock(&pipeline->lock);
+        block->next = pipeline->done;
+        pipeline->done = block;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/* Analyzes TDV input that cannot be seeked (standard input or a pipe),
+ * after `prefix` (bytes already read from it), in parallel: a reader thread
+ * cuts it into newline-aligned blocks that a pool of parser threads parses.
+ * Without record-level options each block is summarized on its own and the
+ * summaries are merged, in input order or with --unordered as the blocks
+ * finish; otherwise the parsed records are added here in input order.
+ * Returns 0 on success. */
+int analyze_stream(FILE *file, const char *prefix, size_t prefix_length, struct climate_info *states[]) {
+    struct parse_pipeline pipeline;
+    pthread_t reader, *parsers;
+    struct parse_batch batch;
+    unsigned long next = 0;
+    int i, started, num_parsers = num_threads();
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.file = file;
+    pipeline.prefix = prefix;
+    pipeline.prefix_length = prefix_length;
+    pipeline.summaries = !query_needs_records();
+    pipeline.max_in_flight = PIPE_BLOCKS_PER_THREAD * num_parsers;
+    pipeline.reading = 1;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    // the parsers first, so a reader is only started once something can take its blocks
+    parsers = (pthread_t*) malloc(num_parsers * sizeof(pthread_t));
+    for (started = 0; started < num_parsers; started++) {
+        if (pthread_create(&parsers[started], NULL, parse_blocks, &pipeline) != 0) {
+            break;
+        }
+    }
+    if (started == 0 || pthread_create(&reader, NULL, read_blocks, &pipeline) != 0) {
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.reading = 0;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+        for (i = 0; i < started; i++) {
+            pthread_join(parsers[i], NULL);
+        }
+        free(parsers);
+        pthread_mutex_destroy(&pipeline.lock);
+        pthread_cond_destroy(&pipeline.changed);
+        return -1;
+    }
+
+    batch.count = 0;
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.reading || next < pipeline.num_blocks) {
+        struct parse_block **link = &pipeline.done, *block;
+        // the next block in input order, or any finished one if unordered
+        while (*link != NULL && (*link)->sequence != next
+                && !(options.unordered && pipeline.summaries)) {
+            link = &(*link)->next;
+        }
+        if (*link == NULL) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+            continue;
+        }
+        block = *link;
+        *link = block->next;
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if (pipeline.summaries) {
+            for (i = 0; i < NUM_STATES && block->states[i] != NULL; i++) {
+                merge_climate_info(states[get_state_index(states, block->states[i]->code)], block->states[i]);
+                free(block->states[i]);
+            }
+        }
+        for (i = 0; i < block->num_records; i++) {
+            const struct record *rec = &block->records[i];
+            int state_index = get_state_index(states, (char*) rec->code);
+            states[state_index]->num_snowcover += rec->snow;
+            states[state_index]->num_lightning += rec->lightning;
+            add_record(states, state_index, rec, &batch);
+        }
+        free(block->records);
+        free(block);
+
+        pthread_mutex_lock(&pipeline.lock);
+        next++;
+        pipeline.in_flight--;
+        pthread_cond_broadcast(&pipeline.changed);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+    flush_batch(&batch, states);
+
+    pthread_join(reader, NULL);
+    for (i = 0; i < started; i++) {
+        pthread_join(parsers[i], NULL);
+    }
+    free(parsers);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    return pipeline.failed ? -1 : 0;
+}